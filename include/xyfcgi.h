@@ -5,7 +5,10 @@
 #include "xyfiber.h"
 #include "xystream.h"
 
-#include <unordered_map>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <string>
 #include <uv.h>
 
 class fcgi_message : public message {
@@ -14,7 +17,8 @@ public:
     enum message_type {
         FCGI_BEGIN_REQUEST = 1, FCGI_ABORT_REQUEST,
         FCGI_END_REQUEST, FCGI_PARAMS, FCGI_STDIN,
-        FCGI_STDOUT, FCGI_STDERR };
+        FCGI_STDOUT, FCGI_STDERR, FCGI_DATA,
+        FCGI_GET_VALUES, FCGI_GET_VALUES_RESULT, FCGI_UNKNOWN_TYPE };
 
     fcgi_message(message_type t, int requestId);
     fcgi_message(message_type t, int requestId, const char *data, int len);
@@ -25,7 +29,7 @@ public:
     inline unsigned int request_id() { return _request_id; }
     virtual void serialize(char *buf);
     virtual int serialize_size();
-    static P<fcgi_message> make_dummy(message_type t);
+    static P<fcgi_message> make_dummy(message_type t, int requestId = 0);
 
     class decoder : public ::decoder {
     public:
@@ -39,34 +43,125 @@ private:
     unsigned int _request_id;
 };
 
+class fcgi_pool {
+public:
+    fcgi_pool();
+    fcgi_pool(const fcgi_pool &) = delete;
+    bool acquire(P<stream> &strm, int &served);
+    void release(P<stream> strm, int served);
+    bool reusable(int served) const;
+    void clear();
+    inline void set_max_idle(int n) { _max_idle = n; }
+    inline void set_max_requests(int n) { _max_requests = n; }
+    inline void set_idle_timeout(int ms) { _idle_timeout = ms; }
+    inline int idle_count() const { return _idle.size(); }
+private:
+    struct idle_stream {
+        P<stream> strm;
+        int served;
+        uint64_t since;
+    };
+    std::vector<idle_stream> _idle;
+    int _max_idle, _max_requests, _idle_timeout;
+};
+
+class fcgi_mux;
+
 class fcgi_connection {
 public:
+    enum begin_flags { FCGI_KEEP_CONN = 1 };
+
     void set_env(const std::string &key, chunk val);
     chunk get_env(const std::string &key);
     void write(const char *data, int len);
     void write(const chunk &msg);
     chunk read();
+    inline void on_release(std::function<void(bool)> fn) { _on_release = std::move(fn); }
 
     fcgi_connection(P<stream> strm, int roleId);
+    fcgi_connection(P<stream> strm, int roleId, P<fcgi_pool> pool, int served,
+                    std::function<P<stream>()> reconnect = nullptr);
+    fcgi_connection(P<fcgi_mux> mux, int requestId, int roleId);
+    ~fcgi_connection();
 private:
     fcgi_connection(const fcgi_connection &);
 
     void flush_env();
-    std::unordered_map<std::string, chunk> _env;
-    bool _env_sent;
+    void flush_tx();
+    P<fcgi_message> first_record();
+    void begin(int roleId, bool keepConn);
+    char *put_records(char *buf, int type, const char *data, size_t len);
+    std::vector<std::pair<std::string, chunk>> _env;
+    bool _env_sent, _stdin_closed, _completed;
+    int _served, _request_id;
+    stream_buffer _tx;
     P<stream> _strm;
     P<fcgi_message::decoder> _decoder;
+    P<fcgi_pool> _pool;
+    P<fcgi_mux> _mux;
+    std::function<void(bool)> _on_release;
+    std::function<P<stream>()> _reconnect;
 };
 
-class fcgi_provider { 
+/*
+ * Carries many concurrent requests over one connection to applications
+ * advertising FCGI_MPXS_CONNS. A reader fiber routes incoming records to
+ * the fcgi_connection waiting on the matching request ID.
+ */
+class fcgi_mux : public std::enable_shared_from_this<fcgi_mux> {
 public:
-    virtual P<fcgi_connection> get_connection() = 0;
+    fcgi_mux(P<stream> strm, int maxRequests);
+    fcgi_mux(const fcgi_mux &) = delete;
+    P<fcgi_connection> open(int roleId);
+    P<fcgi_message> read(int requestId);
+    void close(int requestId, bool completed);
+    void retire();
+    inline const P<stream> &get_stream() const { return _strm; }
+    inline bool alive() const { return !_broken; }
+    inline bool full() const { return _free_ids.empty(); }
+    inline int active() const { return _slots.size() - _free_ids.size(); }
+    inline int capacity() const { return _slots.size(); }
+private:
+    enum slot_state { SLOT_FREE, SLOT_ACTIVE, SLOT_DRAINING };
+    struct slot {
+        slot_state state;
+        std::queue<P<fcgi_message>> inbox;
+        P<fiber> waiter;
+    };
+    void reader();
+    void shutdown();
+    P<stream> _strm;
+    P<fcgi_message::decoder> _decoder;
+    std::vector<slot> _slots;
+    std::vector<int> _free_ids;
+    bool _reading, _broken, _retired;
 };
 
-class tcp_fcgi_provider : public fcgi_provider { 
+class fcgi_provider {
 public:
+    fcgi_provider();
     virtual P<fcgi_connection> get_connection();
+    void set_multiplex(bool enable);
+    inline P<fcgi_pool> pool() const { return _pool; }
+protected:
+    virtual P<stream> connect() = 0;
+private:
+    enum mux_support { MUX_UNKNOWN, MUX_PROBING, MUX_SUPPORTED, MUX_UNSUPPORTED };
+    int probe_multiplex(const P<stream> &strm);
+    P<fcgi_pool> _pool;
+    std::vector<P<fcgi_mux>> _muxes;
+    std::vector<P<fiber>> _probe_waiters;
+    bool _mux_enabled;
+    mux_support _mux_support;
+    int _mux_capacity;
+    uint64_t _probe_after;
+};
+
+class tcp_fcgi_provider : public fcgi_provider {
+public:
     tcp_fcgi_provider(const std::string &hostip, int port);
+protected:
+    virtual P<stream> connect();
 private:
     std::string _hostip;
     int _port;
@@ -74,12 +169,58 @@ private:
 
 class unix_fcgi_provider : public fcgi_provider {
 public:
-    virtual P<fcgi_connection> get_connection();
     unix_fcgi_provider(const std::string &path);
     unix_fcgi_provider(const P<std::string> &path);
     inline const std::string &path() const { return _path; }
+protected:
+    virtual P<stream> connect();
 private:
     std::string _path;
 };
 
+/*
+ * Spawns and supervises local FastCGI workers such as php-cgi. Each worker
+ * gets a private listening UNIX socket as its stdin (FCGI_LISTENSOCK_FILENO)
+ * and serves one request at a time. Requests go to idle workers first; the
+ * pool grows up to maxWorkers while requests wait and shrinks back to
+ * minWorkers after idling. Crashed workers are replaced and each worker is
+ * recycled after serving max_requests requests.
+ */
+class managed_fcgi_provider : public fcgi_provider {
+public:
+    managed_fcgi_provider(const std::string &command, int minWorkers = 1, int maxWorkers = 4);
+    managed_fcgi_provider(std::vector<std::string> args, int minWorkers, int maxWorkers);
+    managed_fcgi_provider(const managed_fcgi_provider &) = delete;
+    ~managed_fcgi_provider();
+    virtual P<fcgi_connection> get_connection();
+    inline void set_max_requests(int n) { _max_requests = n; }
+    inline void set_idle_timeout(int ms) { _idle_timeout = ms; }
+    inline int waiting() const { return _waiters.size(); }
+    int worker_count() const;
+    int idle_count() const;
+protected:
+    virtual P<stream> connect();
+private:
+    struct worker {
+        managed_fcgi_provider *owner;
+        uv_process_t *proc;
+        std::string path;
+        int served;
+        bool busy, retiring;
+        uint64_t idle_since;
+    };
+    P<worker> acquire();
+    void spawn();
+    void retire(const P<worker> &w);
+    void release(const P<worker> &w, bool completed);
+    void replenish();
+    static void on_exit(uv_process_t *proc, int64_t status, int signo);
+    static void on_tick(uv_timer_t *timer);
+    std::vector<std::string> _args;
+    std::vector<P<worker>> _workers;
+    std::deque<P<fiber>> _waiters;
+    uv_timer_t *_timer;
+    int _min, _max, _max_requests, _idle_timeout, _seq;
+};
+
 #endif
\ No newline at end of file
@@ -6,9 +6,11 @@
 #include "xystream.h"
 #include "xyfcgi.h"
 
+#include <deque>
 #include <unordered_map>
 #include <uv.h>
 #include <vector>
+#include <functional>
 
 using http_header_map = std::unordered_map<std::string, chunk>;
 
@@ -95,11 +97,25 @@ private:
     bool _chunked;
 };
 
+/*
+ * What a transaction did, for completion hooks. Times are microseconds
+ * on the monotonic clock of uv_hrtime().
+ */
+struct http_transaction_stats {
+    int status;
+    uint64_t bytes; // Body put on the wire, after content encoding
+    uint64_t service_time; // From the request to finish()
+    uint64_t upstream_time; // Spent forwarding to an upstream
+    bool tls;
+};
+
 class http_transaction {
 public:
     const P<http_request> request;
     chunk postdata;
     const P<class http_connection> connection;
+    // Path parameters captured by router_service
+    std::unordered_map<std::string, std::string> params;
 
     http_transaction(P<class http_connection> conn,
                      P<http_request> req);
@@ -110,17 +126,24 @@ public:
     void forward_to(const std::string &hostname, int port);
     void forward_to(P<stream> strm);
     void forward_to(P<fcgi_connection> conn);
+    void forward_to(P<class http2_connection> upstream);
     void redirect_to(const std::string &dest);
     void display_error(int code);
     P<class websocket> accept_websocket();
+    P<class websocket> accept_websocket(const struct websocket_deflate &policy);
     P<http_response> get_response();
     P<http_response> get_response(int code);
     P<stream> upgrade(bool flush_resp = true);
 
     inline bool header_sent() const { return _headerSent; }
+    inline bool gzipped() const { return _gzip != nullptr; }
+    void capture(std::function<void(const char *, int)> sink);
     void write(const char *buf, int len);
     void write(const std::string &buf);
     void finish();
+    // Called at the end of finish(), in the order added
+    using completion_hook = std::function<void(http_transaction &, const http_transaction_stats &)>;
+    void on_complete(completion_hook hook);
 
     static const std::string SERVER_VERSION;
     static const std::string WEBSOCKET_MAGIC;
@@ -131,8 +154,12 @@ private:
     struct z_stream_s *_gzip;
     stream_buffer _tx_buffer;
     P<http_response> _response;
+    std::function<void(const char *, int)> _capture;
+    std::vector<completion_hook> _completion_hooks;
+    uint64_t _started, _upstream_time, _bytes_sent;
 
     void start_transfer(transfer_mode mode);
+    void compress(const char *buf, int len);
     void transfer(const char *buf, int len);
 };
 
@@ -147,12 +174,20 @@ public:
 class http_connection {
 public:
     http_connection(P<stream> strm, std::string pname);
+    virtual ~http_connection();
     virtual P<http_request> next_request();
     virtual P<stream> upgrade();
     virtual void invoke_service(const P<http_service> &svc, http_trx &tx);
     virtual bool keep_alive();
-    inline std::string peername() { return _peername; }
+    P<stream> accept_http2();
+    inline const std::string &peername() const { return _peername; }
     bool has_tls();
+protected:
+    // How http_transaction puts responses on the wire. Multiplexed
+    // protocols frame the body themselves instead of chunked coding.
+    virtual bool multiplexed() const;
+    virtual void write_response(const P<http_response> &resp, bool endStream);
+    virtual void end_response();
 private:
     bool _keep_alive, _upgraded;
     P<stream> _strm;
@@ -171,11 +206,15 @@ public:
     virtual void service_loop(P<http_connection> conn);
     void listen(const char *addr, int port);
     virtual void do_listen(int backlog);
+    // Serve HTTP/2 to clients asking for it (ALPN "h2" or h2c prior knowledge), off by default
+    inline void set_http2(bool enable) { _http2 = enable; }
+    inline bool http2() const { return _http2; }
 
     http_server(const http_server &) = delete;
     http_server &operator=(const http_server &) = delete;
 protected:
     uv_tcp_t *_server;
+    bool _http2;
 };
 
 class http_client {
@@ -187,6 +226,10 @@ public:
         return _tsfr_decoder && _tsfr_decoder->more();
     }
     inline bool reusable() const { return _reusable; }
+    // Upgrade the connection, offering permessage-deflate as described
+    P<class websocket> open_websocket(const P<http_request> &request);
+    P<class websocket> open_websocket(const P<http_request> &request,
+                                      const struct websocket_deflate &offer);
     virtual ~http_client();
 private:
     P<stream> _stream;
@@ -197,12 +240,24 @@ private:
 
 class websocket_frame : public message {
 public:
+    /*
+     * With maxPiece, data frames longer than that are not buffered whole
+     * but handed out in pieces of at most maxPiece bytes as they arrive:
+     * the first with the frame's opcode, the rest as continuations, FIN
+     * on the last one. maxPayloadLen only limits the frames kept whole.
+     */
     class decoder : public ::decoder {
     public:
-        explicit decoder(int maxPayloadLen);
+        explicit decoder(int maxPayloadLen, size_t maxPiece = 0);
         virtual bool decode(stream_buffer &stb);
     private:
+        bool decode_piece(stream_buffer &stb);
         int _max_payload;
+        size_t _max_piece;
+        uint64_t _remaining, _offset; // Of the frame being split
+        int _op;
+        char _mask[4];
+        bool _masked;
     };
 
     websocket_frame(int op, chunk payload);
@@ -211,32 +266,160 @@ public:
     inline bool fin() { return (_op & 0x80) > 0; }
     inline bool deflated() { return (_op & 0x40) > 0; }
     inline chunk payload() { return _payload; }
+    // Clients mask what they send, the payload is masked while serializing
+    inline void set_mask(const char *key) {
+        memcpy(_mask, key, 4);
+        _masked = true;
+    }
+    // Clear FIN, more frames of the message follow
+    inline void set_more(bool more) { _more = more; }
     virtual int serialize_size();
     virtual void serialize(char *buf);
 
+    // XOR buf with the 4-byte masking key, pos being its offset in the payload
+    static void apply_mask(char *buf, size_t len, const char *key, size_t pos = 0);
+
 private:
     int _op;
     chunk _payload;
+    char _mask[4];
+    bool _masked, _more;
+};
+
+/*
+ * permessage-deflate parameters (RFC 7692) from one side's point of view.
+ * As a server policy, window bits are upper limits and no_context_takeover
+ * is imposed on every connection; once negotiated, they describe one.
+ * zlib needs 1 << (window_bits + 2) plus 1 << (mem_level + 9) bytes to
+ * compress and about 1 << window_bits to decompress.
+ */
+struct websocket_deflate {
+    bool enabled;
+    int level, mem_level;
+    int tx_window_bits, rx_window_bits;
+    bool tx_no_context_takeover, rx_no_context_takeover;
+    websocket_deflate();
 };
 
-class websocket {
+/*
+ * One end of a WebSocket, from accept_websocket() on the server or
+ * http_client::open_websocket(). poll() and read() hand over whole messages;
+ * read_some() streams them instead, piece by piece as frames arrive, with
+ * deflated ones inflated a bounded amount at a time, until message_end().
+ * Outgoing messages are split into frames of at most the fragment size,
+ * and send_some() sends one in pieces, so neither direction has to hold a
+ * large message in memory. Messages go out one at a time: a fiber
+ * starting one waits while another fiber's is still being sent. Peers
+ * not heard from in a while are pinged, and given up on after the idle
+ * timeout, which wakes the reader with an error.
+ */
+class websocket : public std::enable_shared_from_this<websocket> {
 public:
     websocket(const P<stream> &strm, bool _deflate);
+    // The client end masks what it sends
+    websocket(const P<stream> &strm, const websocket_deflate &params, bool client = false);
     bool poll();
     chunk read();
+    chunk read_some();
+    inline bool message_end() const { return _msg_end; }
+    inline bool message_binary() const { return _msg_binary; }
     virtual ~websocket();
     virtual void send(const chunk &msg);
     void send(P<websocket_frame> frame);
+    void send_some(const chunk &piece, bool fin, bool binary = false);
+    inline void set_fragment_size(size_t size) { _fragment = size; }
+    // Longest message read() reassembles
+    inline void set_max_message(size_t size) { _max_message = size; }
+    // In milliseconds of silence from the peer, 0 disables either. The idle
+    // timeout only applies while reading, frames in the socket are not seen
+    void set_heartbeat(int pingInterval, int idleTimeout);
+    bool post(const chunk &frame, bool deflated, size_t limit);
+    void close();
+    inline bool alive() const { return _alive; }
+    inline bool deflate_enabled() const { return _deflate.enabled; }
+    inline const websocket_deflate &deflate_params() const { return _deflate; }
+
+    // What accept_websocket() agrees to unless given another policy
+    static websocket_deflate deflate_policy;
+    // Heartbeat of new websockets
+    static int default_ping_interval, default_idle_timeout;
+    // Bytes posted but not written yet
+    inline size_t queued() const { return _txq_bytes; }
 
 private:
+    friend class websocket_hub;
+    struct tx_entry {
+        chunk frame;
+        P<fiber> waiter;
+    };
+
     void cleanup();
-    void flush_writing();
+    void write_loop();
+    void fail_queue(int status);
+    struct z_stream_s *tx_zstream();
+    struct z_stream_s *rx_zstream();
+    void release_zstreams(bool tx, bool rx);
+    chunk inflate_some();
+    void send_piece(const chunk &piece, bool fin);
+    void send_fragment(const chunk &payload, bool fin);
+    void wait_turn();
+    void end_message();
+    void release_held();
+    void heartbeat();
+    void mask_frame(websocket_frame &frame);
     P<stream> _strm;
+    websocket_deflate _deflate;
     stream_buffer _reassembled;
     chunk _done;
-    bool _msg_deflated, _alive;
+    chunk _rx_input; // Payload being inflated
+    bool _msg_deflated, _msg_binary, _msg_end, _rx_fin, _rx_tail;
+    bool _alive, _writing;
+    int _tx_op; // Of the message being sent, -1 between messages
+    P<fiber> _tx_owner; // Sending that message
+    std::deque<P<fiber>> _tx_waiters; // To start a message after it
+    bool _tx_deflated;
+    stream_buffer _tx_pending; // Deflated, not framed yet
+    size_t _fragment, _max_message;
+    timer_wheel::entry _heartbeat;
+    uint64_t _last_rx; // Loop time of the last frame
+    int _ping_interval, _idle_timeout;
+    bool _client;
+    unsigned char _masks[256]; // Random keys to take from
+    size_t _mask_pos;
     struct z_stream_s *_tx_zs, *_rx_zs;
     P<websocket_frame::decoder> _decoder;
+    std::deque<tx_entry> _txq;
+    std::vector<std::pair<chunk, bool>> _held; // Posted during a fragmented message
+    size_t _txq_bytes;
+};
+
+/*
+ * Fans messages out to the websockets subscribed to a topic. A message is
+ * framed, and deflated for subscribers that negotiated compression, only
+ * once; every subscriber queues the same buffer and writes it on its own.
+ * Client websockets, which mask every frame, get a masked copy each.
+ * Subscribers whose queue is over the limit have the message dropped or
+ * get disconnected, so they cannot hold the others up.
+ */
+class websocket_hub {
+public:
+    enum slow_policy { DROP, DISCONNECT };
+    explicit websocket_hub(size_t maxQueued = 0x100000, slow_policy policy = DROP);
+    websocket_hub(const websocket_hub &) = delete;
+    ~websocket_hub();
+    void subscribe(const std::string &topic, const P<websocket> &ws);
+    void unsubscribe(const std::string &topic, const P<websocket> &ws);
+    void unsubscribe(const P<websocket> &ws);
+    int publish(const std::string &topic, const chunk &msg, bool binary = false);
+    size_t subscribers(const std::string &topic) const;
+    inline void set_max_queued(size_t nbytes) { _max_queued = nbytes; }
+    inline void set_slow_policy(slow_policy policy) { _policy = policy; }
+private:
+    std::unordered_map<std::string, std::vector<P<websocket>>> _topics;
+    size_t _max_queued;
+    slow_policy _policy;
+    struct z_stream_s *_zs;
+    int _zs_bits, _zs_level, _zs_mem_level; // What _zs was set up with
 };
 
 #endif
@@ -0,0 +1,188 @@
+#ifndef XYHTTPD_HTTP2_H
+#define XYHTTPD_HTTP2_H
+
+#include "xyhttp.h"
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using http2_header_list = std::vector<std::pair<std::string, std::string>>;
+
+/*
+ * HPACK dynamic table (RFC 7541). Indices start after the 61 static
+ * entries, newest entry first.
+ */
+class hpack_table {
+public:
+    explicit hpack_table(size_t maxSize = 4096);
+    void set_max_size(size_t maxSize);
+    inline size_t max_size() const { return _max; }
+    inline size_t size() const { return _size; }
+    bool get(size_t index, std::string &name, std::string &value) const;
+    size_t find(const std::string &name, const std::string &value, bool &exact) const;
+protected:
+    void add(const std::string &name, const std::string &value);
+    std::deque<std::pair<std::string, std::string>> _entries;
+    size_t _size, _max;
+};
+
+class hpack_encoder : public hpack_table {
+public:
+    explicit hpack_encoder(size_t maxSize = 4096);
+    void resize(size_t maxSize);
+    // Headers with volatile values should not be indexed
+    void encode(const std::string &name, const std::string &value,
+                std::string &out, bool index = true);
+private:
+    bool _resized;
+    size_t _smallest; // Smallest size since the last header block
+};
+
+class hpack_decoder : public hpack_table {
+public:
+    explicit hpack_decoder(size_t maxSize = 4096);
+    void decode(const char *buf, size_t len, http2_header_list &headers);
+private:
+    size_t _limit; // What we advertised, the peer may not go beyond it
+};
+
+class http2_frame : public message {
+public:
+    enum frame_type {
+        DATA, HEADERS, PRIORITY, RST_STREAM, SETTINGS,
+        PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION };
+    enum frame_flags {
+        END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4,
+        PADDED = 0x8, PRIORITY_INFO = 0x20 };
+
+    class decoder : public ::decoder {
+    public:
+        explicit decoder(int maxFrameSize = 16384);
+        virtual bool decode(stream_buffer &stb);
+    private:
+        int _max_frame;
+    };
+
+    http2_frame(int type, int flags, uint32_t streamId, chunk payload);
+    virtual ~http2_frame();
+    inline int type() const { return _type; }
+    inline int flags() const { return _flags; }
+    inline uint32_t stream_id() const { return _stream_id; }
+    inline const chunk &payload() const { return _payload; }
+    virtual int serialize_size();
+    virtual void serialize(char *buf);
+private:
+    int _type, _flags;
+    uint32_t _stream_id;
+    chunk _payload;
+};
+
+class http2_stream;
+
+/*
+ * An HTTP/2 connection (RFC 7540). On the server side it is reached through
+ * ALPN "h2" or a cleartext client sending the connection preface right away
+ * (h2c with prior knowledge), and every request stream is served as an
+ * http_transaction on its own fiber, so http_service implementations work
+ * as they do over HTTP/1.1. On the client side, open() starts talking h2c
+ * to a backend and http2_client sends requests over it, many at a time.
+ * Frames of all streams are queued and sent by one writer fiber, which
+ * coalesces them into few socket writes.
+ */
+class http2_connection : public std::enable_shared_from_this<http2_connection> {
+public:
+    http2_connection(P<stream> strm, std::string peername);
+    http2_connection(const http2_connection &) = delete;
+    ~http2_connection();
+    void serve(const P<http_service> &svc);
+    void open();
+    // Whether new requests can still be sent over a client connection
+    inline bool usable() const {
+        return _client && !_closing && !_goaway && _last_stream < 0x7ffffff0;
+    }
+    inline const std::string &peername() const { return _peername; }
+    inline int active_streams() const { return _streams.size(); }
+
+    static const std::string PREFACE;
+
+    // Matches the client connection preface. Without consuming, it only
+    // peeks, leaving HTTP/1.1 requests to their own decoder.
+    class preface_decoder : public ::decoder {
+    public:
+        explicit preface_decoder(bool consume);
+        virtual bool decode(stream_buffer &stb);
+        inline bool matched() const { return _matched; }
+    private:
+        bool _consume, _matched;
+    };
+private:
+    P<stream> _strm;
+    std::string _peername;
+    P<http_service> _service;
+    hpack_encoder _encoder;
+    hpack_decoder _decoder;
+    std::unordered_map<uint32_t, P<http2_stream>> _streams;
+    uint32_t _last_stream; // Highest stream opened by the peer, or by us as a client
+    uint32_t _peer_streams; // Peer's SETTINGS_MAX_CONCURRENT_STREAMS
+    int64_t _send_window; // Connection-level credit granted by the peer
+    int _recv_window, _recv_unacked; // Our credit, consumed bytes not returned yet
+    int _peer_window, _peer_frame; // Peer's SETTINGS for new streams and frames
+    std::string _header_block; // HEADERS awaiting their CONTINUATION frames
+    uint32_t _header_stream;
+    int _header_flags;
+    std::string _txq, _tx_spare;
+    P<fiber> _writer;
+    std::vector<P<fiber>> _tx_waiters; // Waiting for credit or queue space
+    uv_timer_t *_flush_timer;
+    int _idle_timeout;
+    bool _client, _writer_idle, _goaway, _closing;
+    friend class http2_stream;
+    friend class http2_client;
+
+    void start_session();
+    void read_loop();
+    void handle_frame(const P<http2_frame> &frame);
+    void handle_headers(uint32_t id, int flags, const std::string &block);
+    void handle_response(uint32_t id, int flags, const http2_header_list &headers);
+    void handle_settings(const P<http2_frame> &frame);
+    void run_stream(P<http2_stream> strm, P<http_request> req);
+    void close_stream(http2_stream &strm);
+    void reset_stream(http2_stream &strm, int code);
+    void refund(http2_stream *strm, size_t nbytes);
+    P<http2_stream> open_stream();
+    void send_headers(http2_stream &strm, const P<http_response> &resp, bool endStream);
+    void send_request(http2_stream &strm, const P<http_request> &req, bool endStream);
+    void queue_header_block(uint32_t id, const std::string &block, bool endStream);
+    void queue_frame(int type, int flags, uint32_t id, const char *payload, size_t len);
+    void queue_rst(uint32_t id, int code);
+    void queue_window_update(uint32_t id, int increment);
+    void wait_tx();
+    void wake_tx(int status);
+    void kick_writer();
+    void write_loop();
+    void shutdown();
+};
+
+/*
+ * One request over a client http2_connection, used like http_client:
+ * send() returns the response head, then read() the body while
+ * data_available(). Requests of different http2_client objects share the
+ * connection and its header compression state.
+ */
+class http2_client {
+public:
+    explicit http2_client(P<http2_connection> conn);
+    http2_client(const http2_client &) = delete;
+    P<http_response> send(const P<http_request> &request, const chunk &body = nullptr);
+    chunk read();
+    inline bool data_available() const { return _more; }
+    ~http2_client();
+private:
+    P<http2_connection> _conn;
+    P<http2_stream> _strm;
+    bool _more;
+};
+
+#endif
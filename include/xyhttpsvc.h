@@ -2,9 +2,18 @@
 #define XYHTTPD_HTTPSVC_H
 
 #include "xyhttp.h"
+#include "xyhttp2.h"
 #include "xyfcgi.h"
 #include <vector>
+#include <list>
+#include <functional>
+#include <memory>
 #include <ostream>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 
 class http_service_chain : public http_service {
 public:
@@ -42,6 +51,38 @@ private:
     std::vector<P<http_service>> _svcs;
 };
 
+/*
+ * Dispatches on the request path with a radix tree, so finding the route
+ * costs the length of the path, not the number of routes. A pattern is
+ * made of static text, ":name" segments capturing one path segment and a
+ * trailing "*name" capturing the rest; captures land in tx->params.
+ * Static text wins over a capture, a segment capture over the rest. An
+ * empty method matches any; a path matching only other methods gets 405.
+ * Requests matching nothing go to the default service, or are left to
+ * whatever follows in a service chain.
+ */
+class router_service : public http_service {
+public:
+    router_service();
+    ~router_service();
+    void add(const std::string &method, const std::string &pattern, P<http_service> svc);
+    inline void add(const std::string &pattern, P<http_service> svc) {
+        add(std::string(), pattern, std::move(svc));
+    }
+    template<typename _Tp, typename... _Args>
+    inline void route(const std::string &method, const std::string &pattern, _Args&&... __args) {
+        add(method, pattern, std::make_shared<_Tp>(std::forward<_Args>(__args)...));
+    }
+    // Everything at and below prefix, the rest of the path in params["*"]
+    void mount(const std::string &prefix, P<http_service> svc);
+    inline void set_default(P<http_service> svc) { _default = std::move(svc); }
+    virtual void serve(http_trx &tx);
+private:
+    struct node;
+    std::unique_ptr<node> _root;
+    P<http_service> _default;
+};
+
 class local_file_service : public http_service {
 public:
     explicit local_file_service(const std::string &docroot);
@@ -58,12 +99,109 @@ private:
     std::unordered_map<std::string, P<fcgi_provider>> _fcgi_providers;
 };
 
+/*
+ * A log file written by a background thread. The loop thread appends
+ * records to a lock-free ring, and the writer drains it in large writes
+ * every flush interval, or sooner once it is half full. Records that do
+ * not fit are dropped and counted instead of blocking the loop. reopen()
+ * has the writer open the file again, after it was rotated.
+ */
+class async_log {
+public:
+    explicit async_log(const std::string &path, int flushInterval = 1000,
+                       size_t capacity = 1 << 20);
+    async_log(const async_log &) = delete;
+    ~async_log();
+    // From the loop thread only
+    bool append(const char *data, size_t len);
+    void reopen();
+    inline uint64_t dropped() const { return _dropped; }
+    inline uint64_t written() const { return _written; }
+private:
+    std::string _path;
+    FILE *_file;
+    std::vector<char> _ring;
+    std::atomic<size_t> _head, _tail; // Bytes appended, bytes written
+    std::atomic<uint64_t> _dropped, _written;
+    std::atomic<bool> _reopen;
+    bool _stop;
+    int _interval;
+    std::mutex _lock;
+    std::condition_variable _wakeup;
+    std::thread _writer;
+
+    void write_loop();
+    void drain();
+};
+
 class logger_service : public http_service {
 public:
     explicit logger_service(std::ostream *os);
+    explicit logger_service(P<async_log> log);
     virtual void serve(http_trx &tx);
 private:
-    std::ostream &_os;
+    std::ostream *_os;
+    P<async_log> _log;
+    time_t _stamp;
+    char _label[32];
+
+    const char *time_label();
+};
+
+/*
+ * A completed request as access_log_format writes and reads it. Strings
+ * point into the transaction, or into the buffer it was read from.
+ */
+struct access_record {
+    uint64_t time; // Completion, microseconds since the epoch
+    int status;
+    bool tls;
+    uint64_t bytes, service_time, upstream_time; // Times in microseconds
+    const char *method, *peer, *host, *uri;
+    size_t method_len, peer_len, host_len, uri_len;
+};
+
+/*
+ * Layout of access log records. A text format is a line where $time,
+ * $peer, $scheme, $method, $host, $uri, $status, $bytes, $service_time
+ * and $upstream_time (in milliseconds) are substituted. "binary" is for
+ * fixed little-endian records of BINARY_HEADER bytes and the strings,
+ * written without formatting anything, which read() decodes offline.
+ */
+class access_log_format {
+public:
+    static const std::string DEFAULT;
+    static const size_t BINARY_HEADER = 40;
+    explicit access_log_format(const std::string &spec = DEFAULT);
+    inline bool binary() const { return _binary; }
+    size_t write(const access_record &rec, char *buf, size_t size);
+    // Bytes taken by the record at buf, 0 if it is not complete yet
+    static size_t read(const char *buf, size_t len, access_record &rec);
+private:
+    enum field_type {
+        LITERAL, TIME, PEER, SCHEME, METHOD, HOST, URI, STATUS, BYTES,
+        SERVICE_TIME, UPSTREAM_TIME };
+    std::vector<std::pair<field_type, std::string>> _fields;
+    bool _binary;
+    time_t _stamp;
+    char _label[32];
+};
+
+/*
+ * Logs requests once they are finished, with status, size and timing,
+ * unlike logger_service which sees them before they are served. It has to
+ * outlive the transactions it was given.
+ */
+class access_log_service : public http_service {
+public:
+    explicit access_log_service(P<async_log> log,
+                                const std::string &format = access_log_format::DEFAULT);
+    virtual void serve(http_trx &tx);
+private:
+    P<async_log> _log;
+    access_log_format _format;
+
+    void record(http_transaction &tx, const http_transaction_stats &stats);
 };
 
 class tls_filter_service : public http_service {
@@ -74,17 +212,26 @@ private:
     int _code;
 };
 
+/*
+ * Picks a service by the Host header: the exact name, else the most
+ * specific "*.domain" registered, which covers every name below domain,
+ * else the default. Names live in a trie of their labels taken from the
+ * right, searched in place without allocating. Changes build a new trie
+ * and swap it in, dispatching carries on with the one it started with.
+ */
 class host_dispatch_service : public http_service {
 public:
     host_dispatch_service();
     void register_host(const std::string &hostname, P<http_service> svc);
     void unregister_host(const std::string &hostname);
     void set_default(P<http_service> svc);
+    P<http_service> find(const char *host, size_t len) const;
     static std::string normalize_hostname(chunk hostname);
     virtual void serve(http_trx &tx);
 private:
-    P<http_service> _default;
-    std::unordered_map<std::string, P<http_service>> _svcmap;
+    struct table;
+    P<const table> _table;
+    void update(const std::function<void(table &)> &change);
 };
 
 class proxy_pass_service : public http_service {
@@ -92,17 +239,68 @@ public:
     proxy_pass_service();
     proxy_pass_service(const std::string &host, int port);
     virtual void serve(http_trx &tx);
-    virtual void append(P<ip_endpoint> ep);
-    virtual void append(const std::string &host, int port);
+    // With http2, the backend is spoken to in h2c (prior knowledge), over
+    // one multiplexed connection
+    virtual void append(P<ip_endpoint> ep, bool http2 = false);
+    virtual void append(const std::string &host, int port, bool http2 = false);
     inline P<ip_endpoint> &operator[](int i) {
         return _svcs.at(i);
     }
     inline int count() const {
         return _svcs.size();
     }
+    // Talk h2c to the backends added so far, or stop
+    inline void set_http2(bool enable) { _http2.assign(_svcs.size(), enable); }
+    inline bool http2(int i) const { return _http2.at(i); }
 private:
     std::vector<P<ip_endpoint>> _svcs;
+    std::vector<bool> _http2; // Per backend
+    std::vector<P<http2_connection>> _h2conns;
     int _cur;
+
+    P<http2_connection> http2_upstream(int i);
+};
+
+class cache_service : public http_service,
+                      public std::enable_shared_from_this<cache_service> {
+public:
+    explicit cache_service(P<http_service> upstream, size_t capacity = 0x4000000);
+    void set_forced_ttl(int ms);
+    void set_stale_ttl(int ms);
+    void set_pass_ttl(int ms);
+    void set_max_entry_size(size_t siz);
+    void purge();
+    inline size_t size() const { return _bytes; }
+    inline size_t count() const { return _index.size(); }
+    virtual void serve(http_trx &tx);
+private:
+    struct entry {
+        std::string key;
+        chunk head;
+        std::vector<chunk> body;
+        std::vector<std::string> vary;
+        size_t bytes;
+        uint64_t stored_at, fresh_until, stale_until;
+        bool pass, refreshing;
+    };
+    using lru_list = std::list<P<entry>>;
+
+    P<http_service> _upstream;
+    size_t _capacity, _bytes, _max_entry;
+    int _forced_ttl, _stale_ttl, _pass_ttl;
+    lru_list _lru;
+    std::unordered_map<std::string, lru_list::iterator> _index;
+    std::unordered_map<std::string, std::vector<P<fiber>>> _pending;
+
+    P<entry> lookup(const std::string &key);
+    std::string variant_key(const std::string &base, const P<entry> &ent,
+                            const P<http_request> &req);
+    void fetch(const std::string &base, http_trx &tx);
+    void wake(const std::string &base);
+    void store(const std::string &base, http_trx &tx, P<entry> ent);
+    void insert(P<entry> ent);
+    void refresh(const std::string &base, const P<entry> &stale, http_trx &tx);
+    void replay(http_trx &tx, const P<entry> &ent, const char *state);
 };
 
 class lambda_service : public http_service {
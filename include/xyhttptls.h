@@ -4,8 +4,38 @@
 #include "xyhttp.h"
 
 #include <unordered_map>
+#include <vector>
+#include <mutex>
 #include <openssl/ssl.h>
 
+/*
+ * Session ticket encryption keys shared by a set of TLS contexts. A new
+ * key is generated every rotation interval; tickets sealed with a retired
+ * key are still accepted (and renewed) during the grace window.
+ */
+class tls_ticket_keys {
+public:
+    explicit tls_ticket_keys(int rotateInterval = 3600, int graceWindow = 3600);
+    tls_ticket_keys(const tls_ticket_keys &) = delete;
+    ~tls_ticket_keys();
+    void rotate();
+    inline int key_count() const { return _keys.size(); }
+    int lookup(unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cctx,
+               unsigned char *hmacKey, int enc);
+private:
+    struct ticket_key {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+        uint64_t retired_at;
+    };
+    std::vector<ticket_key> _keys; // Current key first
+    std::mutex _lock; // Offloaded handshakes look keys up from worker threads
+    uv_timer_t *_timer;
+    uint64_t _grace;
+    void expire();
+};
+
 class tls_context {
 public:
     tls_context();
@@ -16,11 +46,64 @@ public:
     virtual void unregister_context(const std::string &hostname);
     virtual void use_certificate(const char *file);
     virtual void use_certificate(const char *file, const char *key);
+    void reload_certificates();
+    void set_session_cache(long size, long timeout);
+    void set_session_tickets(P<tls_ticket_keys> keys);
+    inline const P<tls_ticket_keys> &session_tickets() const { return _tickets; }
+    uint64_t session_hits() const;
+    uint64_t session_misses() const;
+    // Run server handshake steps on the libuv thread pool. SNI contexts
+    // should then be registered before serving.
+    inline void set_handshake_offload(bool enable) { _offload = enable; }
+    inline bool handshake_offload() const { return _offload; }
+    void set_ktls(bool enable);
+    inline bool ktls() const { return _ktls; }
+    void set_record_sizing(int smallRecord, size_t boostAfter = 0x100000, int idleTimeout = 1000);
+    void set_alpn_protocols(const std::vector<std::string> &protocols);
+    void set_ocsp_staple(const std::string &path, int refreshInterval = 3600);
+    void refresh_ocsp_staple();
     inline SSL_CTX *ctx() const { return _ctx; }
+    static tls_context *from(SSL_CTX *ctx);
 private:
+    struct sni_entry {
+        std::string name; // Wildcards are kept as their suffix, e.g. ".example.com"
+        tls_context *ctx;
+    };
+    struct cert_files {
+        int type; // Key type, one pair each
+        std::string file, key;
+    };
+
     SSL_CTX *_ctx;
     std::unordered_map<std::string, P<tls_context>> _others;
+    std::vector<sni_entry> _sni_exact, _sni_wildcard; // Sorted for lookups
+    std::vector<cert_files> _cert_files;
+    std::mutex _cert_lock; // Certificates and staples, used by offloaded handshakes
+    P<tls_ticket_keys> _tickets;
+    long _cache_size, _cache_timeout;
+    uint64_t _hits, _misses;
+    bool _offload, _ktls;
+    int _small_record, _record_idle;
+    size_t _record_boost;
+    struct ocsp_staple;
+    std::vector<P<ocsp_staple>> _ocsp;
+    std::string _ocsp_path, _ocsp_dir; // SNI contexts look their responses up in _ocsp_dir
+    int _ocsp_interval;
+    uv_timer_t *_ocsp_timer;
+    std::string _alpn; // Protocols in ALPN wire format, preferred first
+    std::unordered_map<std::string, SSL_SESSION *> _client_sessions;
     static int sni_callback(SSL *ssl, int *ad, void *arg);
+    static int alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                             const unsigned char *in, unsigned int inlen, void *arg);
+    static int new_session_callback(SSL *ssl, SSL_SESSION *sess);
+    static int ocsp_status_callback(SSL *ssl, void *arg);
+    int load_certificate(const std::string &file, const std::string &key);
+    tls_context *find_context(const char *name) const;
+    void rebuild_sni_index();
+    void apply_shared_settings(tls_context &sub);
+    void count_handshake(bool resumed);
+    SSL_SESSION *client_session(const std::string &peer);
+    friend class tls_stream;
 };
 
 class tls_stream : public tcp_stream {
@@ -31,18 +114,50 @@ public:
     virtual ~tls_stream();
 
     virtual void connect(const std::string &host, int port);
+    void set_server_name(const std::string &name);
     virtual void read(const P<decoder> &);
     virtual void write(const char *buf, int length);
+    virtual void sendfile(int fd, size_t offset, size_t length);
     virtual void accept(uv_stream_t *);
     virtual bool has_tls();
+    virtual std::string alpn_protocol();
+    inline bool ktls_active() const { return _ktls; }
 private:
+    // Ciphertext between the socket and OpenSSL. It keeps its capacity, so
+    // records are queued and sent without allocations of their own.
+    struct cipher_queue {
+        char *data = nullptr;
+        size_t head = 0, tail = 0, cap = 0;
+        inline size_t size() const { return tail - head; }
+        char *reserve(size_t nbytes);
+        void consume(size_t nbytes);
+        void swap(cipher_queue &other);
+        ~cipher_queue();
+    };
+
+    virtual char *_prepare_rx(size_t nbytes);
     virtual void _commit_rx(char *base, int nread);
     SSL *_ssl;
     BIO *_txbio, *_rxbio;
-    bool _handshake_ok, _chelo_recv;
+    cipher_queue _txq, _rxq, _tx_spare;
+    bool _handshake_ok, _handshaking, _chelo_recv, _offload, _want_ktls, _ktls;
+    int _small_record, _record_idle, _record_size;
+    size_t _record_boost, _tx_streak; // Bytes sent since the last idle period
+    uint64_t _last_tx;
+    // Fibers waiting for another one to finish the handshake or to receive
+    std::vector<P<fiber>> _handshake_waiters, _rx_waiters;
+    std::string _peer; // Session cache key for client connections
+    std::string _server_name;
+    std::string _alpn; // Negotiated application protocol
+    friend class tls_context;
 
+    static BIO *queue_bio(cipher_queue *q);
     void do_handshake();
+    void handshake_step();
+    int offload_handshake();
+    void flush_tx();
     bool handle_want(int r);
+    bool enable_ktls();
 };
 
 class https_server : public http_server {
@@ -86,11 +86,16 @@ public:
     virtual void accept(uv_stream_t *);
     virtual void read(const P<decoder> &dec);
     virtual void write(const char *buf, int length);
+    virtual void sendfile(int fd, size_t offset, size_t length);
     virtual bool has_tls();
+    virtual std::string alpn_protocol();
+    bool alive();
+    void cancel_read(int status);
     void write(const P<message> &msg);
     void write(const chunk &str);
     void shutdown();
     void set_timeout(int timeout);
+    inline int timeout() const { return _timeout; }
     virtual ~stream();
 
     template<class T>
@@ -100,6 +105,8 @@ public:
     }
 protected:
     int _do_read();
+    void copy_file(int fd, size_t offset, size_t length);
+    virtual char *_prepare_rx(size_t nbytes);
     virtual void _commit_rx(char *base, int nread);
     uv_stream_t *handle;
     uv_timer_t *_timeOuter;
@@ -111,6 +118,52 @@ private:
     stream(const stream &);
 };
 
+/*
+ * Coarse timeouts for many objects on one uv_timer_t: entries hang in the
+ * slot of the tick they are due, and every tick fires one slot. Scheduling
+ * and cancelling are O(1), and a tick costs the entries due then, however
+ * many are waiting. Entries due more than one turn ahead stay in their
+ * slot for the following turns. Callbacks run outside of any fiber.
+ */
+class timer_wheel {
+public:
+    class entry {
+    public:
+        entry();
+        entry(const entry &) = delete;
+        ~entry();
+        inline bool scheduled() const { return _next != nullptr; }
+        void cancel();
+        std::function<void()> callback;
+    private:
+        entry *_prev, *_next;
+        uint64_t _due; // Tick
+        timer_wheel *_wheel;
+        void unlink();
+        friend class timer_wheel;
+    };
+
+    explicit timer_wheel(int tickMs = 100, int slots = 1024);
+    timer_wheel(const timer_wheel &) = delete;
+    ~timer_wheel();
+    // Fire the entry after at least delayMs, rounded up to whole ticks
+    void schedule(entry &e, uint64_t delayMs);
+    inline size_t size() const { return _size; }
+    inline int tick_ms() const { return _tick_ms; }
+    // The wheel of the default loop
+    static timer_wheel &shared();
+private:
+    static void on_tick(uv_timer_t *timer);
+    void start();
+    void stop();
+    void link(entry &head, entry &e);
+    std::vector<entry> _slots; // List heads
+    uint64_t _tick;
+    size_t _size;
+    int _tick_ms;
+    uv_timer_t *_timer;
+};
+
 class ip_endpoint {
 public:
     ip_endpoint(struct sockaddr_storage *_sa);
@@ -1,8 +1,16 @@
+#include <algorithm>
 #include <cstring>
-#include <sstream>
 #include <iostream>
 #include <utility>
 #include "xyfcgi.h"
+#ifndef _WIN32
+# include <csignal>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+
+extern char **environ;
+#endif
 
 using namespace std;
 
@@ -55,59 +63,213 @@ int fcgi_message::serialize_size() {
 }
 
 chunk fcgi_connection::get_env(const std::string &key) {
-    return _env[key];
+    for(auto &kv : _env)
+        if(kv.first == key)
+            return kv.second;
+    return nullptr;
 }
 
-shared_ptr<fcgi_message> fcgi_message::make_dummy(fcgi_message::message_type t) {
-    return make_shared<fcgi_message>(t, 0);
+shared_ptr<fcgi_message> fcgi_message::make_dummy(fcgi_message::message_type t, int requestId) {
+    return make_shared<fcgi_message>(t, requestId);
 }
 
 fcgi_connection::fcgi_connection(P<stream> strm, int roleId)
-	: _strm(move(strm)), _env_sent(false), _decoder(make_shared<fcgi_message::decoder>()) {
-    unsigned char requestBegin[8] = { 0, (unsigned char)roleId, 0, 0, 0, 0, 0, 0};
-    _strm->write(make_shared<fcgi_message>(
-            fcgi_message::message_type::FCGI_BEGIN_REQUEST, 0, (char *)requestBegin, 8));
+    : fcgi_connection(move(strm), roleId, nullptr, 0) {}
+
+/**
+ * @param reconnect Given for a pooled connection, opens a new one if the
+ *                  application closed it while it was idle.
+ */
+fcgi_connection::fcgi_connection(P<stream> strm, int roleId, P<fcgi_pool> pool, int served,
+                                 function<P<stream>()> reconnect)
+    : _env_sent(false), _stdin_closed(false), _completed(false), _served(served),
+      _request_id(1), _strm(move(strm)), _decoder(make_shared<fcgi_message::decoder>()),
+      _reconnect(move(reconnect)) {
+    _env.reserve(32);
+    // Ask the application to keep the connection open only if it will be pooled
+    if(pool && pool->reusable(served + 1))
+        _pool = move(pool);
+    begin(roleId, (bool)_pool);
+}
+
+fcgi_connection::fcgi_connection(P<fcgi_mux> mux, int requestId, int roleId)
+    : _env_sent(false), _stdin_closed(false), _completed(false), _served(0),
+      _request_id(requestId), _strm(mux->get_stream()), _mux(move(mux)) {
+    _env.reserve(32);
+    begin(roleId, true); // Closing a multiplexed connection would abort other requests
+}
+
+/**
+ * Stage the BEGIN_REQUEST record. Nothing is sent until the parameters
+ * and the first STDIN records can go out in the same write.
+ */
+void fcgi_connection::begin(int roleId, bool keepConn) {
+    unsigned char requestBegin[8] = {
+            0, (unsigned char)roleId, (unsigned char)(keepConn ? FCGI_KEEP_CONN : 0),
+            0, 0, 0, 0, 0 };
+    put_records(_tx.prepare(16), fcgi_message::message_type::FCGI_BEGIN_REQUEST,
+                (char *)requestBegin, 8);
+    _tx.commit(16);
+}
+
+fcgi_connection::~fcgi_connection() {
+    if(_mux)
+        _mux->close(_request_id, _completed);
+    else if(_pool && _completed)
+        _pool->release(move(_strm), _served + 1);
+    if(_on_release)
+        _on_release(_completed);
 }
 
 void fcgi_connection::set_env(const string &key, chunk val) {
     if(_env_sent)
         throw RTERR("environment variables already sent");
     if(!val) return;
-    _env[key] = move(val);
+    for(auto &kv : _env) {
+        if(kv.first == key) {
+            kv.second = move(val);
+            return;
+        }
+    }
+    _env.emplace_back(key, move(val));
+}
+
+// Largest record content, kept a multiple of 8 so records stay aligned
+static const size_t FCGI_MAX_CONTENT = 0xFFF8;
+// Buffered STDIN records are sent once they reach this size
+static const size_t FCGI_TX_BATCH = 0x10000;
+
+static inline size_t length_bytes(size_t len) {
+    return len <= 127 ? 1 : 4;
 }
 
-static void append_length_bytes(stringstream &ss, int len) {
+static inline char *put_length(char *p, size_t len) {
     if(len <= 127)
-        ss.put(len);
+        *(p++) = len;
     else {
-        char buf[4];
-        buf[0] = 0x80 | ((len >> 24) & 0x7f);
-        buf[1] = (len >> 16) & 0xff;
-        buf[2] = (len >> 8) & 0xff;
-        buf[3] = len & 0xff;
-        ss.write(buf, 4);
+        *(p++) = 0x80 | ((len >> 24) & 0x7f);
+        *(p++) = (len >> 16) & 0xff;
+        *(p++) = (len >> 8) & 0xff;
+        *(p++) = len & 0xff;
+    }
+    return p;
+}
+
+static inline void put_header(char *p, int type, int requestId, size_t len) {
+    auto *hdr = (unsigned char *)p;
+    hdr[0] = 1; // FCGI_VERSION_1
+    hdr[1] = type;
+    hdr[2] = (requestId >> 8) & 0xff;
+    hdr[3] = requestId & 0xff;
+    hdr[4] = (len >> 8) & 0xff;
+    hdr[5] = len & 0xff;
+    hdr[6] = 0;
+    hdr[7] = 0;
+}
+
+static inline size_t records_size(size_t len) {
+    return len + 8 * ((len + FCGI_MAX_CONTENT - 1) / FCGI_MAX_CONTENT);
+}
+
+/**
+ * Encode data as a sequence of records of the given type.
+ * @param buf Destination with at least records_size(len) bytes.
+ * @return The address right after the last record written.
+ */
+char *fcgi_connection::put_records(char *buf, int type, const char *data, size_t len) {
+    do {
+        size_t n = min(len, FCGI_MAX_CONTENT);
+        put_header(buf, type, _request_id, n);
+        if(n) memcpy(buf + 8, data, n);
+        buf += 8 + n;
+        data += n;
+        len -= n;
+    } while(len > 0);
+    return buf;
+}
+
+void fcgi_connection::flush_tx() {
+    if(_tx.size() == 0) return;
+    _reconnect = nullptr; // The request no longer goes out in one piece to be replayed
+    _strm->write(_tx.data(), _tx.size());
+    _tx.pull(_tx.size());
+}
+
+/**
+ * Send the whole request over a reused connection and wait for the first
+ * record. The application may have closed the connection while it was
+ * idle, and the close may not have arrived when the pool handed it out.
+ * Then nothing was processed and the request is sent over a new one.
+ */
+P<fcgi_message> fcgi_connection::first_record() {
+    auto reconnect = move(_reconnect);
+    P<fcgi_message> msg;
+    try {
+        _strm->write(_tx.data(), _tx.size());
+        msg = _strm->read<fcgi_message>(_decoder);
+    }
+    catch(runtime_error &ex) {
+        if(_strm->alive())
+            throw; // Timed out, the request may be in progress
     }
+    if(!msg) {
+        _strm = reconnect();
+        _served = 0;
+        _decoder = make_shared<fcgi_message::decoder>();
+        _strm->write(_tx.data(), _tx.size());
+        msg = _strm->read<fcgi_message>(_decoder);
+    }
+    _tx.pull(_tx.size());
+    return msg;
 }
 
+/**
+ * Append the PARAMS stream and its empty terminator to the staged
+ * records. The stream is laid out in one pass and split into records in
+ * place, without intermediate copies.
+ */
 void fcgi_connection::flush_env() {
     if(_env_sent) return;
-    stringstream ss;
-    for(auto it = _env.cbegin(); it != _env.cend(); it++) {
-        if(!it->second) continue;
-        append_length_bytes(ss, it->first.size());
-        append_length_bytes(ss, it->second.size());
-        ss.write(it->first.data(), it->first.size());
-        ss.write(it->second.data(), it->second.size());
-    }
-    _strm->write(make_shared<fcgi_message>(
-            fcgi_message::message_type::FCGI_PARAMS, 0, ss.str().data(), ss.str().size()));
-    _strm->write(fcgi_message::make_dummy(fcgi_message::message_type::FCGI_PARAMS));
+    size_t paramsLen = 0;
+    for(auto &kv : _env)
+        paramsLen += length_bytes(kv.first.size()) + length_bytes(kv.second.size())
+                + kv.first.size() + kv.second.size();
+    size_t nrecords = (paramsLen + FCGI_MAX_CONTENT - 1) / FCGI_MAX_CONTENT;
+    size_t total = paramsLen + 8 * nrecords + 8;
+    char *base = _tx.prepare(total);
+    // Serialize past the space reserved for record headers, then move each
+    // record's content down behind its header. Sources never precede
+    // destinations, so the moves are safe.
+    char *body = base + 8 * nrecords, *p = body;
+    for(auto &kv : _env) {
+        p = put_length(p, kv.first.size());
+        p = put_length(p, kv.second.size());
+        memcpy(p, kv.first.data(), kv.first.size());
+        p += kv.first.size();
+        memcpy(p, kv.second.data(), kv.second.size());
+        p += kv.second.size();
+    }
+    p = base;
+    for(size_t i = 0; i < nrecords; i++) {
+        size_t n = min(paramsLen - i * FCGI_MAX_CONTENT, FCGI_MAX_CONTENT);
+        put_header(p, fcgi_message::message_type::FCGI_PARAMS, _request_id, n);
+        if(p + 8 != body + i * FCGI_MAX_CONTENT)
+            memmove(p + 8, body + i * FCGI_MAX_CONTENT, n);
+        p += 8 + n;
+    }
+    put_header(p, fcgi_message::message_type::FCGI_PARAMS, _request_id, 0);
+    _tx.commit(total);
     _env_sent = true;
 }
 
 void fcgi_connection::write(const char *data, int len) {
     flush_env();
-    _strm->write(make_shared<fcgi_message>(fcgi_message::message_type::FCGI_STDIN, 0, data, len));
+    if(len <= 0) return; // An empty STDIN record would end the stream
+    size_t size = records_size(len);
+    put_records(_tx.prepare(size), fcgi_message::message_type::FCGI_STDIN, data, len);
+    _tx.commit(size);
+    if(_tx.size() >= FCGI_TX_BATCH)
+        flush_tx();
 }
 
 void fcgi_connection::write(const chunk &msg) {
@@ -116,15 +278,29 @@ void fcgi_connection::write(const chunk &msg) {
 
 chunk fcgi_connection::read() {
     flush_env();
+    if(!_stdin_closed) {
+        put_header(_tx.prepare(8), fcgi_message::message_type::FCGI_STDIN, _request_id, 0);
+        _tx.commit(8);
+        _stdin_closed = true;
+    }
+    P<fcgi_message> msg;
+    if(_reconnect)
+        msg = first_record();
+    else
+        flush_tx();
     while(true) {
-        auto msg = _strm->read<fcgi_message>(_decoder);
+        if(!msg)
+            msg = _mux ? _mux->read(_request_id) : _strm->read<fcgi_message>(_decoder);
         switch(msg->msgtype()) {
             case fcgi_message::message_type::FCGI_STDOUT:
                 return msg->data();
             case fcgi_message::message_type::FCGI_STDERR:
                 cerr.write(msg->data().data(), msg->data().size());
+                msg.reset();
                 break;
             case fcgi_message::message_type::FCGI_END_REQUEST:
+                // protocolStatus must be FCGI_REQUEST_COMPLETE for reuse
+                _completed = msg->data().size() >= 5 && msg->data().data()[4] == 0;
                 return nullptr;
             default:
                 throw RTERR("FastCGI protocol error");
@@ -132,22 +308,548 @@ chunk fcgi_connection::read() {
     }
 }
 
+fcgi_pool::fcgi_pool() : _max_idle(8), _max_requests(1000), _idle_timeout(30000) {}
+
+/**
+ * Whether a connection that has served n requests may go back to the pool.
+ * @param served Request count including the current one.
+ */
+bool fcgi_pool::reusable(int served) const {
+    return _max_idle > 0 && (_max_requests <= 0 || served < _max_requests);
+}
+
+/**
+ * Take the most recently used idle stream that is still alive.
+ * @return false if there is no usable idle stream.
+ */
+bool fcgi_pool::acquire(P<stream> &strm, int &served) {
+    uint64_t now = uv_now(uv_default_loop());
+    while(!_idle.empty()) {
+        idle_stream ent = move(_idle.back());
+        _idle.pop_back();
+        if(_idle_timeout > 0 && now - ent.since >= (uint64_t)_idle_timeout)
+            continue;
+        if(ent.strm->alive()) {
+            strm = move(ent.strm);
+            served = ent.served;
+            return true;
+        }
+    }
+    return false;
+}
+
+void fcgi_pool::release(P<stream> strm, int served) {
+    if(!reusable(served) || !strm->alive())
+        return;
+    if(_idle.size() >= (size_t)_max_idle)
+        _idle.erase(_idle.begin()); // Evict the coldest one
+    _idle.push_back({ move(strm), served, uv_now(uv_default_loop()) });
+}
+
+void fcgi_pool::clear() {
+    _idle.clear();
+}
+
+fcgi_mux::fcgi_mux(P<stream> strm, int maxRequests)
+    : _strm(move(strm)), _decoder(make_shared<fcgi_message::decoder>()),
+      _slots(maxRequests), _reading(false), _broken(false), _retired(false) {
+    for(int i = maxRequests; i > 0; i--)
+        _free_ids.push_back(i);
+    for(auto &s : _slots)
+        s.state = SLOT_FREE;
+}
+
+P<fcgi_connection> fcgi_mux::open(int roleId) {
+    if(_broken || _free_ids.empty())
+        throw RTERR("FastCGI connection unavailable for multiplexing");
+    int requestId = _free_ids.back();
+    _free_ids.pop_back();
+    _slots[requestId - 1].state = SLOT_ACTIVE;
+    if(!_reading) {
+        _reading = true;
+        fiber::launch(bind(&fcgi_mux::reader, shared_from_this()));
+    }
+    return make_shared<fcgi_connection>(shared_from_this(), requestId, roleId);
+}
+
+void fcgi_mux::reader() {
+    try {
+        while(!_broken) {
+            auto msg = _strm->read<fcgi_message>(_decoder);
+            int requestId = msg->request_id();
+            if(requestId < 1 || requestId > (int)_slots.size())
+                continue; // Management records are not expected here
+            slot &s = _slots[requestId - 1];
+            if(s.state == SLOT_DRAINING) {
+                // Abandoned request, its ID is reusable once the application ends it
+                if(msg->msgtype() == fcgi_message::message_type::FCGI_END_REQUEST) {
+                    s.state = SLOT_FREE;
+                    _free_ids.push_back(requestId);
+                    if(_retired && active() == 0)
+                        _broken = true;
+                }
+                continue;
+            }
+            if(s.state != SLOT_ACTIVE)
+                continue;
+            s.inbox.push(move(msg));
+            if(s.waiter) {
+                P<fiber> f = move(s.waiter);
+                f->resume(0);
+            }
+        }
+    }
+    catch(runtime_error &ex) {
+        _broken = true;
+        for(auto &s : _slots) {
+            if(s.waiter) {
+                P<fiber> f = move(s.waiter);
+                f->raise(ex.what());
+            }
+        }
+    }
+    _reading = false;
+    _strm.reset(); // Nothing can be sent over a broken connection either
+}
+
+P<fcgi_message> fcgi_mux::read(int requestId) {
+    slot &s = _slots[requestId - 1];
+    while(s.inbox.empty()) {
+        if(_broken)
+            throw RTERR("FastCGI multiplexed connection lost");
+        fiber::preserve p(s.waiter);
+        fiber::yield();
+    }
+    P<fcgi_message> msg = move(s.inbox.front());
+    s.inbox.pop();
+    return msg;
+}
+
+void fcgi_mux::close(int requestId, bool completed) {
+    slot &s = _slots[requestId - 1];
+    s.inbox = queue<P<fcgi_message>>();
+    s.waiter.reset();
+    if(completed || _broken) {
+        s.state = SLOT_FREE;
+        _free_ids.push_back(requestId);
+    } else {
+        s.state = SLOT_DRAINING;
+    }
+    if(_retired && active() == 0)
+        shutdown();
+}
+
+/**
+ * Take no more requests and close the connection once those in flight end.
+ */
+void fcgi_mux::retire() {
+    _retired = true;
+    if(active() == 0)
+        shutdown();
+}
+
+void fcgi_mux::shutdown() {
+    if(_broken) return;
+    _broken = true;
+    if(_reading)
+        _strm->cancel_read(UV_ECANCELED); // The reader releases the stream
+    else
+        _strm.reset();
+}
+
+// Delay before asking again an application that failed to answer FCGI_GET_VALUES
+static const uint64_t FCGI_PROBE_RETRY = 30000;
+
+fcgi_provider::fcgi_provider()
+    : _pool(make_shared<fcgi_pool>()), _mux_enabled(false), _mux_support(MUX_UNKNOWN),
+      _mux_capacity(64), _probe_after(0) {}
+
+/**
+ * Multiplex concurrent requests over shared connections. The application
+ * is asked with FCGI_GET_VALUES first, and pooled connections are used if
+ * it does not advertise FCGI_MPXS_CONNS.
+ * @param enable Whether multiplexing should be attempted.
+ */
+void fcgi_provider::set_multiplex(bool enable) {
+    _mux_enabled = enable;
+    if(enable) return;
+    for(auto &mux : _muxes)
+        mux->retire();
+    _muxes.clear();
+}
+
+static int parse_fcgi_length(const unsigned char *&p, const unsigned char *end) {
+    if(p >= end) return -1;
+    if(*p < 0x80) return *(p++);
+    if(end - p < 4) return -1;
+    int len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    p += 4;
+    return len;
+}
+
+/**
+ * Query FCGI_MPXS_CONNS and FCGI_MAX_REQS of the application.
+ * @return Maximum concurrent requests per connection, 0 if not multiplexed.
+ */
+int fcgi_provider::probe_multiplex(const P<stream> &strm) {
+    static const char query[] = "\x0f\x00" "FCGI_MPXS_CONNS" "\x0d\x00" "FCGI_MAX_REQS";
+    strm->write(make_shared<fcgi_message>(
+            fcgi_message::message_type::FCGI_GET_VALUES, 0, query, sizeof(query) - 1));
+    int oldTimeout = strm->timeout();
+    strm->set_timeout(2000);
+    auto msg = strm->read<fcgi_message>(make_shared<fcgi_message::decoder>());
+    strm->set_timeout(oldTimeout);
+    if(msg->msgtype() != fcgi_message::message_type::FCGI_GET_VALUES_RESULT)
+        return 0;
+    bool mpxs = false;
+    int maxReqs = 64;
+    auto p = (const unsigned char *)msg->data().data();
+    auto end = p + msg->data().size();
+    while(p < end) {
+        int nameLen = parse_fcgi_length(p, end);
+        int valueLen = parse_fcgi_length(p, end);
+        if(nameLen < 0 || valueLen < 0 || end - p < nameLen + valueLen)
+            break;
+        string name((const char *)p, nameLen), value((const char *)p + nameLen, valueLen);
+        p += nameLen + valueLen;
+        if(name == "FCGI_MPXS_CONNS")
+            mpxs = value == "1";
+        else if(name == "FCGI_MAX_REQS" && atoi(value.c_str()) > 0)
+            maxReqs = min(atoi(value.c_str()), 256);
+    }
+    return mpxs ? maxReqs : 0;
+}
+
+P<fcgi_connection> fcgi_provider::get_connection() {
+    while(_mux_enabled && _mux_support == MUX_PROBING) {
+        _probe_waiters.push_back(fiber::current());
+        fiber::yield();
+    }
+    if(_mux_enabled && _mux_support == MUX_UNKNOWN && uv_now(uv_default_loop()) >= _probe_after) {
+        P<stream> strm;
+        int maxReqs = 0;
+        _mux_support = MUX_PROBING;
+        try {
+            strm = connect();
+            maxReqs = probe_multiplex(strm);
+            _mux_support = maxReqs > 0 ? MUX_SUPPORTED : MUX_UNSUPPORTED;
+        }
+        catch(runtime_error &ex) {
+            // Unreachable, or the connection dropped without an answer
+            _mux_support = MUX_UNKNOWN;
+            _probe_after = uv_now(uv_default_loop()) + FCGI_PROBE_RETRY;
+        }
+        if(maxReqs > 0) {
+            _mux_capacity = maxReqs;
+            _muxes.push_back(make_shared<fcgi_mux>(strm, maxReqs));
+        }
+        // Some applications (e.g. PHP-FPM) close the connection after FCGI_GET_VALUES
+        auto waiters = move(_probe_waiters);
+        for(auto &f : waiters)
+            f->resume(0);
+    }
+    if(_mux_enabled && _mux_support == MUX_SUPPORTED) {
+        // New requests go to the last mux, older ones close once their requests end
+        _muxes.erase(remove_if(_muxes.begin(), _muxes.end(),
+                               [](const P<fcgi_mux> &mux) { return !mux->alive(); }), _muxes.end());
+        if(!_muxes.empty() && !_muxes.back()->full())
+            return _muxes.back()->open(1);
+        if(!_muxes.empty())
+            _muxes.back()->retire();
+        auto mux = make_shared<fcgi_mux>(connect(), _mux_capacity);
+        _muxes.push_back(mux);
+        return mux->open(1);
+    }
+    P<stream> strm;
+    int served;
+    if(_pool->acquire(strm, served))
+        return make_shared<fcgi_connection>(move(strm), 1, _pool, served,
+                                            [this] () { return connect(); });
+    return make_shared<fcgi_connection>(connect(), 1, _pool, 0);
+}
+
 tcp_fcgi_provider::tcp_fcgi_provider(const string &host, int port)
 	: _hostip(host), _port(port) {}
 
-shared_ptr<fcgi_connection> tcp_fcgi_provider::get_connection()
+P<stream> tcp_fcgi_provider::connect()
 {
     auto strm = make_shared<tcp_stream>();
     strm->connect(_hostip, _port);
-    return make_shared<fcgi_connection>(strm, 1);
+    return strm;
 }
 
 unix_fcgi_provider::unix_fcgi_provider(const string &p)
     : _path(p) {}
 
-shared_ptr<fcgi_connection> unix_fcgi_provider::get_connection()
+P<stream> unix_fcgi_provider::connect()
 {
     auto strm = make_shared<unix_stream>();
     strm->connect(_path);
-    return make_shared<fcgi_connection>(strm, 1);
+    return strm;
+}
+
+managed_fcgi_provider::managed_fcgi_provider(const string &command, int minWorkers, int maxWorkers)
+    : managed_fcgi_provider(vector<string>(), minWorkers, maxWorkers) {
+    size_t pos = 0;
+    while(pos < command.size()) {
+        size_t next = command.find(' ', pos);
+        if(next == string::npos) next = command.size();
+        if(next > pos)
+            _args.push_back(command.substr(pos, next - pos));
+        pos = next + 1;
+    }
+    if(_args.empty())
+        throw RTERR("FastCGI worker command is empty");
+    replenish();
+}
+
+managed_fcgi_provider::managed_fcgi_provider(vector<string> args, int minWorkers, int maxWorkers)
+    : _args(move(args)), _min(max(minWorkers, 0)), _max(max(maxWorkers, max(minWorkers, 1))),
+      _max_requests(500), _idle_timeout(10000), _seq(0) {
+    _timer = mem_alloc<uv_timer_t>();
+    if(uv_timer_init(uv_default_loop(), _timer) < 0) {
+        free(_timer);
+        throw bad_alloc();
+    }
+    _timer->data = this;
+    uv_timer_start(_timer, on_tick, 1000, 1000);
+    uv_unref((uv_handle_t *)_timer); // Workers are supervised, never waited for
+    if(!_args.empty())
+        replenish();
+}
+
+managed_fcgi_provider::~managed_fcgi_provider() {
+    uv_close((uv_handle_t *)_timer, (uv_close_cb) free);
+    for(auto &w : _workers) {
+        w->owner = nullptr;
+        if(w->proc) {
+            w->proc->data = nullptr;
+#ifndef _WIN32
+            uv_process_kill(w->proc, SIGTERM);
+            unlink(w->path.c_str());
+#endif
+        }
+    }
+}
+
+int managed_fcgi_provider::worker_count() const {
+    int n = 0;
+    for(auto &w : _workers)
+        if(!w->retiring) n++;
+    return n;
+}
+
+int managed_fcgi_provider::idle_count() const {
+    int n = 0;
+    for(auto &w : _workers)
+        if(!w->retiring && !w->busy) n++;
+    return n;
+}
+
+P<stream> managed_fcgi_provider::connect() {
+    throw RTERR("managed FastCGI workers are dispatched by get_connection()");
+}
+
+/**
+ * Dispatch to the most recently used idle worker, spawning another one or
+ * waiting in line when all workers are busy.
+ */
+P<fcgi_connection> managed_fcgi_provider::get_connection() {
+    P<worker> w;
+    bool requeue = false;
+    while(!(w = acquire())) {
+        if(worker_count() < _max) {
+            spawn();
+            continue;
+        }
+        // Keep our place in the queue if another request took the worker first
+        if(requeue)
+            _waiters.push_front(fiber::current());
+        else
+            _waiters.push_back(fiber::current());
+        fiber::yield();
+        requeue = true;
+    }
+    w->busy = true;
+    auto strm = make_shared<unix_stream>();
+    try {
+        strm->connect(w->path);
+    }
+    catch(runtime_error &ex) {
+        release(w, false);
+        throw;
+    }
+    auto conn = make_shared<fcgi_connection>(strm, 1);
+    conn->on_release([w] (bool completed) {
+        if(w->owner) w->owner->release(w, completed);
+    });
+    return conn;
+}
+
+P<managed_fcgi_provider::worker> managed_fcgi_provider::acquire() {
+    P<worker> best;
+    for(auto &w : _workers) {
+        if(w->busy || w->retiring || !w->proc)
+            continue;
+        if(!best || w->idle_since > best->idle_since)
+            best = w;
+    }
+    return best;
+}
+
+void managed_fcgi_provider::release(const P<worker> &w, bool completed) {
+    w->busy = false;
+    if(completed)
+        w->served++;
+    w->idle_since = uv_now(uv_default_loop());
+    if(_max_requests > 0 && w->served >= _max_requests)
+        retire(w);
+    try {
+        replenish();
+    }
+    catch(runtime_error &ex) {
+        cerr << ex.what() << endl;
+    }
+    if(!_waiters.empty()) {
+        P<fiber> f = move(_waiters.front());
+        _waiters.pop_front();
+        f->resume(0);
+    }
+}
+
+void managed_fcgi_provider::retire(const P<worker> &w) {
+    if(w->retiring) return;
+    w->retiring = true;
+#ifndef _WIN32
+    if(w->proc)
+        uv_process_kill(w->proc, SIGTERM);
+#endif
+}
+
+void managed_fcgi_provider::replenish() {
+    while(worker_count() < _min)
+        spawn();
+}
+
+void managed_fcgi_provider::spawn() {
+#ifdef _WIN32
+    throw RTERR("managed FastCGI workers require UNIX domain sockets");
+#else
+    auto w = make_shared<worker>();
+    char tmpdir[256];
+    size_t tmplen = sizeof(tmpdir);
+    if(uv_os_tmpdir(tmpdir, &tmplen) < 0)
+        strcpy(tmpdir, "/tmp");
+    w->path = fmt("%s/xyhttpd-fcgi-%d-%d.sock", tmpdir, getpid(), ++_seq);
+    sockaddr_un addr;
+    if(w->path.size() >= sizeof(addr.sun_path))
+        throw RTERR("FastCGI worker socket path too long: %s", w->path.c_str());
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, w->path.c_str());
+    // The worker inherits the listening socket, so it is ready before exec
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        throw RTERR("socket: %s", strerror(errno));
+    unlink(w->path.c_str());
+    if(::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        int err = errno;
+        close(fd);
+        throw RTERR("cannot listen on %s: %s", w->path.c_str(), strerror(err));
+    }
+
+    vector<string> envs;
+    for(char **e = environ; *e; e++) {
+        if(strncmp(*e, "PHP_FCGI_CHILDREN=", 18) && strncmp(*e, "PHP_FCGI_MAX_REQUESTS=", 22))
+            envs.emplace_back(*e);
+    }
+    // One process per worker, recycling is left to us
+    envs.push_back("PHP_FCGI_CHILDREN=0");
+    envs.push_back("PHP_FCGI_MAX_REQUESTS=0");
+    vector<char *> argv, envp;
+    for(auto &a : _args) argv.push_back((char *)a.c_str());
+    argv.push_back(nullptr);
+    for(auto &e : envs) envp.push_back((char *)e.c_str());
+    envp.push_back(nullptr);
+
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_INHERIT_FD;
+    stdio[0].data.fd = fd;
+    stdio[1].flags = UV_IGNORE;
+    stdio[2].flags = UV_INHERIT_FD;
+    stdio[2].data.fd = 2;
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.exit_cb = on_exit;
+    options.file = argv[0];
+    options.args = argv.data();
+    options.env = envp.data();
+    options.stdio_count = 3;
+    options.stdio = stdio;
+
+    w->proc = mem_alloc<uv_process_t>();
+    w->proc->data = nullptr;
+    int r = uv_spawn(uv_default_loop(), w->proc, &options);
+    close(fd);
+    if(r < 0) {
+        uv_close((uv_handle_t *)w->proc, (uv_close_cb) free);
+        unlink(w->path.c_str());
+        throw RTERR("cannot spawn FastCGI worker %s: %s", argv[0], uv_strerror(r));
+    }
+    uv_unref((uv_handle_t *)w->proc);
+    w->proc->data = w.get();
+    w->owner = this;
+    w->served = 0;
+    w->busy = w->retiring = false;
+    w->idle_since = uv_now(uv_default_loop());
+    _workers.push_back(move(w));
+#endif
+}
+
+void managed_fcgi_provider::on_exit(uv_process_t *proc, int64_t status, int signo) {
+    auto *wp = (worker *)proc->data;
+    uv_close((uv_handle_t *)proc, (uv_close_cb) free);
+    if(!wp) return;
+    wp->proc = nullptr;
+#ifndef _WIN32
+    unlink(wp->path.c_str());
+#endif
+    managed_fcgi_provider *self = wp->owner;
+    if(!self) return;
+    if(!wp->retiring)
+        cerr << fmt("FastCGI worker %s exited (status %d, signal %d)",
+                    self->_args[0].c_str(), (int)status, signo) << endl;
+    for(auto it = self->_workers.begin(); it != self->_workers.end(); it++) {
+        if(it->get() == wp) {
+            wp->owner = nullptr; // Its request in flight, if any, is not handed back
+            self->_workers.erase(it);
+            break;
+        }
+    }
+    // Crashed workers come back on the next tick, so a worker that dies on
+    // startup cannot spin the loop. Queued requests may spawn one right away.
+    if(!self->_waiters.empty()) {
+        P<fiber> f = move(self->_waiters.front());
+        self->_waiters.pop_front();
+        f->resume(0);
+    }
+}
+
+void managed_fcgi_provider::on_tick(uv_timer_t *timer) {
+    auto *self = (managed_fcgi_provider *)timer->data;
+    uint64_t now = uv_now(uv_default_loop());
+    int surplus = self->worker_count() - self->_min;
+    for(size_t i = 0; i < self->_workers.size() && surplus > 0; i++) {
+        auto w = self->_workers[i];
+        if(w->busy || w->retiring || now - w->idle_since < (uint64_t)self->_idle_timeout)
+            continue;
+        self->retire(w);
+        surplus--;
+    }
+    try {
+        self->replenish();
+    }
+    catch(runtime_error &ex) {
+        cerr << ex.what() << endl;
+    }
 }
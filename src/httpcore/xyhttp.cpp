@@ -2,6 +2,7 @@
 #include <cstring>
 
 #include "xyhttp.h"
+#include "xyhttp2.h"
 
 using namespace std;
 
@@ -9,6 +10,8 @@ http_connection::http_connection(P<stream> strm, string pname)
     : _reqdec(make_shared<http_request::decoder>()), _strm(strm),
       _keep_alive(true), _upgraded(false), _peername(pname) {}
 
+http_connection::~http_connection() = default;
+
 P<http_request> http_connection::next_request() {
     try {
         P<http_request> _req = _strm->read<http_request>(_reqdec);
@@ -38,6 +41,39 @@ shared_ptr<stream> http_connection::upgrade() {
     return _strm;
 }
 
+/**
+ * Hand the stream over to HTTP/2 if the client negotiated "h2" with ALPN
+ * or opened with the HTTP/2 connection preface (h2c prior knowledge).
+ * @return The stream, or nullptr to go on with HTTP/1.1.
+ */
+P<stream> http_connection::accept_http2() {
+    try {
+        if(_strm->alpn_protocol() != "h2") {
+            auto preface = make_shared<http2_connection::preface_decoder>(false);
+            _strm->read(preface);
+            if(!preface->matched())
+                return nullptr;
+        }
+    }
+    catch(exception &ex) {
+        _keep_alive = false;
+        _strm.reset();
+        return nullptr;
+    }
+    _upgraded = true;
+    return _strm;
+}
+
+bool http_connection::multiplexed() const {
+    return false;
+}
+
+void http_connection::write_response(const P<http_response> &resp, bool) {
+    _strm->write(resp);
+}
+
+void http_connection::end_response() {}
+
 void http_connection::invoke_service(const P<http_service> &svc, http_trx &tx) {
     try {
         if(!tx->request->header("host")) {
@@ -88,7 +124,7 @@ bool http_connection::has_tls() {
     return _strm->has_tls();
 }
 
-http_server::http_server(shared_ptr<http_service> svc) : service(svc) {
+http_server::http_server(shared_ptr<http_service> svc) : service(svc), _http2(false) {
     _server = mem_alloc<uv_tcp_t>();
     if(uv_tcp_init(uv_default_loop(), _server) < 0) {
         free(_server);
@@ -123,6 +159,11 @@ static void http_server_on_connection(uv_stream_t* strm, int status) {
 }
 
 void http_server::service_loop(P<http_connection> conn) {
+    P<stream> h2strm = _http2 ? conn->accept_http2() : nullptr;
+    if(h2strm) {
+        make_shared<http2_connection>(move(h2strm), conn->peername())->serve(service);
+        return;
+    }
     while(conn->keep_alive()) {
         shared_ptr<http_request> request = conn->next_request();
         if(!request) break;
@@ -0,0 +1,1362 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "xyhttp2.h"
+
+using namespace std;
+
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_INTERNAL_ERROR       0x2
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_CANCEL               0x8
+#define H2_COMPRESSION_ERROR    0x9
+
+#define H2_MAX_STREAMS      128
+#define H2_STREAM_WINDOW    0x40000  // Receive credit per stream
+#define H2_CONN_WINDOW      0x100000 // Receive credit for all streams together
+#define H2_TX_HIGH_WATER    0x40000  // Queued bytes before writers have to wait
+#define H2_MAX_HEADER_BLOCK 0x10000
+#define H2_MAX_BODY         0x800000 // Same limit as http_transaction
+
+/****** HPACK ******/
+
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const char *const hpack_static[61][2] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" },
+    { ":status", "200" }, { ":status", "204" }, { ":status", "206" }, { ":status", "304" },
+    { ":status", "400" }, { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" }, { "accept-language", "" }, { "accept-ranges", "" },
+    { "accept", "" }, { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+    { "authorization", "" }, { "cache-control", "" }, { "content-disposition", "" },
+    { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" },
+    { "cookie", "" }, { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" },
+    { "last-modified", "" }, { "link", "" }, { "location", "" }, { "max-forwards", "" },
+    { "proxy-authenticate", "" }, { "proxy-authorization", "" }, { "range", "" },
+    { "referer", "" }, { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+    { "set-cookie", "" }, { "strict-transport-security", "" }, { "transfer-encoding", "" },
+    { "user-agent", "" }, { "vary", "" }, { "via", "" }, { "www-authenticate", "" },
+};
+
+// Decoding tree built from the code table, leaves hold -(symbol + 1)
+struct huffman_tree {
+    int16_t child[256][2];
+
+    huffman_tree() {
+        int nodes = 1;
+        memset(child, 0, sizeof(child));
+        for(int sym = 0; sym < 257; sym++) {
+            int node = 0;
+            for(int i = huffman_lengths[sym] - 1; i > 0; i--) {
+                int bit = (huffman_codes[sym] >> i) & 1;
+                if(!child[node][bit])
+                    child[node][bit] = nodes++;
+                node = child[node][bit];
+            }
+            child[node][huffman_codes[sym] & 1] = -(sym + 1);
+        }
+    }
+
+    static const huffman_tree &get() {
+        static huffman_tree tree;
+        return tree;
+    }
+};
+
+static bool huffman_decode(const unsigned char *p, size_t len, string &out) {
+    const huffman_tree &tree = huffman_tree::get();
+    int node = 0, depth = 0;
+    bool ones = true;
+    for(size_t i = 0; i < len; i++) {
+        for(int shift = 7; shift >= 0; shift--) {
+            int bit = (p[i] >> shift) & 1;
+            int next = tree.child[node][bit];
+            depth++;
+            ones = ones && bit;
+            if(next < 0) {
+                if(next == -257) // EOS must not appear in strings
+                    return false;
+                out.push_back((char)(-next - 1));
+                node = depth = 0;
+                ones = true;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // Padding is a prefix of EOS, i.e. up to 7 one bits
+    return depth < 8 && ones;
+}
+
+static void huffman_encode(const string &str, string &out) {
+    uint64_t bits = 0;
+    int nbits = 0;
+    for(unsigned char c : str) {
+        bits = (bits << huffman_lengths[c]) | huffman_codes[c];
+        nbits += huffman_lengths[c];
+        while(nbits >= 8) {
+            nbits -= 8;
+            out.push_back((char)(bits >> nbits));
+        }
+    }
+    if(nbits > 0)
+        out.push_back((char)((bits << (8 - nbits)) | (0xff >> nbits)));
+}
+
+static size_t huffman_size(const string &str) {
+    size_t nbits = 0;
+    for(unsigned char c : str)
+        nbits += huffman_lengths[c];
+    return (nbits + 7) / 8;
+}
+
+static void hpack_put_int(string &out, int prefix, int flags, size_t value) {
+    size_t limit = (1 << prefix) - 1;
+    if(value < limit) {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | limit));
+    for(value -= limit; value >= 0x80; value >>= 7)
+        out.push_back((char)((value & 0x7f) | 0x80));
+    out.push_back((char)value);
+}
+
+static size_t hpack_get_int(const unsigned char *&p, const unsigned char *end, int prefix) {
+    size_t limit = (1 << prefix) - 1;
+    size_t value = *p++ & limit;
+    if(value < limit)
+        return value;
+    for(int shift = 0; shift < 28; shift += 7) {
+        if(p >= end)
+            break;
+        unsigned char c = *p++;
+        value += (size_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return value;
+    }
+    throw runtime_error("malformed HPACK integer");
+}
+
+static void hpack_put_string(string &out, const string &str) {
+    size_t huffmanLen = huffman_size(str);
+    if(huffmanLen < str.size()) {
+        hpack_put_int(out, 7, 0x80, huffmanLen);
+        huffman_encode(str, out);
+    } else {
+        hpack_put_int(out, 7, 0, str.size());
+        out.append(str);
+    }
+}
+
+static void hpack_get_string(const unsigned char *&p, const unsigned char *end, string &out) {
+    if(p >= end)
+        throw runtime_error("truncated HPACK string");
+    bool huffman = (*p & 0x80) != 0;
+    size_t len = hpack_get_int(p, end, 7);
+    if(len > (size_t)(end - p))
+        throw runtime_error("truncated HPACK string");
+    out.clear();
+    if(!huffman)
+        out.assign((const char *)p, len);
+    else if(!huffman_decode(p, len, out))
+        throw runtime_error("malformed HPACK Huffman string");
+    p += len;
+}
+
+hpack_table::hpack_table(size_t maxSize) : _size(0), _max(maxSize) {}
+
+void hpack_table::set_max_size(size_t maxSize) {
+    _max = maxSize;
+    while(_size > _max) {
+        _size -= _entries.back().first.size() + _entries.back().second.size() + 32;
+        _entries.pop_back();
+    }
+}
+
+void hpack_table::add(const string &name, const string &value) {
+    size_t entrySize = name.size() + value.size() + 32;
+    while(!_entries.empty() && _size + entrySize > _max) {
+        _size -= _entries.back().first.size() + _entries.back().second.size() + 32;
+        _entries.pop_back();
+    }
+    if(entrySize > _max) // Adding it only empties the table
+        return;
+    _entries.emplace_front(name, value);
+    _size += entrySize;
+}
+
+bool hpack_table::get(size_t index, string &name, string &value) const {
+    if(index == 0)
+        return false;
+    if(index <= 61) {
+        name = hpack_static[index - 1][0];
+        value = hpack_static[index - 1][1];
+        return true;
+    }
+    if(index - 62 >= _entries.size())
+        return false;
+    name = _entries[index - 62].first;
+    value = _entries[index - 62].second;
+    return true;
+}
+
+/**
+ * Look a header field up in the static and dynamic tables.
+ * @param exact Set if the value matches too.
+ * @return Index of the best match, 0 if even the name is unknown.
+ */
+size_t hpack_table::find(const string &name, const string &value, bool &exact) const {
+    size_t nameIndex = 0;
+    exact = false;
+    for(size_t i = 0; i < 61; i++) {
+        if(name != hpack_static[i][0])
+            continue;
+        if(value == hpack_static[i][1]) {
+            exact = true;
+            return i + 1;
+        }
+        if(!nameIndex)
+            nameIndex = i + 1;
+    }
+    for(size_t i = 0; i < _entries.size(); i++) {
+        if(_entries[i].first != name)
+            continue;
+        if(_entries[i].second == value) {
+            exact = true;
+            return i + 62;
+        }
+        if(!nameIndex)
+            nameIndex = i + 62;
+    }
+    return nameIndex;
+}
+
+hpack_encoder::hpack_encoder(size_t maxSize)
+        : hpack_table(maxSize), _resized(false), _smallest(maxSize) {}
+
+/**
+ * Follow the peer's SETTINGS_HEADER_TABLE_SIZE. The change is announced at
+ * the start of the next header block.
+ */
+void hpack_encoder::resize(size_t maxSize) {
+    maxSize = min<size_t>(maxSize, 4096);
+    if(maxSize == _max && !_resized)
+        return;
+    _smallest = _resized ? min(_smallest, maxSize) : maxSize;
+    _resized = true;
+    set_max_size(_smallest); // Evict as the decoder will
+    _max = maxSize;
+}
+
+void hpack_encoder::encode(const string &name, const string &value, string &out, bool index) {
+    if(_resized) {
+        if(_smallest < _max)
+            hpack_put_int(out, 5, 0x20, _smallest);
+        hpack_put_int(out, 5, 0x20, _max);
+        _resized = false;
+    }
+    bool exact;
+    size_t found = find(name, value, exact);
+    if(exact) {
+        hpack_put_int(out, 7, 0x80, found);
+        return;
+    }
+    // Entries over half the table would evict too much to pay off
+    index = index && name.size() + value.size() + 32 <= _max / 2;
+    hpack_put_int(out, index ? 6 : 4, index ? 0x40 : 0, found);
+    if(!found)
+        hpack_put_string(out, name);
+    hpack_put_string(out, value);
+    if(index)
+        add(name, value);
+}
+
+hpack_decoder::hpack_decoder(size_t maxSize) : hpack_table(maxSize), _limit(maxSize) {}
+
+/**
+ * Decode a complete header block, updating the dynamic table.
+ * @param headers Receives the header fields in order.
+ */
+void hpack_decoder::decode(const char *buf, size_t len, http2_header_list &headers) {
+    auto p = (const unsigned char *)buf, end = p + len;
+    string name, value;
+    bool fieldSeen = false;
+    while(p < end) {
+        unsigned char c = *p;
+        if(c & 0x80) { // Indexed field
+            size_t index = hpack_get_int(p, end, 7);
+            if(!get(index, name, value))
+                throw runtime_error("invalid HPACK index");
+        } else if((c & 0xe0) == 0x20) { // Dynamic table size update
+            size_t newSize = hpack_get_int(p, end, 5);
+            if(fieldSeen || newSize > _limit)
+                throw runtime_error("invalid HPACK table size update");
+            set_max_size(newSize);
+            continue;
+        } else { // Literal, with incremental indexing if 01xxxxxx
+            bool indexing = (c & 0xc0) == 0x40;
+            size_t index = hpack_get_int(p, end, indexing ? 6 : 4);
+            if(index) {
+                if(!get(index, name, value))
+                    throw runtime_error("invalid HPACK index");
+            } else {
+                hpack_get_string(p, end, name);
+            }
+            hpack_get_string(p, end, value);
+            if(indexing)
+                add(name, value);
+        }
+        fieldSeen = true;
+        headers.emplace_back(name, value);
+    }
+}
+
+/****** Framing ******/
+
+static inline uint32_t get32(const void *buf) {
+    auto p = (const unsigned char *)buf;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put32(char *p, uint32_t value) {
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+static inline void put_frame_header(char *p, size_t len, int type, int flags, uint32_t id) {
+    p[0] = (char)(len >> 16);
+    p[1] = (char)(len >> 8);
+    p[2] = (char)len;
+    p[3] = (char)type;
+    p[4] = (char)flags;
+    put32(p + 5, id & 0x7fffffff);
+}
+
+http2_frame::http2_frame(int type, int flags, uint32_t streamId, chunk payload)
+        : _type(type), _flags(flags), _stream_id(streamId), _payload(move(payload)) {}
+
+http2_frame::~http2_frame() = default;
+
+int http2_frame::serialize_size() {
+    return 9 + _payload.size();
+}
+
+void http2_frame::serialize(char *buf) {
+    put_frame_header(buf, _payload.size(), _type, _flags, _stream_id);
+    if(_payload.size() > 0)
+        memcpy(buf + 9, _payload.data(), _payload.size());
+}
+
+http2_frame::decoder::decoder(int maxFrameSize) : _max_frame(maxFrameSize) {}
+
+bool http2_frame::decoder::decode(stream_buffer &stb) {
+    if(stb.size() < 9)
+        return false;
+    auto p = (const unsigned char *)stb.data();
+    int len = p[0] << 16 | p[1] << 8 | p[2];
+    if(len > _max_frame)
+        throw runtime_error("HTTP/2 frame too large");
+    if(stb.size() < 9 + (size_t)len)
+        return false;
+    _msg = make_shared<http2_frame>(p[3], p[4], get32(p + 5) & 0x7fffffff,
+                                    chunk(stb.data() + 9, len));
+    stb.pull(9 + len);
+    return true;
+}
+
+/****** Connection ******/
+
+// Errors closing the whole connection with GOAWAY
+class http2_error : public runtime_error {
+public:
+    http2_error(int c, const char *what) : runtime_error(what), code(c) {}
+    const int code;
+};
+
+/*
+ * One request stream. To the http_transaction serving it, this is the
+ * byte stream carrying the request body and the response body. On a client
+ * connection, it carries the request body out and the response body in.
+ */
+class http2_stream : public stream {
+public:
+    http2_stream(P<http2_connection> conn, uint32_t id)
+            : conn(move(conn)), id(id), send_window(this->conn->_peer_window),
+              recv_window(H2_STREAM_WINDOW), recv_unacked(0), held(0), remote_closed(false),
+              local_closed(false), was_reset(false) {
+        handle = nullptr;
+    }
+
+    using stream::write;
+    virtual void read(const P<decoder> &dec);
+    virtual void write(const char *buf, int length);
+    virtual bool has_tls() { return conn->_strm->has_tls(); }
+    virtual string alpn_protocol() { return "h2"; }
+
+    void receive(const char *buf, size_t len) {
+        buffer.append(buf, len);
+        held += len;
+    }
+
+    void wake(int status) {
+        if(reading_fiber)
+            reading_fiber->resume(status);
+    }
+
+    void check_open() {
+        if(was_reset || conn->_closing)
+            throw RTERR("HTTP/2 stream %u reset", id);
+        if(local_closed)
+            throw RTERR("HTTP/2 stream %u already ended", id);
+    }
+
+    inline size_t buffer_size() const { return buffer.size(); }
+    void wait_input();
+    void read_all(size_t limit);
+    P<http_response> wait_response();
+    chunk read_some();
+    void send_response(const P<http_response> &resp, bool endStream) {
+        conn->send_headers(*this, resp, endStream);
+    }
+    void end();
+
+    P<http2_connection> conn;
+    P<http_response> response; // Client side, once its HEADERS arrived
+    const uint32_t id;
+    int64_t send_window;
+    int recv_window, recv_unacked;
+    size_t held; // Buffered bytes whose credit is not returned yet
+    bool remote_closed, local_closed, was_reset;
+};
+
+void http2_stream::wait_input() {
+    if(_timeout > 0)
+        uv_timer_start(_timeOuter, [] (uv_timer_t *timer) {
+            uv_timer_stop(timer);
+            ((http2_stream *)(stream *)timer->data)->wake(UV_ETIMEDOUT);
+        }, _timeout, 0);
+    int status;
+    {
+        fiber::preserve p(reading_fiber);
+        status = fiber::yield();
+    }
+    uv_timer_stop(_timeOuter);
+    if(status < 0)
+        throw IOERR(status);
+}
+
+void http2_stream::read(const P<decoder> &dec) {
+    if(reading_fiber)
+        throw RTERR("stream is read-busy");
+    while(true) {
+        bool done = buffer.size() > 0 && dec->decode(buffer);
+        if(held > buffer.size()) { // Give consumed bytes back to the peer
+            conn->refund(this, held - buffer.size());
+            held = buffer.size();
+        }
+        if(done)
+            return;
+        if(was_reset || conn->_closing)
+            throw RTERR("HTTP/2 stream %u reset", id);
+        if(remote_closed)
+            throw IOERR(UV_EOF);
+        wait_input();
+    }
+}
+
+/**
+ * Wait for a request body sent without Content-Length to complete.
+ */
+void http2_stream::read_all(size_t limit) {
+    while(!remote_closed) {
+        if(was_reset || conn->_closing)
+            throw RTERR("HTTP/2 stream %u reset", id);
+        if(buffer.size() > limit)
+            throw RTERR("request body too long");
+        conn->refund(this, held);
+        held = 0;
+        wait_input();
+    }
+}
+
+P<http_response> http2_stream::wait_response() {
+    while(!response) {
+        if(was_reset || conn->_closing)
+            throw RTERR("HTTP/2 stream %u reset", id);
+        if(remote_closed)
+            throw RTERR("HTTP/2 stream %u ended without response", id);
+        wait_input();
+    }
+    return response;
+}
+
+/**
+ * Take whatever body has arrived.
+ * @return nullptr once the body is over.
+ */
+chunk http2_stream::read_some() {
+    while(buffer.size() == 0) {
+        if(was_reset || conn->_closing)
+            throw RTERR("HTTP/2 stream %u reset", id);
+        if(remote_closed)
+            return nullptr;
+        wait_input();
+    }
+    chunk data(buffer.data(), buffer.size());
+    buffer.pull(buffer.size());
+    conn->refund(this, held);
+    held = 0;
+    return data;
+}
+
+void http2_stream::write(const char *buf, int length) {
+    while(length > 0) {
+        check_open();
+        int64_t room = min<int64_t>(min(send_window, conn->_send_window), conn->_peer_frame);
+        if(room <= 0 || conn->_txq.size() >= H2_TX_HIGH_WATER) {
+            conn->wait_tx();
+            continue;
+        }
+        int n = (int)min<int64_t>(room, length);
+        conn->queue_frame(http2_frame::DATA, 0, id, buf, n);
+        send_window -= n;
+        conn->_send_window -= n;
+        buf += n;
+        length -= n;
+    }
+}
+
+void http2_stream::end() {
+    if(local_closed || was_reset || conn->_closing)
+        return;
+    conn->queue_frame(http2_frame::DATA, http2_frame::END_STREAM, id, nullptr, 0);
+    local_closed = true;
+}
+
+/*
+ * The http_connection an http_transaction sees for one stream.
+ */
+class http2_exchange : public http_connection {
+public:
+    http2_exchange(const P<http2_stream> &strm, const string &peername)
+            : http_connection(strm, peername), _h2(strm) {}
+
+    virtual P<stream> upgrade() {
+        throw RTERR("connection upgrade is not available over HTTP/2");
+    }
+protected:
+    virtual bool multiplexed() const { return true; }
+
+    virtual void write_response(const P<http_response> &resp, bool endStream) {
+        _h2->send_response(resp, endStream);
+    }
+
+    virtual void end_response() { _h2->end(); }
+private:
+    P<http2_stream> _h2;
+};
+
+const string http2_connection::PREFACE("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+
+http2_connection::preface_decoder::preface_decoder(bool consume)
+        : _consume(consume), _matched(false) {}
+
+bool http2_connection::preface_decoder::decode(stream_buffer &stb) {
+    size_t n = min(stb.size(), PREFACE.size());
+    if(memcmp(stb.data(), PREFACE.data(), n) != 0) {
+        _matched = false;
+        return true;
+    }
+    if(n < PREFACE.size())
+        return false;
+    _matched = true;
+    if(_consume)
+        stb.pull(PREFACE.size());
+    return true;
+}
+
+http2_connection::http2_connection(P<stream> strm, string peername)
+        : _strm(move(strm)), _peername(move(peername)), _last_stream(0), _peer_streams(100),
+          _send_window(65535), _recv_window(H2_CONN_WINDOW), _recv_unacked(0),
+          _peer_window(65535), _peer_frame(16384), _header_stream(0), _header_flags(0),
+          _idle_timeout(15000), _client(false), _writer_idle(false), _goaway(false),
+          _closing(false) {
+    _flush_timer = mem_alloc<uv_timer_t>();
+    if(uv_timer_init(uv_default_loop(), _flush_timer) < 0) {
+        free(_flush_timer);
+        throw runtime_error("failed to setup HTTP/2 flush timer");
+    }
+    _flush_timer->data = this;
+}
+
+http2_connection::~http2_connection() {
+    uv_close((uv_handle_t *)_flush_timer, (uv_close_cb) free);
+}
+
+/**
+ * Serve requests until the client goes away. Returns while streams may
+ * still be finishing on their own fibers.
+ * @param svc The service each stream's transaction is passed to.
+ */
+void http2_connection::serve(const P<http_service> &svc) {
+    _service = svc;
+    try {
+        auto preface = make_shared<preface_decoder>(true);
+        _strm->read(preface);
+        if(!preface->matched())
+            return;
+    }
+    catch(runtime_error &ex) {
+        return;
+    }
+    start_session();
+    read_loop();
+}
+
+/**
+ * Start the client side of a connection to a server known to speak h2c.
+ * Responses are read by a fiber of its own, requests go through
+ * http2_client.
+ */
+void http2_connection::open() {
+    auto self = shared_from_this();
+    _client = true;
+    _txq.append(PREFACE);
+    start_session();
+    fiber::launch([self] () { self->read_loop(); });
+}
+
+static inline void put_setting(char *p, int id, uint32_t value) {
+    p[0] = 0, p[1] = id;
+    put32(p + 2, value);
+}
+
+void http2_connection::start_session() {
+    auto self = shared_from_this();
+    // Our SETTINGS, then raise the connection window from the 64 KB default
+    char settings[12];
+    if(_client)
+        put_setting(settings, 2, 0); // SETTINGS_ENABLE_PUSH
+    else
+        put_setting(settings, 3, H2_MAX_STREAMS); // SETTINGS_MAX_CONCURRENT_STREAMS
+    put_setting(settings + 6, 4, H2_STREAM_WINDOW); // SETTINGS_INITIAL_WINDOW_SIZE
+    queue_frame(http2_frame::SETTINGS, 0, 0, settings, sizeof(settings));
+    queue_window_update(0, H2_CONN_WINDOW - 65535);
+    _writer = fiber::launch([self] () { self->write_loop(); });
+}
+
+void http2_connection::read_loop() {
+    auto self = shared_from_this();
+    auto dec = make_shared<http2_frame::decoder>();
+    int error = H2_NO_ERROR;
+    while(!_closing) {
+        // Only idle connections time out, streams may take their time. A
+        // client cannot tell when its next request comes, the server decides.
+        _strm->set_timeout(_client || !_streams.empty() ? 0 : _idle_timeout);
+        P<http2_frame> frame;
+        try {
+            frame = _strm->read<http2_frame>(dec);
+        }
+        catch(runtime_error &ex) {
+            break;
+        }
+        try {
+            handle_frame(frame);
+        }
+        catch(http2_error &ex) {
+            error = ex.code;
+            break;
+        }
+    }
+    if(error != H2_NO_ERROR) {
+        char goaway[8];
+        put32(goaway, _last_stream);
+        put32(goaway + 4, error);
+        queue_frame(http2_frame::GOAWAY, 0, 0, goaway, sizeof(goaway));
+    }
+    shutdown();
+}
+
+void http2_connection::handle_frame(const P<http2_frame> &frame) {
+    uint32_t id = frame->stream_id();
+    int flags = frame->flags();
+    const char *payload = frame->payload().data();
+    size_t len = frame->payload().size();
+    if(_header_stream) { // Nothing may come between HEADERS and CONTINUATION
+        if(frame->type() != http2_frame::CONTINUATION || id != _header_stream)
+            throw http2_error(H2_PROTOCOL_ERROR, "expected CONTINUATION");
+        _header_block.append(payload, len);
+        if(_header_block.size() > H2_MAX_HEADER_BLOCK)
+            throw http2_error(H2_PROTOCOL_ERROR, "header block too large");
+        if(flags & http2_frame::END_HEADERS) {
+            string block;
+            block.swap(_header_block);
+            _header_stream = 0;
+            handle_headers(id, _header_flags, block);
+        }
+        return;
+    }
+    switch(frame->type()) {
+        case http2_frame::DATA: {
+            if(id == 0 || id > _last_stream)
+                throw http2_error(H2_PROTOCOL_ERROR, "DATA on idle stream");
+            if((int64_t)len > _recv_window)
+                throw http2_error(H2_FLOW_CONTROL_ERROR, "connection window exceeded");
+            _recv_window -= len;
+            size_t skip = 0, pad = 0;
+            if(flags & http2_frame::PADDED) {
+                if(len < 1 || (unsigned char)payload[0] >= len)
+                    throw http2_error(H2_PROTOCOL_ERROR, "invalid padding");
+                skip = 1;
+                pad = (unsigned char)payload[0];
+            }
+            auto it = _streams.find(id);
+            if(it == _streams.end() || it->second->remote_closed) {
+                refund(nullptr, len); // Closed or reset already, drop it
+                return;
+            }
+            P<http2_stream> strm = it->second;
+            if((int64_t)len > strm->recv_window) {
+                refund(nullptr, len);
+                reset_stream(*strm, H2_FLOW_CONTROL_ERROR);
+                return;
+            }
+            strm->recv_window -= len;
+            strm->receive(payload + skip, len - skip - pad);
+            if(skip + pad > 0) // Padding is consumed right away
+                refund(strm.get(), skip + pad);
+            if(flags & http2_frame::END_STREAM)
+                strm->remote_closed = true;
+            strm->wake(0);
+            return;
+        }
+        case http2_frame::HEADERS: {
+            if(id == 0)
+                throw http2_error(H2_PROTOCOL_ERROR, "HEADERS on stream 0");
+            size_t skip = 0, pad = 0;
+            if(flags & http2_frame::PADDED) {
+                if(len < 1)
+                    throw http2_error(H2_PROTOCOL_ERROR, "invalid padding");
+                skip = 1;
+                pad = (unsigned char)payload[0];
+            }
+            if(flags & http2_frame::PRIORITY_INFO)
+                skip += 5;
+            if(skip + pad > len)
+                throw http2_error(H2_PROTOCOL_ERROR, "invalid padding");
+            _header_block.assign(payload + skip, len - skip - pad);
+            if(flags & http2_frame::END_HEADERS) {
+                string block;
+                block.swap(_header_block);
+                handle_headers(id, flags, block);
+            } else {
+                _header_stream = id;
+                _header_flags = flags;
+            }
+            return;
+        }
+        case http2_frame::PRIORITY: // Streams are served as they come
+            if(len != 5)
+                throw http2_error(H2_FRAME_SIZE_ERROR, "invalid PRIORITY frame");
+            return;
+        case http2_frame::RST_STREAM: {
+            if(id == 0 || len != 4)
+                throw http2_error(H2_PROTOCOL_ERROR, "invalid RST_STREAM frame");
+            auto it = _streams.find(id);
+            if(it == _streams.end())
+                return;
+            P<http2_stream> strm = it->second;
+            strm->was_reset = strm->remote_closed = true;
+            strm->wake(UV_ECONNRESET);
+            wake_tx(0); // Its writer, if any, has to notice
+            return;
+        }
+        case http2_frame::SETTINGS:
+            handle_settings(frame);
+            return;
+        case http2_frame::PUSH_PROMISE: // Servers get none, clients disabled them
+            throw http2_error(H2_PROTOCOL_ERROR, "unexpected PUSH_PROMISE");
+        case http2_frame::PING:
+            if(id != 0 || len != 8)
+                throw http2_error(H2_PROTOCOL_ERROR, "invalid PING frame");
+            if(!(flags & http2_frame::ACK))
+                queue_frame(http2_frame::PING, http2_frame::ACK, 0, payload, len);
+            return;
+        case http2_frame::GOAWAY: {
+            if(id != 0 || len < 8)
+                throw http2_error(H2_PROTOCOL_ERROR, "invalid GOAWAY frame");
+            _goaway = true;
+            if(!_client) // Streams in flight still get their responses
+                return;
+            // Requests the server will never process may be retried elsewhere
+            uint32_t last = get32(payload) & 0x7fffffff;
+            vector<P<http2_stream>> refused;
+            for(auto &it : _streams)
+                if(it.first > last)
+                    refused.push_back(it.second);
+            for(auto &strm : refused) {
+                strm->was_reset = strm->remote_closed = true;
+                strm->wake(UV_ECONNRESET);
+            }
+            return;
+        }
+        case http2_frame::WINDOW_UPDATE: {
+            if(len != 4)
+                throw http2_error(H2_FRAME_SIZE_ERROR, "invalid WINDOW_UPDATE frame");
+            uint32_t increment = get32(payload) & 0x7fffffff;
+            if(id == 0) {
+                if(increment == 0 || _send_window + increment > 0x7fffffff)
+                    throw http2_error(H2_FLOW_CONTROL_ERROR, "invalid window increment");
+                _send_window += increment;
+            } else {
+                auto it = _streams.find(id);
+                if(it == _streams.end())
+                    return;
+                P<http2_stream> strm = it->second;
+                if(increment == 0 || strm->send_window + increment > 0x7fffffff) {
+                    reset_stream(*strm, H2_FLOW_CONTROL_ERROR);
+                    return;
+                }
+                strm->send_window += increment;
+            }
+            wake_tx(0);
+            return;
+        }
+        case http2_frame::CONTINUATION:
+            throw http2_error(H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+        default: // Unknown frame types must be ignored
+            return;
+    }
+}
+
+void http2_connection::handle_settings(const P<http2_frame> &frame) {
+    size_t len = frame->payload().size();
+    if(frame->stream_id() != 0)
+        throw http2_error(H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+    if(frame->flags() & http2_frame::ACK) {
+        if(len != 0)
+            throw http2_error(H2_FRAME_SIZE_ERROR, "SETTINGS ACK with payload");
+        return;
+    }
+    if(len % 6 != 0)
+        throw http2_error(H2_FRAME_SIZE_ERROR, "invalid SETTINGS frame");
+    auto p = (const unsigned char *)frame->payload().data();
+    for(size_t i = 0; i < len; i += 6) {
+        uint32_t value = get32(p + i + 2);
+        switch(p[i] << 8 | p[i + 1]) {
+            case 1: // SETTINGS_HEADER_TABLE_SIZE
+                _encoder.resize(value);
+                break;
+            case 3: // SETTINGS_MAX_CONCURRENT_STREAMS, limits our requests
+                _peer_streams = value;
+                break;
+            case 2: // SETTINGS_ENABLE_PUSH, we never push anyway
+                if(value > 1)
+                    throw http2_error(H2_PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH");
+                break;
+            case 4: // SETTINGS_INITIAL_WINDOW_SIZE, open streams follow the change
+                if(value > 0x7fffffff)
+                    throw http2_error(H2_FLOW_CONTROL_ERROR, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+                for(auto &it : _streams)
+                    it.second->send_window += (int64_t)value - _peer_window;
+                _peer_window = value;
+                break;
+            case 5: // SETTINGS_MAX_FRAME_SIZE
+                if(value < 16384 || value > 0xffffff)
+                    throw http2_error(H2_PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE");
+                _peer_frame = value;
+                break;
+            default:
+                break;
+        }
+    }
+    queue_frame(http2_frame::SETTINGS, http2_frame::ACK, 0, nullptr, 0);
+    wake_tx(0);
+}
+
+void http2_connection::handle_headers(uint32_t id, int flags, const string &block) {
+    http2_header_list headers;
+    try { // Always decode, the table has to stay in sync
+        _decoder.decode(block.data(), block.size(), headers);
+    }
+    catch(runtime_error &ex) {
+        throw http2_error(H2_COMPRESSION_ERROR, ex.what());
+    }
+    if(_client) {
+        handle_response(id, flags, headers);
+        return;
+    }
+    auto it = _streams.find(id);
+    if(it != _streams.end()) { // Trailers, they end the request body
+        P<http2_stream> strm = it->second;
+        if(!(flags & http2_frame::END_STREAM)) {
+            reset_stream(*strm, H2_PROTOCOL_ERROR);
+            return;
+        }
+        strm->remote_closed = true;
+        strm->wake(0);
+        return;
+    }
+    if(!(id & 1))
+        throw http2_error(H2_PROTOCOL_ERROR, "invalid stream identifier");
+    if(id <= _last_stream) // Trailers of a stream we are done with
+        return;
+    _last_stream = id;
+    if(_streams.size() >= H2_MAX_STREAMS) {
+        queue_rst(id, H2_REFUSED_STREAM);
+        return;
+    }
+    auto req = make_shared<http_request>();
+    string path, authority;
+    for(auto &field : headers) {
+        const string &name = field.first;
+        if(name[0] == ':') {
+            if(name == ":method")
+                req->method = field.second;
+            else if(name == ":path")
+                path = field.second;
+            else if(name == ":authority")
+                authority = field.second;
+            continue;
+        }
+        // Repeated fields are combined, cookies with their own separator
+        chunk prev = req->header(name);
+        if(prev)
+            req->set_header(name, prev.to_string() +
+                            (name == "cookie" ? "; " : ", ") + field.second);
+        else
+            req->set_header(name, field.second);
+    }
+    if(req->method.empty() || path.empty()) {
+        queue_rst(id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    req->set_resource(path);
+    if(!authority.empty() && !req->header("host"))
+        req->set_header("host", authority);
+    auto strm = make_shared<http2_stream>(shared_from_this(), id);
+    strm->remote_closed = (flags & http2_frame::END_STREAM) != 0;
+    _streams[id] = strm;
+    auto self = shared_from_this();
+    fiber::launch([self, strm, req] () { self->run_stream(strm, req); });
+}
+
+// Field names as HTTP/1.1 peers write them, which is what lookups expect
+static string canonical_name(const string &name) {
+    string result(name);
+    for(size_t i = 0; i < result.size(); i++)
+        if(i == 0 || result[i - 1] == '-')
+            result[i] = toupper(result[i]);
+    return result;
+}
+
+void http2_connection::handle_response(uint32_t id, int flags, const http2_header_list &headers) {
+    auto it = _streams.find(id);
+    if(it == _streams.end()) // Cancelled or never ours
+        return;
+    P<http2_stream> strm = it->second;
+    if(strm->response) { // Trailers, they end the response body
+        if(!(flags & http2_frame::END_STREAM)) {
+            reset_stream(*strm, H2_PROTOCOL_ERROR);
+            return;
+        }
+        strm->remote_closed = true;
+        strm->wake(0);
+        return;
+    }
+    int code = 0;
+    for(auto &field : headers)
+        if(field.first == ":status")
+            code = atoi(field.second.c_str());
+    if(code < 100 || code > 999 || (code < 200 && (flags & http2_frame::END_STREAM))) {
+        reset_stream(*strm, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if(code < 200) // Informational, the final response follows
+        return;
+    auto resp = make_shared<http_response>(code);
+    for(auto &field : headers) {
+        if(field.first[0] == ':')
+            continue;
+        string name = canonical_name(field.first);
+        chunk prev = resp->header(name);
+        if(prev && name != "Set-Cookie")
+            resp->set_header(name, prev.to_string() + ", " + field.second);
+        else
+            resp->set_header(name, field.second);
+    }
+    strm->response = resp;
+    strm->remote_closed = (flags & http2_frame::END_STREAM) != 0;
+    strm->wake(0);
+}
+
+void http2_connection::run_stream(P<http2_stream> strm, P<http_request> req) {
+    try {
+        if(!strm->remote_closed && !req->header("content-length")) {
+            // HTTP/2 bodies may come without a length, wait for all of it
+            strm->read_all(H2_MAX_BODY);
+            if(strm->buffer_size() > 0)
+                req->set_header("content-length", to_string(strm->buffer_size()));
+        }
+        auto conn = make_shared<http2_exchange>(strm, _peername);
+        conn->invoke_service(_service, make_shared<http_transaction>(conn, move(req)));
+    }
+    catch(exception &ex) {
+        if(!_closing && !strm->was_reset)
+            cerr<<"["<<timelabel()<<" "<<_peername<<"] "<<ex.what()<<endl;
+    }
+    close_stream(*strm);
+}
+
+void http2_connection::close_stream(http2_stream &strm) {
+    if(!_closing && !strm.was_reset) {
+        if(!strm.local_closed) // The response broke off
+            queue_rst(strm.id, _client ? H2_CANCEL : H2_INTERNAL_ERROR);
+        else if(!strm.remote_closed) // Stop the rest of an unread body
+            queue_rst(strm.id, _client ? H2_CANCEL : H2_NO_ERROR);
+    }
+    strm.was_reset = strm.remote_closed = strm.local_closed = true;
+    refund(nullptr, strm.held);
+    strm.held = 0;
+    _streams.erase(strm.id);
+    if(_client && !_tx_waiters.empty()) // Requests may wait for a free stream
+        kick_writer();
+}
+
+void http2_connection::reset_stream(http2_stream &strm, int code) {
+    queue_rst(strm.id, code);
+    strm.was_reset = strm.remote_closed = true;
+    strm.wake(UV_ECONNRESET);
+    wake_tx(0);
+}
+
+/**
+ * Return receive credit for consumed bytes, once enough has accumulated
+ * to be worth a WINDOW_UPDATE.
+ * @param strm The stream they were received on, nullptr for the connection only.
+ */
+void http2_connection::refund(http2_stream *strm, size_t nbytes) {
+    if(nbytes == 0)
+        return;
+    _recv_unacked += nbytes;
+    if(_recv_unacked >= H2_CONN_WINDOW / 2) {
+        queue_window_update(0, _recv_unacked);
+        _recv_window += _recv_unacked;
+        _recv_unacked = 0;
+    }
+    if(!strm || strm->remote_closed)
+        return;
+    strm->recv_unacked += nbytes;
+    if(strm->recv_unacked >= H2_STREAM_WINDOW / 2) {
+        queue_window_update(strm->id, strm->recv_unacked);
+        strm->recv_window += strm->recv_unacked;
+        strm->recv_unacked = 0;
+    }
+}
+
+static bool volatile_header(const string &name) {
+    static const char *const names[] = {
+        "content-length", "content-range", "date", "etag", "expires",
+        "last-modified", "location", "set-cookie" };
+    for(auto n : names)
+        if(name == n) return true;
+    return false;
+}
+
+/**
+ * Open a client stream, waiting while the server's concurrency limit is
+ * reached.
+ */
+P<http2_stream> http2_connection::open_stream() {
+    while(_streams.size() >= _peer_streams) {
+        if(!usable())
+            break;
+        wait_tx();
+    }
+    if(!usable())
+        throw RTERR("HTTP/2 connection to %s is going away", _peername.c_str());
+    _last_stream = _last_stream ? _last_stream + 2 : 1;
+    auto strm = make_shared<http2_stream>(shared_from_this(), _last_stream);
+    _streams[strm->id] = strm;
+    return strm;
+}
+
+void http2_connection::send_headers(http2_stream &strm, const P<http_response> &resp, bool endStream) {
+    strm.check_open();
+    string block, name;
+    _encoder.encode(":status", to_string(resp->code()), block);
+    for(auto it = resp->hbegin(); it != resp->hend(); it++) {
+        if(!it->second)
+            continue;
+        name.resize(it->first.size());
+        transform(it->first.begin(), it->first.end(), name.begin(), ::tolower);
+        // Connection-specific fields are not allowed in HTTP/2
+        if(name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade")
+            continue;
+        _encoder.encode(name, string(it->second.data(), it->second.size()), block,
+                        !volatile_header(name));
+    }
+    for(auto &cookie : resp->cookies)
+        _encoder.encode("set-cookie", string(cookie.data(), cookie.size()), block, false);
+    queue_header_block(strm.id, block, endStream);
+    if(endStream)
+        strm.local_closed = true;
+}
+
+/**
+ * Send a request on a client stream. Headers repeated across requests, as
+ * a proxy's are, mostly shrink to dynamic table indices.
+ */
+void http2_connection::send_request(http2_stream &strm, const P<http_request> &req, bool endStream) {
+    strm.check_open();
+    string block, name;
+    chunk host = req->header("host");
+    _encoder.encode(":method", req->method, block);
+    _encoder.encode(":scheme", _strm->has_tls() ? "https" : "http", block);
+    if(host)
+        _encoder.encode(":authority", host.to_string(), block);
+    _encoder.encode(":path", req->resource().to_string(), block);
+    for(auto it = req->hbegin(); it != req->hend(); it++) {
+        if(!it->second)
+            continue;
+        name.resize(it->first.size());
+        transform(it->first.begin(), it->first.end(), name.begin(), ::tolower);
+        if(name == "host" || name == "connection" || name == "keep-alive" ||
+           name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade")
+            continue;
+        if(name == "te" && string(it->second.data(), it->second.size()) != "trailers")
+            continue;
+        _encoder.encode(name, string(it->second.data(), it->second.size()), block,
+                        !volatile_header(name));
+    }
+    queue_header_block(strm.id, block, endStream);
+    if(endStream)
+        strm.local_closed = true;
+}
+
+// Blocks larger than a frame continue in CONTINUATION frames
+void http2_connection::queue_header_block(uint32_t id, const string &block, bool endStream) {
+    int type = http2_frame::HEADERS;
+    int flags = endStream ? http2_frame::END_STREAM : 0;
+    size_t offset = 0;
+    do {
+        size_t n = min<size_t>(block.size() - offset, _peer_frame);
+        if(offset + n == block.size())
+            flags |= http2_frame::END_HEADERS;
+        queue_frame(type, flags, id, block.data() + offset, n);
+        offset += n;
+        type = http2_frame::CONTINUATION;
+        flags = 0;
+    } while(offset < block.size());
+}
+
+void http2_connection::queue_frame(int type, int flags, uint32_t id, const char *payload, size_t len) {
+    if(_closing)
+        return;
+    size_t base = _txq.size();
+    _txq.resize(base + 9 + len);
+    put_frame_header(&_txq[base], len, type, flags, id);
+    if(len > 0)
+        memcpy(&_txq[base + 9], payload, len);
+    kick_writer();
+}
+
+void http2_connection::queue_rst(uint32_t id, int code) {
+    char payload[4];
+    put32(payload, code);
+    queue_frame(http2_frame::RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void http2_connection::queue_window_update(uint32_t id, int increment) {
+    char payload[4];
+    put32(payload, increment);
+    queue_frame(http2_frame::WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+// Wait for send credit or room in the queue
+void http2_connection::wait_tx() {
+    _tx_waiters.push_back(fiber::current());
+    int status = fiber::yield();
+    if(status < 0)
+        throw IOERR(status);
+}
+
+void http2_connection::wake_tx(int status) {
+    auto waiters = move(_tx_waiters);
+    for(auto &f : waiters)
+        f->resume(status);
+}
+
+/**
+ * Have the writer send what is queued. It runs on the next loop iteration,
+ * so frames queued by every fiber woken meanwhile leave in one write.
+ */
+void http2_connection::kick_writer() {
+    if(!_writer_idle || uv_is_active((uv_handle_t *)_flush_timer))
+        return;
+    uv_timer_start(_flush_timer, [] (uv_timer_t *timer) {
+        auto self = (http2_connection *)timer->data;
+        if(self->_writer_idle)
+            self->_writer->resume(0);
+    }, 0, 0);
+}
+
+void http2_connection::write_loop() {
+    while(true) {
+        if(_txq.empty()) {
+            if(_closing)
+                break;
+            _writer_idle = true;
+            fiber::yield();
+            _writer_idle = false;
+            if(_txq.empty()) // Kicked for the waiters alone
+                wake_tx(0);
+            continue;
+        }
+        _txq.swap(_tx_spare);
+        try {
+            _strm->write(_tx_spare.data(), _tx_spare.size());
+        }
+        catch(runtime_error &ex) {
+            _tx_spare.clear();
+            _txq.clear();
+            shutdown();
+            break;
+        }
+        _tx_spare.clear();
+        wake_tx(0);
+    }
+    _writer.reset();
+}
+
+/**
+ * Stop serving: streams and waiting writers fail, while frames already
+ * queued (such as GOAWAY) are still sent.
+ */
+void http2_connection::shutdown() {
+    if(_closing)
+        return;
+    _closing = true;
+    auto streams = move(_streams);
+    _streams.clear();
+    for(auto &it : streams)
+        it.second->wake(UV_ECONNABORTED);
+    wake_tx(UV_ECONNABORTED);
+    if(_writer && _writer_idle) // Let it flush the queue and exit
+        _writer->resume(0);
+}
+
+http2_client::http2_client(P<http2_connection> conn) : _conn(move(conn)), _more(false) {}
+
+/**
+ * Send a request and wait for the response head.
+ * @param body The whole request body, if any.
+ */
+P<http_response> http2_client::send(const P<http_request> &request, const chunk &body) {
+    if(_strm)
+        throw RTERR("request already sent");
+    _strm = _conn->open_stream();
+    bool hasBody = body && body.size() > 0;
+    _conn->send_request(*_strm, request, !hasBody);
+    if(hasBody) {
+        _strm->write(body.data(), body.size());
+        _strm->end();
+    }
+    auto response = _strm->wait_response();
+    _more = true;
+    return response;
+}
+
+/**
+ * Read what has arrived of the response body.
+ * @return nullptr when the body is over.
+ */
+chunk http2_client::read() {
+    if(!_more)
+        throw RTERR("read on unreadable HTTP/2 stream");
+    chunk data = _strm->read_some();
+    if(!data)
+        _more = false;
+    return data;
+}
+
+http2_client::~http2_client() {
+    if(_strm)
+        _conn->close_stream(*_strm);
+}
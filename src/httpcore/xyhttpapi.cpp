@@ -3,9 +3,13 @@
 #include <unistd.h>
 
 #include "xyhttp.h"
+#include "xyhttp2.h"
 
 #include <zlib.h>
 #include <openssl/sha.h> // used by http_transaction::accept_websocket
+#include <openssl/rand.h>
+#include <algorithm>
+#include <exception>
 #include <cassert>
 #include <ctime>
 
@@ -17,7 +21,8 @@ const string http_transaction::WEBSOCKET_MAGIC("258EAFA5-E914-47DA-95CA-C5AB0DC8
 http_transaction::http_transaction(
     shared_ptr<http_connection> conn, shared_ptr<http_request> req) :
     connection(move(conn)), request(move(req)), _headerSent(false),
-    _finished(false), _transfer_mode(UNDECIDED), _gzip(nullptr) {
+    _finished(false), _transfer_mode(UNDECIDED), _gzip(nullptr),
+    _started(uv_hrtime()), _upstream_time(0), _bytes_sent(0) {
     _response = make_shared<http_response>(200);
     auto contentLength = request->header("content-length");
     if(contentLength) {
@@ -58,6 +63,7 @@ void http_transaction::forward_to(const string &host, int port) {
 
 void http_transaction::forward_to(P<stream> strm) {
     if(header_sent()) throw RTERR("header already sent");
+    uint64_t since = uv_hrtime();
     auto req = make_shared<http_request>(*request);
     req->set_header("X-Forwarded-For", connection->_peername);
     strm->write(req);
@@ -67,6 +73,7 @@ void http_transaction::forward_to(P<stream> strm) {
     while(_response->code() == 100) {
         auto upstream_response = strm->read<http_response>(respdec);
         if (!upstream_response) {
+            _upstream_time += uv_hrtime() - since;
             display_error(502);
             return;
         }
@@ -76,6 +83,7 @@ void http_transaction::forward_to(P<stream> strm) {
         _noGzip = true; // Disable GZIP if upstream has already done compression
     if (_response->code() == 101) {
         _response->delete_header("Upgrade");
+        _upstream_time += uv_hrtime() - since;
         display_error(502);
         return;
     }
@@ -90,10 +98,43 @@ void http_transaction::forward_to(P<stream> strm) {
         }
         catch(runtime_error &ex) { } // EOF won't be thrown outside
     }
+    _upstream_time += uv_hrtime() - since;
+    finish();
+}
+
+/**
+ * Forward the request as one stream of a client HTTP/2 connection, which
+ * other transactions may be using at the same time.
+ */
+void http_transaction::forward_to(P<http2_connection> upstream) {
+    if(header_sent()) throw RTERR("header already sent");
+    auto req = make_shared<http_request>(*request);
+    uint64_t since = uv_hrtime();
+    req->set_header("x-forwarded-for", connection->_peername);
+    http2_client client(move(upstream));
+    try {
+        _response = client.send(req, postdata);
+    }
+    catch(runtime_error &ex) {
+        _upstream_time += uv_hrtime() - since;
+        display_error(502);
+        return;
+    }
+    if(_response->header("Content-Encoding"))
+        _noGzip = true; // Disable GZIP if upstream has already done compression
+    try {
+        while(client.data_available()) {
+            chunk data = client.read();
+            if(data) write(data.data(), data.size());
+        }
+    }
+    catch(runtime_error &ex) { } // Send what we got, like HTTP/1.1 upstreams
+    _upstream_time += uv_hrtime() - since;
     finish();
 }
 
 void http_transaction::forward_to(P<fcgi_connection> conn) {
+    uint64_t since = uv_hrtime();
     conn->set_env("PATH_INFO", request->path());
     conn->set_env("SERVER_PROTOCOL", "HTTP/1.1");
     conn->set_env("CONTENT_TYPE", request->header("content-type"));
@@ -113,18 +154,13 @@ void http_transaction::forward_to(P<fcgi_connection> conn) {
             *(dest++) = (*src == '-') ? '_' : toupper(*src);
         conn->set_env(envKeyBuf, it->second);
     }
-    if(postdata) {
-        int base = 0;
-        while(base < postdata.size()) {
-            int txsize = min<int>(0xFF00, postdata.size() - base);
-            conn->write(postdata.data() + base, txsize);
-            base += txsize;
-        }
-    }
+    if(postdata)
+        conn->write(postdata);
     stream_buffer responseBuffer;
     while(true) {
         chunk data = conn->read();
         if(!data) {
+            _upstream_time += uv_hrtime() - since;
             display_error(502);
             return;
         }
@@ -144,6 +180,7 @@ void http_transaction::forward_to(P<fcgi_connection> conn) {
         if(!msg) break;
         write(msg.data(), msg.size());
     }
+    _upstream_time += uv_hrtime() - since;
     finish();
 }
 
@@ -220,6 +257,19 @@ void http_transaction::serve_file(const string &filename, struct stat &info) {
         _response->set_header("Content-Length", to_string(rest));
         _tx_buffer.pull(_tx_buffer.size());
         start_transfer(SIMPLE);
+        if(!_capture) { // Nothing has to see the body, let the stream send it
+            try {
+                connection->_strm->sendfile(fd, seekTo, rest);
+                _bytes_sent += rest;
+            }
+            catch(runtime_error &ex) {
+                close(fd);
+                throw;
+            }
+            close(fd);
+            finish();
+            return;
+        }
     }
 #ifdef _WIN32
     size_t chunkSize = 8192;
@@ -245,6 +295,7 @@ void http_transaction::serve_file(const string &filename, struct stat &info) {
 shared_ptr<stream> http_transaction::upgrade(bool flush_resp) {
     if(_transfer_mode != UNDECIDED || _gzip)
         throw runtime_error("transaction not in clean state");
+    auto strm = connection->upgrade(); // Throws before responding if impossible
     _tx_buffer.pull(_tx_buffer.size());
     if(flush_resp) {
         start_transfer(UPGRADE);
@@ -253,10 +304,133 @@ shared_ptr<stream> http_transaction::upgrade(bool flush_resp) {
         _headerSent = true;
     }
     _finished = true;
-    return connection->upgrade();
+    return strm;
+}
+
+static void trim_token(string &s) {
+    size_t begin = s.find_first_not_of(" \t"), end = s.find_last_not_of(" \t");
+    s = begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+    if(s.size() >= 2 && s.front() == '"' && s.back() == '"')
+        s = s.substr(1, s.size() - 2);
+}
+
+static vector<string> split_list(const string &s, char sep) {
+    vector<string> items;
+    size_t pos = 0;
+    for(;;) {
+        size_t next = s.find(sep, pos);
+        items.push_back(s.substr(pos, next == string::npos ? string::npos : next - pos));
+        trim_token(items.back());
+        if(next == string::npos)
+            return items;
+        pos = next + 1;
+    }
+}
+
+static bool parse_window_bits(const string &value, int &bits) {
+    if(value.size() < 1 || value.size() > 2 ||
+       value.find_first_not_of("0123456789") != string::npos)
+        return false;
+    bits = atoi(value.c_str());
+    return bits >= 8 && bits <= 15;
+}
+
+// Raw deflate streams from zlib need 9 to 15 window bits
+static inline int deflate_window_bits(int bits) {
+    return max(9, min(bits, MAX_WBITS));
+}
+
+/*
+ * Pick the first permessage-deflate offer (RFC 7692) that fits the policy.
+ * Window sizes are the smaller of what the client asks and the policy
+ * allows. The client's own window can only be limited if it said it
+ * understands client_max_window_bits, so offers without it are passed over
+ * when the policy wants less than 32K. A server window of 256 bytes is
+ * declined, zlib cannot produce it.
+ */
+static bool negotiate_deflate(const string &offers, const websocket_deflate &policy,
+                              websocket_deflate &result, string &accepted) {
+    for(auto &offer : split_list(offers, ',')) {
+        auto tokens = split_list(offer, ';');
+        if(tokens[0] != "permessage-deflate")
+            continue;
+        websocket_deflate params = policy;
+        bool valid = true, seen[4] = { false, false, false, false };
+        bool clientBits = false, serverBits = false;
+        int clientMax = 15, serverMax = 15;
+        for(size_t i = 1; i < tokens.size() && valid; i++) {
+            string name = tokens[i], value;
+            size_t eq = name.find('=');
+            if(eq != string::npos) {
+                value = name.substr(eq + 1);
+                name = name.substr(0, eq);
+                trim_token(name);
+                trim_token(value);
+            }
+            int which = name == "server_no_context_takeover" ? 0 :
+                        name == "client_no_context_takeover" ? 1 :
+                        name == "server_max_window_bits" ? 2 :
+                        name == "client_max_window_bits" ? 3 : -1;
+            if(which < 0 || seen[which]) {
+                valid = false;
+                break;
+            }
+            seen[which] = true;
+            switch(which) {
+                case 0: case 1:
+                    valid = eq == string::npos;
+                    if(which == 0)
+                        params.tx_no_context_takeover = true;
+                    else
+                        params.rx_no_context_takeover = true;
+                    break;
+                case 2:
+                    valid = parse_window_bits(value, serverMax);
+                    serverBits = true;
+                    break;
+                case 3:
+                    valid = eq == string::npos || parse_window_bits(value, clientMax);
+                    clientBits = true;
+                    break;
+            }
+        }
+        if(!valid || serverMax < 9)
+            continue;
+        params.tx_window_bits = min(serverMax, deflate_window_bits(policy.tx_window_bits));
+        params.rx_window_bits = min(clientMax, policy.rx_window_bits);
+        if(!clientBits && params.rx_window_bits < 15)
+            continue;
+        accepted = "permessage-deflate";
+        if(params.tx_no_context_takeover)
+            accepted += "; server_no_context_takeover";
+        if(params.rx_no_context_takeover)
+            accepted += "; client_no_context_takeover";
+        if(serverBits || params.tx_window_bits < 15)
+            accepted += "; server_max_window_bits=" + to_string(params.tx_window_bits);
+        if(clientBits && params.rx_window_bits < 15)
+            accepted += "; client_max_window_bits=" + to_string(params.rx_window_bits);
+        result = params;
+        return true;
+    }
+    return false;
+}
+
+static string websocket_accept_key(const string &key) {
+    string wsaccept = key + http_transaction::WEBSOCKET_MAGIC;
+    unsigned char shabuf[SHA_DIGEST_LENGTH];
+    SHA1((unsigned char *)wsaccept.data(), wsaccept.size(), shabuf);
+    return base64_encode(shabuf, SHA_DIGEST_LENGTH);
 }
 
 P<websocket> http_transaction::accept_websocket() {
+    return accept_websocket(websocket::deflate_policy);
+}
+
+/**
+ * Complete the WebSocket handshake, compressing messages if the client
+ * offers permessage-deflate with parameters the policy can live with.
+ */
+P<websocket> http_transaction::accept_websocket(const websocket_deflate &policy) {
     if(request->method != "GET") {
         display_error(405);
         throw RTERR("WebSocket negotiation expects GET, got %s",
@@ -265,18 +439,130 @@ P<websocket> http_transaction::accept_websocket() {
     auto wskey = request->header("sec-websocket-key");
     if(!request->header("upgrade") || !wskey)
         throw RTERR("Headers necessary for WebSocket handshake not present");
-    string wsaccept = wskey.substr(0) + WEBSOCKET_MAGIC;
-    unsigned char shabuf[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char *)wsaccept.data(), wsaccept.size(), shabuf);
     auto resp = get_response(101);
-    bool permsgDeflate;
+    websocket_deflate params;
+    string accepted;
+    params.enabled = false;
     resp->set_header("Upgrade", "websocket");
-    resp->set_header("Sec-WebSocket-Accept", base64_encode(shabuf, SHA_DIGEST_LENGTH));
-    permsgDeflate = request->header_include("sec-websocket-extensions", "permessage-deflate")
-            && !request->header_include("sec-websocket-extensions", "server_max_window_bits");
-    if(permsgDeflate)
-        resp->set_header("Sec-WebSocket-Extensions", "permessage-deflate");
-    return make_shared<websocket>(upgrade(), permsgDeflate);
+    resp->set_header("Sec-WebSocket-Accept", websocket_accept_key(wskey.substr(0)));
+    auto offers = request->header("sec-websocket-extensions");
+    if(policy.enabled && offers &&
+       negotiate_deflate(string(offers.data(), offers.size()), policy, params, accepted))
+        resp->set_header("Sec-WebSocket-Extensions", accepted);
+    return make_shared<websocket>(upgrade(), params);
+}
+
+/*
+ * What the server agreed to of our offer. It may add limits of its own,
+ * but not loosen ours; a client window of 256 bytes cannot be honoured
+ * with zlib.
+ */
+static bool accept_deflate(const string &response, const websocket_deflate &offer,
+                           websocket_deflate &params) {
+    auto tokens = split_list(response, ';');
+    if(tokens[0] != "permessage-deflate" || response.find(',') != string::npos)
+        return false;
+    params = offer;
+    bool seen[4] = { false, false, false, false };
+    for(size_t i = 1; i < tokens.size(); i++) {
+        string name = tokens[i], value;
+        size_t eq = name.find('=');
+        if(eq != string::npos) {
+            value = name.substr(eq + 1);
+            name = name.substr(0, eq);
+            trim_token(name);
+            trim_token(value);
+        }
+        int which = name == "server_no_context_takeover" ? 0 :
+                    name == "client_no_context_takeover" ? 1 :
+                    name == "server_max_window_bits" ? 2 :
+                    name == "client_max_window_bits" ? 3 : -1;
+        if(which < 0 || seen[which])
+            return false;
+        seen[which] = true;
+        int bits;
+        switch(which) {
+            case 0:
+                params.rx_no_context_takeover = true;
+                break;
+            case 1:
+                params.tx_no_context_takeover = true;
+                break;
+            case 2:
+                if(!parse_window_bits(value, bits) || bits > offer.rx_window_bits)
+                    return false;
+                params.rx_window_bits = bits;
+                break;
+            case 3:
+                if(!parse_window_bits(value, bits) || bits < 9)
+                    return false;
+                params.tx_window_bits = min(bits, deflate_window_bits(offer.tx_window_bits));
+                break;
+        }
+        if(which < 2 && eq != string::npos)
+            return false;
+    }
+    params.enabled = true;
+    return true;
+}
+
+// Response headers keep the case the server sent them in
+static string response_header(const P<http_response> &resp, const char *name) {
+    for(auto it = resp->hbegin(); it != resp->hend(); ++it)
+        if(strcasecmp(it->first.c_str(), name) == 0)
+            return string(it->second.data(), it->second.size());
+    return string();
+}
+
+P<websocket> http_client::open_websocket(const P<http_request> &request) {
+    return open_websocket(request, websocket::deflate_policy);
+}
+
+/**
+ * Do the client side of the WebSocket handshake. The request needs its
+ * resource and Host header set; the connection is not reusable after.
+ * @param offer Compression to offer, in our own terms: tx_* are for what
+ *        we send (client_*), rx_* for what the server sends (server_*).
+ */
+P<websocket> http_client::open_websocket(const P<http_request> &request,
+                                         const websocket_deflate &offer) {
+    unsigned char nonce[16];
+    if(RAND_bytes(nonce, sizeof(nonce)) != 1)
+        throw RTERR("failed to generate WebSocket key");
+    string key = base64_encode(nonce, sizeof(nonce));
+    request->method = "GET";
+    request->set_header("upgrade", "websocket");
+    request->set_header("connection", "Upgrade");
+    request->set_header("sec-websocket-version", "13");
+    request->set_header("sec-websocket-key", key);
+    if(offer.enabled) {
+        string ext = "permessage-deflate";
+        if(offer.tx_no_context_takeover)
+            ext += "; client_no_context_takeover";
+        if(offer.rx_no_context_takeover)
+            ext += "; server_no_context_takeover";
+        if(offer.rx_window_bits < 15)
+            ext += "; server_max_window_bits=" + to_string(offer.rx_window_bits);
+        ext += "; client_max_window_bits";
+        if(offer.tx_window_bits < 15)
+            ext += "=" + to_string(deflate_window_bits(offer.tx_window_bits));
+        request->set_header("sec-websocket-extensions", ext);
+    }
+    auto resp = send(request);
+    _reusable = false;
+    _tsfr_decoder.reset();
+    if(resp->code() != 101)
+        throw RTERR("WebSocket handshake refused with status %d", resp->code());
+    if(strcasecmp(response_header(resp, "Upgrade").c_str(), "websocket") != 0 ||
+       response_header(resp, "Sec-WebSocket-Accept") != websocket_accept_key(key))
+        throw RTERR("WebSocket handshake response is invalid");
+    websocket_deflate params;
+    params.enabled = false;
+    string ext = response_header(resp, "Sec-WebSocket-Extensions");
+    if(!ext.empty() && !(offer.enabled && accept_deflate(ext, offer, params)))
+        throw RTERR("WebSocket extensions not offered: %s", ext.c_str());
+    _stream->set_timeout(0); // The heartbeat takes over
+    return make_shared<websocket>(_stream, params, true);
 }
 
 void http_transaction::redirect_to(const string &dest) {
@@ -311,7 +597,13 @@ void http_transaction::start_transfer(transfer_mode mode) {
     assert(!_headerSent);
     _transfer_mode = mode;
     _response->set_header("Server", SERVER_VERSION);
-    if(_transfer_mode == UPGRADE) {
+    if(connection->multiplexed()) {
+        // Frames delimit the body, so there is nothing to chunk
+        if(_transfer_mode == CHUNKED) {
+            _response->delete_header("Content-Length");
+            _transfer_mode = SIMPLE;
+        }
+    } else if(_transfer_mode == UPGRADE) {
         _response->set_header("Connection", "upgrade");
     } else {
         _response->set_header("Connection",
@@ -321,31 +613,27 @@ void http_transaction::start_transfer(transfer_mode mode) {
             _response->set_header("Transfer-Encoding", "chunked");
         }
     }
-    connection->_strm->write(_response);
+    connection->write_response(_response, _transfer_mode == HEADONLY);
     _headerSent = true;
 }
 
+void http_transaction::capture(function<void(const char *, int)> sink) {
+    _capture = move(sink);
+}
+
 void http_transaction::write(const char *buf, int len) {
     if(_finished)
         throw RTERR("writing to finished transaction");
     if(len == 0)
         return;
-    else if(_gzip) {
-        Bytef outBuf[0x4000];
-        _gzip->next_in = (Bytef *)buf;
-        _gzip->avail_in = len;
-        while(_gzip->avail_in > 0) {
-            _gzip->next_out = outBuf;
-            _gzip->avail_out = sizeof(outBuf);
-            int ret = deflate(_gzip, 0);
-            if(ret != Z_OK)
-                throw runtime_error("GZIP compression failure");
-            if(sizeof(outBuf) - _gzip->avail_out > 0)
-                transfer((char *)&outBuf, sizeof(outBuf) - _gzip->avail_out);
-        }
-    } else {
+    if(_capture) // Observers see the body before content encoding
+        _capture(buf, len);
+    if(_gzip)
+        compress(buf, len);
+    else {
         transfer(buf, len);
-        if(_transfer_mode == UNDECIDED && !_noGzip && _tx_buffer.size() >= 0x200) {
+        if(_transfer_mode == UNDECIDED && !_noGzip && _tx_buffer.size() >= 0x200 &&
+           !_response->header("Content-Encoding")) {
             _gzip = new z_stream;
             _gzip->zalloc = Z_NULL;
             _gzip->zfree = Z_NULL;
@@ -359,16 +647,32 @@ void http_transaction::write(const char *buf, int len) {
             _response->set_header("Content-Encoding", "gzip");
             len = _tx_buffer.size();
             buf = _tx_buffer.detach();
-            write(buf, len);
+            compress(buf, len);
             free((void *)buf);
         }
     }
 }
 
+void http_transaction::compress(const char *buf, int len) {
+    Bytef outBuf[0x4000];
+    _gzip->next_in = (Bytef *)buf;
+    _gzip->avail_in = len;
+    while(_gzip->avail_in > 0) {
+        _gzip->next_out = outBuf;
+        _gzip->avail_out = sizeof(outBuf);
+        int ret = deflate(_gzip, 0);
+        if(ret != Z_OK)
+            throw runtime_error("GZIP compression failure");
+        if(sizeof(outBuf) - _gzip->avail_out > 0)
+            transfer((char *)&outBuf, sizeof(outBuf) - _gzip->avail_out);
+    }
+}
+
 void http_transaction::transfer(const char *buf, int len) {
     switch(_transfer_mode) {
         case SIMPLE:
             connection->_strm->write(buf, len);
+            _bytes_sent += len;
             break;
         case UNDECIDED:
             _tx_buffer.append(buf, len);
@@ -384,6 +688,7 @@ void http_transaction::transfer(const char *buf, int len) {
             connection->_strm->write(chunkHdr, hdrLen);
             connection->_strm->write(buf, len);
             connection->_strm->write("\r\n", 2);
+            _bytes_sent += len;
             break;
         }
         default: break;
@@ -421,17 +726,38 @@ void http_transaction::finish() {
                 _tx_buffer.pull(_tx_buffer.size());
             }
         }
+        else if(_transfer_mode == HEADONLY && !_headerSent)
+            start_transfer(HEADONLY); // HEAD requests
     }
+    connection->end_response();
     _finished = true;
+    if(_completion_hooks.empty())
+        return;
+    http_transaction_stats stats;
+    stats.status = _response->code();
+    stats.bytes = _bytes_sent;
+    stats.service_time = (uv_hrtime() - _started) / 1000;
+    stats.upstream_time = _upstream_time / 1000;
+    stats.tls = connection->has_tls();
+    for(auto &hook : _completion_hooks)
+        hook(*this, stats);
+}
+
+void http_transaction::on_complete(completion_hook hook) {
+    _completion_hooks.push_back(move(hook));
 }
 
-websocket_frame::decoder::decoder(int maxPayloadLen)
-        : _max_payload(maxPayloadLen) {}
+websocket_frame::decoder::decoder(int maxPayloadLen, size_t maxPiece)
+        : _max_payload(maxPayloadLen), _max_piece(maxPiece), _remaining(0),
+          _offset(0), _op(0), _masked(false) {}
 
 bool websocket_frame::decoder::decode(stream_buffer &stb) {
+    if(_remaining > 0)
+        return decode_piece(stb);
     unsigned char *frame = (unsigned char *)stb.data();
-    int opcode_and_fin, payload_length, masked;
-    int expectedLength = 2;
+    int opcode_and_fin, masked;
+    uint64_t payload_length;
+    size_t expectedLength = 2;
     if(stb.size() < expectedLength) return false;
     opcode_and_fin = frame[0];
     payload_length = frame[1] & 0x7f;
@@ -440,10 +766,11 @@ bool websocket_frame::decoder::decode(stream_buffer &stb) {
     if(payload_length == 127) {
         expectedLength += 8;
         if(stb.size() < expectedLength) return false;
-        if(frame[0] != 0 || frame[1] != 0 || frame[2] != 0 ||
-           frame[3] != 0 || frame[4] != 0)
+        if(frame[0] & 0x80)
             throw runtime_error("payload too long");
-        payload_length = (frame[5] << 16) + (frame[6] << 8) + frame[7];
+        payload_length = 0;
+        for(int i = 0; i < 8; i++)
+            payload_length = payload_length << 8 | frame[i];
         frame += 8;
     }
     else if(payload_length == 126) {
@@ -452,7 +779,18 @@ bool websocket_frame::decoder::decode(stream_buffer &stb) {
         payload_length = (frame[0] << 8) + frame[1];
         frame += 2;
     }
-    if(payload_length > _max_payload) // Avoid DoS Attack of Giant Frame
+    if(_max_piece && payload_length > _max_piece && !(opcode_and_fin & 8)) {
+        if(stb.size() < expectedLength) return false;
+        _op = opcode_and_fin;
+        _masked = masked;
+        if(masked)
+            memcpy(_mask, frame, 4);
+        _remaining = payload_length;
+        _offset = 0;
+        stb.pull(expectedLength);
+        return decode_piece(stb);
+    }
+    if(payload_length > (uint64_t)_max_payload) // Avoid DoS Attack of Giant Frame
         throw runtime_error("max payload length limit exceeded");
     expectedLength += payload_length;
     if(stb.size() < expectedLength) return false;
@@ -460,8 +798,7 @@ bool websocket_frame::decoder::decode(stream_buffer &stb) {
         if(masked) {
             unsigned char *mask = frame;
             frame += 4;
-            for(int i = 0; i < payload_length; i++)
-                frame[i] ^= mask[i % 4];
+            websocket_frame::apply_mask((char *)frame, payload_length, (char *)mask);
         }
         _msg = make_shared<websocket_frame>(opcode_and_fin, chunk((char *)frame, payload_length));
     } else {
@@ -471,10 +808,27 @@ bool websocket_frame::decoder::decode(stream_buffer &stb) {
     return true;
 }
 
-websocket_frame::websocket_frame(int op, chunk pl) : _op(op), _payload(pl) {}
+bool websocket_frame::decoder::decode_piece(stream_buffer &stb) {
+    if(stb.size() == 0)
+        return false;
+    size_t n = min<uint64_t>(min(stb.size(), _max_piece), _remaining);
+    if(_masked)
+        websocket_frame::apply_mask(stb.data(), n, _mask, _offset);
+    int op = _offset == 0 ? _op & 0x4f : 0;
+    _offset += n;
+    _remaining -= n;
+    if(_remaining == 0)
+        op |= _op & 0x80;
+    _msg = make_shared<websocket_frame>(op, chunk(stb.data(), n));
+    stb.pull(n);
+    return true;
+}
+
+websocket_frame::websocket_frame(int op, chunk pl)
+        : _op(op), _payload(pl), _masked(false), _more(false) {}
 
 int websocket_frame::serialize_size() {
-    int estimatedLength = 2;
+    int estimatedLength = _masked ? 6 : 2;
     if(_payload) {
         if(_payload.size() > 0xffff)
             estimatedLength += 8;
@@ -487,15 +841,14 @@ int websocket_frame::serialize_size() {
 
 void websocket_frame::serialize(char *buf) {
     char *payloadBase = buf + 2;
-    buf[0] = 0x80 | (_op & 0x4f);
+    buf[0] = (_more ? 0 : 0x80) | (_op & 0x4f);
     if(!_payload) {
         buf[1] = 0;
-        return;
     }
     else if(_payload.size() > 0xffff) {
         buf[1] = 127;
         buf[2] = buf[3] = buf[4] = buf[5] = 0;
-        buf[6] = (_payload.size() >> 24) & 0x7f;
+        buf[6] = (_payload.size() >> 24) & 0xff;
         buf[7] = (_payload.size() >> 16) & 0xff;
         buf[8] = (_payload.size() >> 8) & 0xff;
         buf[9] = _payload.size() & 0xff;
@@ -509,127 +862,689 @@ void websocket_frame::serialize(char *buf) {
     } else {
         buf[1] = _payload.size();
     }
+    if(_masked) {
+        buf[1] |= 0x80;
+        memcpy(payloadBase, _mask, 4);
+        payloadBase += 4;
+    }
+    if(!_payload)
+        return;
     memcpy(payloadBase, _payload.data(), _payload.size());
+    if(_masked)
+        apply_mask(payloadBase, _payload.size(), _mask);
 }
 
 websocket_frame::~websocket_frame() {}
 
+websocket_deflate::websocket_deflate() :
+        enabled(true), level(Z_BEST_COMPRESSION), mem_level(MAX_MEM_LEVEL),
+        tx_window_bits(MAX_WBITS), rx_window_bits(MAX_WBITS),
+        tx_no_context_takeover(false), rx_no_context_takeover(false) {}
+
+websocket_deflate websocket::deflate_policy;
+int websocket::default_ping_interval = 30000;
+int websocket::default_idle_timeout = 90000;
+
+static websocket_deflate default_deflate(bool enabled) {
+    websocket_deflate params;
+    params.enabled = enabled;
+    return params;
+}
+
 websocket::websocket(const shared_ptr<stream> &strm, bool deflate) :
-        _strm(strm), _decoder(make_shared<websocket_frame::decoder>(0x100000)),
-        _tx_zs(nullptr), _rx_zs(nullptr), _msg_deflated(false), _alive(true) {
-    if (deflate) {
+        websocket(strm, default_deflate(deflate)) {}
+
+/**
+ * The compression contexts are set up with the first message that needs
+ * them, and dropped after each message on the sides without context
+ * takeover, so idle connections hold no zlib memory there.
+ */
+websocket::websocket(const shared_ptr<stream> &strm, const websocket_deflate &params,
+                     bool client) :
+        _strm(strm), _deflate(params),
+        _msg_deflated(false), _msg_binary(false), _msg_end(false), _rx_fin(false),
+        _rx_tail(false), _alive(true), _writing(false), _tx_op(-1), _tx_deflated(false),
+        _fragment(0x10000), _max_message(0x1000000), _last_rx(uv_now(uv_default_loop())),
+        _ping_interval(0), _idle_timeout(0), _client(client), _mask_pos(sizeof(_masks)),
+        _tx_zs(nullptr), _rx_zs(nullptr),
+        _decoder(make_shared<websocket_frame::decoder>(0x100000, 0x10000)), _txq_bytes(0) {
+    _heartbeat.callback = [this] () { heartbeat(); };
+    set_heartbeat(default_ping_interval, default_idle_timeout);
+}
+
+static z_stream *new_deflater(int level, int windowBits, int memLevel) {
+    auto zs = new z_stream;
+    zs->zalloc = nullptr;
+    zs->zfree = nullptr;
+    zs->opaque = nullptr;
+    if(deflateInit2(zs, level, Z_DEFLATED, -windowBits, memLevel,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete zs;
+        throw runtime_error("failed to initialize z_stream");
+    }
+    return zs;
+}
+
+// The message body, without the empty block that ends the sync flush
+static chunk deflate_message(z_stream *zs, const chunk &msg) {
+    zs->next_in = (Bytef *)msg.data();
+    zs->avail_in = msg.size();
+    stream_buffer sb;
+    do {
+        zs->next_out = (Bytef *)sb.prepare(XY_PAGESIZE);
+        zs->avail_out = XY_PAGESIZE;
+        int ret = deflate(zs, Z_SYNC_FLUSH);
+        if(ret != Z_OK && ret != Z_BUF_ERROR)
+            throw runtime_error("deflate failure");
+        sb.commit(XY_PAGESIZE - zs->avail_out);
+    } while(zs->avail_out == 0);
+    return chunk(sb.data(), sb.size() - 4);
+}
+
+z_stream *websocket::tx_zstream() {
+    if(!_tx_zs)
+        _tx_zs = new_deflater(_deflate.level, _deflate.tx_window_bits, _deflate.mem_level);
+    return _tx_zs;
+}
+
+z_stream *websocket::rx_zstream() {
+    if(!_rx_zs) {
         _rx_zs = new z_stream;
         _rx_zs->zalloc = nullptr;
         _rx_zs->zfree = nullptr;
         _rx_zs->opaque = nullptr;
-        if (inflateInit2(_rx_zs, -MAX_WBITS) != Z_OK) {
+        _rx_zs->next_in = nullptr;
+        _rx_zs->avail_in = 0;
+        // zlib deflaters asked for 256 bytes use 512
+        if(inflateInit2(_rx_zs, -max(_deflate.rx_window_bits, 9)) != Z_OK) {
             delete _rx_zs;
+            _rx_zs = nullptr;
             throw runtime_error("failed to initialize z_stream");
         }
-        _tx_zs = new z_stream;
-        _tx_zs->zalloc = nullptr;
-        _tx_zs->zfree = nullptr;
-        _tx_zs->opaque = nullptr;
-        if (deflateInit2(_tx_zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
-                         MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
-            delete _tx_zs;
-            _tx_zs = nullptr;
-        }
+    }
+    return _rx_zs;
+}
+
+void websocket::release_zstreams(bool tx, bool rx) {
+    if(rx && _rx_zs) {
+        inflateEnd(_rx_zs);
+        delete _rx_zs;
+        _rx_zs = nullptr;
+    }
+    if(tx && _tx_zs) {
+        deflateEnd(_tx_zs);
+        delete _tx_zs;
+        _tx_zs = nullptr;
     }
 }
 
+/**
+ * Wait for a whole message. Messages that arrived in one piece are handed
+ * over as they are, fragmented ones are copied together.
+ */
 bool websocket::poll() {
     if(_done)
         return true;
+    _reassembled.pull(_reassembled.size());
+    while(true) {
+        chunk piece = read_some();
+        if(!_msg_end && !_alive)
+            return false;
+        if(_msg_end && _reassembled.size() == 0) {
+            _done = move(piece);
+            return true;
+        }
+        if(_reassembled.size() + piece.size() > _max_message) {
+            cleanup();
+            throw RTERR("max message length limit exceeded");
+        }
+        if(piece)
+            _reassembled.append(piece.data(), piece.size());
+        if(_msg_end) {
+            _done = _reassembled.dump();
+            _reassembled.pull(_reassembled.size());
+            return true;
+        }
+    }
+}
+
+chunk websocket::read() {
+    chunk result;
+    if(_done || poll())
+        result = move(_done);
+    return result;
+}
+
+/**
+ * Read the next piece of the current message, or the first one of the
+ * next, answering control frames on the way.
+ * @return nullptr once the websocket is closed. message_end() tells
+ *         whether this was the last piece.
+ */
+chunk websocket::read_some() {
+    _msg_end = false;
     while(_alive) {
         try {
+            if(_rx_input || _rx_tail) {
+                chunk piece = inflate_some();
+                if(!piece.empty() || _msg_end)
+                    return piece;
+                continue;
+            }
             auto frame = _strm->read<websocket_frame>(_decoder);
+            _last_rx = uv_now(uv_default_loop());
             switch(frame->opcode()) {
                 case 0: break;  // CONTINUATION
                 case 1: case 2: // DATA OR TEXT
-                    _reassembled.pull(_reassembled.size());
                     _msg_deflated = frame->deflated();
+                    _msg_binary = frame->opcode() == 2;
                     break;
                 case 8: // CLOSE
                     cleanup();
                     continue;
                 case 9: // PING
-                    _strm->write(make_shared<websocket_frame>(10, frame->payload()));
+                    send(make_shared<websocket_frame>(10, frame->payload()));
+                    continue;
+                default:
                     continue;
             }
-            if(frame->payload())
-                _reassembled.append(frame->payload().data(), frame->payload().size());
-            if(frame->fin()) {
-                if(_msg_deflated && _reassembled.size() > 0) {
-                    if(!_rx_zs)
-                        throw runtime_error("message is deflated");
-                    _reassembled.append("\0\0\xff\xff", 4);
-                    _rx_zs->avail_in = _reassembled.size();
-                    char *detached = _reassembled.detach();
-                    _rx_zs->next_in = (Bytef *)detached;
-                    while(_rx_zs->avail_in) {
-                        _rx_zs->next_out = (Bytef *)_reassembled.prepare(XY_PAGESIZE);
-                        _rx_zs->avail_out = XY_PAGESIZE;
-                        int r = 0;
-                        if((r = inflate(_rx_zs, Z_SYNC_FLUSH)) != Z_OK)
-                            throw runtime_error("inflate failure");
-                        _reassembled.commit(XY_PAGESIZE - _rx_zs->avail_out);
-                    }
-                    _msg_deflated = false;
-                }
-                // TODO: optimize stream_buffer::dump() to avoid copy
-                _done = _reassembled.dump();
-                _reassembled.pull(_reassembled.size());
-                return true;
+            if(!_msg_deflated) {
+                _msg_end = frame->fin();
+                return frame->payload();
             }
+            if(!_deflate.enabled)
+                throw runtime_error("message is deflated");
+            _rx_input = frame->payload();
+            _rx_fin = frame->fin();
+            _rx_tail = false;
+            z_stream *zs = rx_zstream();
+            zs->next_in = (Bytef *)_rx_input.data();
+            zs->avail_in = _rx_input.size();
         }
         catch(runtime_error &ex) {
             cleanup();
             throw;
         }
     }
-    return false;
+    return nullptr;
 }
 
-chunk websocket::read() {
-    chunk result;
-    if(_done || poll())
-        result = move(_done);
-    return result;
+/**
+ * Inflate what is left of the current frame, up to 8 pages at a time, so
+ * a small frame cannot blow up into a huge buffer. The empty block the
+ * sender stripped is put back after the last frame.
+ */
+chunk websocket::inflate_some() {
+    static char tail[] = { 0, 0, '\xff', '\xff' };
+    z_stream *zs = _rx_zs;
+    stream_buffer out;
+    size_t room = XY_PAGESIZE * 8;
+    zs->next_out = (Bytef *)out.prepare(room);
+    zs->avail_out = room;
+    for(;;) {
+        if(zs->avail_in == 0 && _rx_fin && !_rx_tail) {
+            zs->next_in = (Bytef *)tail;
+            zs->avail_in = 4;
+            _rx_tail = true;
+        }
+        int r = inflate(zs, Z_SYNC_FLUSH);
+        if(r != Z_OK && r != Z_BUF_ERROR)
+            throw runtime_error("inflate failure");
+        if(zs->avail_out == 0)
+            break; // There may be more
+        if(zs->avail_in == 0 && (!_rx_fin || _rx_tail)) {
+            _rx_input = nullptr;
+            _rx_tail = false;
+            if(_rx_fin) {
+                _msg_end = true;
+                _msg_deflated = false;
+                release_zstreams(false, _deflate.rx_no_context_takeover);
+            }
+            break;
+        }
+    }
+    out.commit(room - zs->avail_out);
+    return chunk(out.data(), out.size());
 }
 
 void websocket::send(const chunk &str) {
-    if(_tx_zs && !str.empty()) {
-        _tx_zs->next_in = (Bytef *)str.data();
-        _tx_zs->avail_in = str.size();
-        stream_buffer sb;
-        while(_tx_zs->avail_in) {
-            _tx_zs->next_out = (Bytef *)sb.prepare(XY_PAGESIZE);
-            _tx_zs->avail_out = XY_PAGESIZE;
-            if(deflate(_tx_zs, Z_SYNC_FLUSH) != Z_OK)
-                throw runtime_error("deflate failure");
-            sb.commit(XY_PAGESIZE - _tx_zs->avail_out);
-        }
-        _strm->write(make_shared<websocket_frame>(0x41, chunk(sb.data(), sb.size() - 4)));
-    } else {
-        _strm->write(make_shared<websocket_frame>(1, str));
+    send_some(str, true);
+}
+
+/**
+ * Send a piece of a message, fin telling whether it is the last one. It is
+ * framed, and deflated if negotiated, as it comes; frames are cut at the
+ * fragment size. A fiber starting a message while another one's is still
+ * going out waits for its end.
+ */
+void websocket::send_some(const chunk &piece, bool fin, bool binary) {
+    wait_turn();
+    if(!_alive)
+        throw RTERR("websocket is closed");
+    if(_tx_op < 0) {
+        _tx_op = binary ? 2 : 1;
+        _tx_deflated = _deflate.enabled && !(fin && piece.empty());
+        if(_tx_deflated)
+            _tx_op |= 0x40;
+        _tx_owner = fiber::current();
+    }
+    exception_ptr error;
+    try {
+        send_piece(piece, fin);
     }
+    catch(runtime_error &ex) {
+        error = current_exception(); // Others may send once we are out of here
+    }
+    if(fin || error)
+        end_message();
+    if(error)
+        rethrow_exception(error);
+}
+
+void websocket::send_piece(const chunk &piece, bool fin) {
+    size_t fragment = _fragment ? _fragment : SIZE_MAX;
+    if(!_tx_deflated) {
+        if(piece.empty() && fin)
+            send_fragment(piece, true);
+        for(size_t pos = 0; pos < piece.size(); ) {
+            size_t n = min(piece.size() - pos, fragment);
+            if(n == piece.size())
+                send_fragment(piece, fin);
+            else
+                send_fragment(chunk(piece.data() + pos, n), fin && pos + n == piece.size());
+            pos += n;
+        }
+        return;
+    }
+    z_stream *zs = tx_zstream();
+    zs->next_in = (Bytef *)piece.data();
+    zs->avail_in = piece.size();
+    do {
+        zs->next_out = (Bytef *)_tx_pending.prepare(XY_PAGESIZE);
+        zs->avail_out = XY_PAGESIZE;
+        int ret = deflate(zs, fin ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_BUF_ERROR)
+            throw runtime_error("deflate failure");
+        _tx_pending.commit(XY_PAGESIZE - zs->avail_out);
+        // The last 4 bytes may be the empty block to strip, hold them back
+        while(_tx_pending.size() >= fragment + 4) {
+            send_fragment(chunk(_tx_pending.data(), fragment), false);
+            _tx_pending.pull(fragment);
+        }
+        zs = _tx_zs; // Closing while a fragment was written releases it
+        if(!zs)
+            throw RTERR("websocket is closed");
+    } while(zs->avail_in || zs->avail_out == 0);
+    if(fin) {
+        send_fragment(chunk(_tx_pending.data(), _tx_pending.size() - 4), true);
+        _tx_pending.pull(_tx_pending.size());
+        release_zstreams(_deflate.tx_no_context_takeover, false);
+    }
+}
+
+void websocket::send_fragment(const chunk &payload, bool fin) {
+    auto frame = make_shared<websocket_frame>(_tx_op, payload);
+    frame->set_more(!fin);
+    _tx_op = 0; // Until the last fragment is out
+    send(frame);
+}
+
+// Frames of two messages must not interleave
+void websocket::wait_turn() {
+    while(_tx_op >= 0 && _tx_owner != fiber::current()) {
+        _tx_waiters.push_back(fiber::current());
+        int status = fiber::yield();
+        if(status < 0)
+            throw IOERR(status);
+    }
+}
+
+/**
+ * The message is out, or failed: queue the data frames posted meanwhile,
+ * which could not go between its fragments, then let the next sender in.
+ */
+void websocket::end_message() {
+    _tx_op = -1;
+    _tx_owner.reset();
+    _tx_pending.pull(_tx_pending.size());
+    release_held();
+    if(!_tx_waiters.empty()) {
+        P<fiber> next = move(_tx_waiters.front());
+        _tx_waiters.pop_front();
+        next->resume(0);
+    }
+}
+
+void websocket::release_held() {
+    if(_held.empty())
+        return;
+    bool deflated = false;
+    for(auto &entry : _held) {
+        deflated = deflated || entry.second;
+        _txq.push_back({ move(entry.first), nullptr });
+    }
+    _held.clear();
+    if(deflated)
+        release_zstreams(true, false);
+    if(!_writing) {
+        auto self = shared_from_this();
+        _writing = true;
+        fiber::launch([self] () { self->write_loop(); });
+    }
+}
+
+static chunk serialize_frame(websocket_frame &frame) {
+    string wire(frame.serialize_size(), '\0');
+    frame.serialize(&wire[0]);
+    return chunk(wire);
+}
+
+/**
+ * Send a frame, after the frames posted before it.
+ */
+void websocket::send(P<websocket_frame> frame) {
+    if(frame->opcode() < 8) // Not between the fragments of another message
+        wait_turn();
+    if(!_alive)
+        throw RTERR("websocket is closed");
+    if(_client)
+        mask_frame(*frame);
+    if(_writing || !_txq.empty()) { // Wait for the writer to get to it
+        chunk wire = serialize_frame(*frame);
+        _txq_bytes += wire.size();
+        _txq.push_back({ move(wire), fiber::current() });
+        int status = fiber::yield();
+        if(status < 0)
+            throw IOERR(status);
+        return;
+    }
+    P<stream> strm = _strm;
+    int status = 0;
+    _writing = true;
+    try {
+        strm->write(frame);
+    }
+    catch(runtime_error &ex) {
+        status = UV_EPIPE;
+    }
+    _writing = false;
+    if(status < 0) {
+        fail_queue(status);
+        throw IOERR(status);
+    }
+    if(!_txq.empty()) { // Posted meanwhile
+        auto self = shared_from_this();
+        _writing = true;
+        fiber::launch([self] () { self->write_loop(); });
+    }
+}
+
+/**
+ * Queue a serialized frame without waiting for it to be written. Data
+ * frames posted while a fragmented message is being sent go after it.
+ * @param deflated The frame was compressed on its own. Our compression
+ *        context restarts, so later messages refer to nothing the peer
+ *        received in between.
+ * @param limit Refuse the frame if it would queue more bytes than this.
+ * @return Whether the frame was queued.
+ */
+bool websocket::post(const chunk &frame, bool deflated, size_t limit) {
+    if(!_alive)
+        return false;
+    if(_txq_bytes > 0 && _txq_bytes + frame.size() > limit)
+        return false;
+    _txq_bytes += frame.size();
+    // Only control frames may go between the fragments of a message
+    bool control = frame.size() > 0 && (frame.data()[0] & 0x08);
+    if(_tx_op >= 0 && !control) {
+        _held.emplace_back(frame, deflated);
+        return true;
+    }
+    if(deflated)
+        release_zstreams(true, false);
+    _txq.push_back({ frame, nullptr });
+    if(!_writing) {
+        auto self = shared_from_this();
+        _writing = true;
+        fiber::launch([self] () { self->write_loop(); });
+    }
+    return true;
+}
+
+// Every frame from a client gets a fresh unpredictable key (RFC 6455 5.3)
+void websocket::mask_frame(websocket_frame &frame) {
+    if(_mask_pos + 4 > sizeof(_masks)) {
+        if(RAND_bytes(_masks, sizeof(_masks)) != 1)
+            throw RTERR("failed to generate masking keys");
+        _mask_pos = 0;
+    }
+    frame.set_mask((char *)_masks + _mask_pos);
+    _mask_pos += 4;
+}
+
+void websocket::set_heartbeat(int pingInterval, int idleTimeout) {
+    _ping_interval = max(pingInterval, 0);
+    _idle_timeout = max(idleTimeout, 0);
+    if(!_alive || (_ping_interval == 0 && _idle_timeout == 0)) {
+        _heartbeat.cancel();
+        return;
+    }
+    int first = _ping_interval == 0 ? _idle_timeout :
+                _idle_timeout == 0 ? _ping_interval : min(_ping_interval, _idle_timeout);
+    timer_wheel::shared().schedule(_heartbeat, first);
+}
+
+/**
+ * Runs on the shared timer wheel. Pings go through the write queue, so
+ * they never wait; a peer silent for too long has its reader woken up
+ * with ETIMEDOUT. Frames are only seen when read: while nobody reads, the
+ * peer's pongs wait in the socket, and only pings go out.
+ */
+void websocket::heartbeat() {
+    auto self = shared_from_this(); // The reader may drop the last reference
+    if(!_alive)
+        return;
+    uint64_t idle = uv_now(uv_default_loop()) - _last_rx;
+    P<stream> strm = _strm;
+    if(_idle_timeout > 0 && idle >= (uint64_t)_idle_timeout && strm && strm->reading_fiber) {
+        strm->cancel_read(UV_ETIMEDOUT);
+        return;
+    }
+    uint64_t next = UINT64_MAX;
+    if(_ping_interval > 0) {
+        if(idle >= (uint64_t)_ping_interval) {
+            websocket_frame ping(9, nullptr);
+            if(_client)
+                mask_frame(ping);
+            post(serialize_frame(ping), false, SIZE_MAX);
+            next = _ping_interval;
+        } else {
+            next = _ping_interval - idle;
+        }
+    }
+    if(_idle_timeout > 0) // Or look again in a while if nobody reads
+        next = min(next, idle < (uint64_t)_idle_timeout ? _idle_timeout - idle : _idle_timeout);
+    timer_wheel::shared().schedule(_heartbeat, next);
+}
+
+void websocket::write_loop() {
+    P<stream> strm = _strm;
+    int status = 0;
+    while(!_txq.empty() && strm) {
+        chunk frame = _txq.front().frame;
+        try {
+            strm->write(frame.data(), frame.size());
+        }
+        catch(runtime_error &ex) {
+            status = UV_EPIPE;
+            break;
+        }
+        if(_txq.empty()) // Closed meanwhile
+            break;
+        P<fiber> waiter = move(_txq.front().waiter);
+        _txq_bytes -= _txq.front().frame.size();
+        _txq.pop_front();
+        if(waiter)
+            waiter->resume(0);
+    }
+    _writing = false;
+    if(!_txq.empty())
+        fail_queue(status < 0 ? status : UV_ECONNABORTED);
+}
+
+void websocket::fail_queue(int status) {
+    auto queue = move(_txq);
+    _txq.clear();
+    _held.clear();
+    _txq_bytes = 0;
+    auto senders = move(_tx_waiters);
+    _tx_waiters.clear();
+    for(auto &entry : queue)
+        if(entry.waiter)
+            entry.waiter->resume(status);
+    for(auto &sender : senders)
+        sender->resume(status);
+}
+
+/**
+ * Drop the connection. Queued frames are discarded and a fiber polling
+ * the websocket gets an error.
+ */
+void websocket::close() {
+    if(!_alive)
+        return;
+    _alive = false;
+    fail_queue(UV_ECONNABORTED);
+    P<stream> strm = _strm;
+    if(strm && strm->reading_fiber)
+        strm->cancel_read(UV_ECONNABORTED); // The reader cleans up
+    else
+        cleanup();
 }
 
 void websocket::cleanup() {
     _alive = false;
     _reassembled.pull(_reassembled.size());
     _strm.reset();
-    if(_rx_zs) {
-        inflateEnd(_rx_zs);
-        delete _rx_zs;
-        _rx_zs = nullptr;
+    _heartbeat.cancel();
+    release_zstreams(true, true);
+}
+
+websocket::~websocket() { cleanup(); }
+
+websocket_hub::websocket_hub(size_t maxQueued, slow_policy policy)
+        : _max_queued(maxQueued), _policy(policy), _zs(nullptr),
+          _zs_bits(0), _zs_level(0), _zs_mem_level(0) {}
+
+websocket_hub::~websocket_hub() {
+    if(_zs) {
+        deflateEnd(_zs);
+        delete _zs;
     }
-    if(_tx_zs) {
-        deflateEnd(_tx_zs);
-        delete _tx_zs;
-        _tx_zs = nullptr;
+}
+
+void websocket_hub::subscribe(const string &topic, const P<websocket> &ws) {
+    auto &subs = _topics[topic];
+    if(find(subs.begin(), subs.end(), ws) == subs.end())
+        subs.push_back(ws);
+}
+
+void websocket_hub::unsubscribe(const string &topic, const P<websocket> &ws) {
+    auto it = _topics.find(topic);
+    if(it == _topics.end())
+        return;
+    auto &subs = it->second;
+    auto pos = find(subs.begin(), subs.end(), ws);
+    if(pos != subs.end()) {
+        *pos = move(subs.back());
+        subs.pop_back();
     }
+    if(subs.empty())
+        _topics.erase(it);
+}
+
+void websocket_hub::unsubscribe(const P<websocket> &ws) {
+    vector<string> topics;
+    for(auto &it : _topics)
+        topics.push_back(it.first);
+    for(auto &topic : topics)
+        unsubscribe(topic, ws);
 }
 
-websocket::~websocket() { cleanup(); }
\ No newline at end of file
+size_t websocket_hub::subscribers(const string &topic) const {
+    auto it = _topics.find(topic);
+    return it == _topics.end() ? 0 : it->second.size();
+}
+
+/**
+ * Send a message to every subscriber of a topic. Closed subscribers are
+ * forgotten on the way.
+ * @return How many subscribers it was queued to.
+ */
+int websocket_hub::publish(const string &topic, const chunk &msg, bool binary) {
+    auto it = _topics.find(topic);
+    if(it == _topics.end())
+        return 0;
+    auto &subs = it->second;
+    int opcode = binary ? 2 : 1, count = 0;
+    chunk plain, deflated[16], packed[16]; // Compressed once per server window size
+    vector<P<websocket>> slow;
+    for(size_t i = 0; i < subs.size(); ) {
+        auto &ws = subs[i];
+        bool compress = ws->deflate_enabled() && !msg.empty();
+        if(ws->alive()) {
+            auto &params = ws->deflate_params();
+            chunk &frame = compress ? deflated[params.tx_window_bits] : plain;
+            chunk &payload = packed[params.tx_window_bits];
+            if(!payload && compress) {
+                // Compressed on its own, as any subscriber may receive it
+                if(_zs && (_zs_bits != params.tx_window_bits || _zs_level != params.level
+                           || _zs_mem_level != params.mem_level)) {
+                    deflateEnd(_zs);
+                    delete _zs;
+                    _zs = nullptr;
+                }
+                if(!_zs) {
+                    _zs = new_deflater(params.level, params.tx_window_bits, params.mem_level);
+                    _zs_bits = params.tx_window_bits;
+                    _zs_level = params.level;
+                    _zs_mem_level = params.mem_level;
+                } else {
+                    deflateReset(_zs);
+                }
+                payload = deflate_message(_zs, msg);
+            }
+            int op = compress ? 0x40 | opcode : opcode;
+            chunk wire;
+            if(ws->_client) { // Masked with a key of its own (RFC 6455 5.3)
+                websocket_frame f(op, compress ? payload : msg);
+                ws->mask_frame(f);
+                wire = serialize_frame(f);
+            } else {
+                if(!frame) {
+                    websocket_frame f(op, compress ? payload : msg);
+                    frame = serialize_frame(f);
+                }
+                wire = frame;
+            }
+            if(ws->post(wire, compress, _max_queued)) {
+                count++;
+                i++;
+                continue;
+            }
+            if(_policy == DROP) {
+                i++;
+                continue;
+            }
+            slow.push_back(ws);
+        }
+        subs[i] = move(subs.back());
+        subs.pop_back();
+    }
+    if(subs.empty())
+        _topics.erase(it);
+    // Readers of disconnected subscribers wake up now, they may unsubscribe
+    for(auto &ws : slow)
+        ws->close();
+    return count;
+}
\ No newline at end of file
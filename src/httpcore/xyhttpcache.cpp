@@ -0,0 +1,382 @@
+#include "xyhttpsvc.h"
+
+#include <cstring>
+#include <ctime>
+#include <climits>
+#include <strings.h>
+
+#ifdef _WIN32
+# define timegm _mkgmtime
+#endif
+
+using namespace std;
+
+/*
+ * Background revalidation runs a transaction that has no client. This stream
+ * stands in for the client socket and drops everything sent to it, so the
+ * refreshed body is only seen by the transaction's capture sink.
+ */
+class discard_stream : public stream {
+public:
+    discard_stream() { handle = nullptr; }
+    virtual void read(const P<decoder> &) {
+        throw RTERR("reading from discard stream");
+    }
+    virtual void write(const char *, int) {}
+};
+
+static bool find_directive(const chunk &hdr, const char *name, long *value = nullptr) {
+    if(!hdr) return false;
+    size_t nameLen = strlen(name);
+    const char *p = hdr.data(), *end = p + hdr.size();
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == ',')) p++;
+        const char *token = p;
+        while(p < end && *p != ',' && *p != '=' && *p != ' ') p++;
+        bool matched = (size_t)(p - token) == nameLen && strncasecmp(token, name, nameLen) == 0;
+        while(p < end && *p == ' ') p++;
+        long v = 0;
+        if(p < end && *p == '=') {
+            p++;
+            if(p < end && *p == '"') {
+                const char *quoteEnd = (const char *)memchr(p + 1, '"', end - p - 1);
+                v = strtol(p + 1, nullptr, 10);
+                p = quoteEnd ? quoteEnd + 1 : end;
+            } else {
+                v = strtol(p, nullptr, 10);
+            }
+        }
+        if(matched) {
+            if(value) *value = v;
+            return true;
+        }
+        while(p < end && *p != ',') p++;
+    }
+    return false;
+}
+
+static time_t parse_http_date(const chunk &str) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    char mon[4];
+    int year;
+    if(!str) return -1;
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(str.data(), "%*[a-zA-Z], %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+              &year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    const char *monPos = strstr(months, mon);
+    if(!monPos || (monPos - months) % 3 != 0)
+        return -1;
+    tm.tm_mon = (monPos - months) / 3;
+    tm.tm_year = year - 1900;
+    return timegm(&tm);
+}
+
+static bool is_hop_header(const string &key) {
+    static const char *hopHeaders[] = {
+            "Connection", "Keep-Alive", "Transfer-Encoding",
+            "Content-Length", "Server", "Age", "X-Cache" };
+    for(auto name : hopHeaders)
+        if(strcasecmp(key.c_str(), name) == 0)
+            return true;
+    return false;
+}
+
+cache_service::cache_service(P<http_service> upstream, size_t capacity)
+    : _upstream(move(upstream)), _capacity(capacity), _bytes(0),
+      _max_entry(0x100000), _forced_ttl(0), _stale_ttl(0), _pass_ttl(5000) {}
+
+/**
+ * Cache every cacheable response for a fixed time, ignoring the freshness
+ * the backend declares. no-store, private and Set-Cookie are still honoured.
+ * @param ms Time-to-live in milliseconds, 0 to honour Cache-Control/Expires.
+ */
+void cache_service::set_forced_ttl(int ms) {
+    _forced_ttl = ms;
+}
+
+/**
+ * Default stale-while-revalidate window, used when the backend does not
+ * send a stale-while-revalidate directive itself.
+ * @param ms Window in milliseconds after expiry.
+ */
+void cache_service::set_stale_ttl(int ms) {
+    _stale_ttl = ms;
+}
+
+/**
+ * How long an uncacheable URI keeps bypassing request coalescing.
+ * @param ms Time in milliseconds, 0 to disable hit-for-pass markers.
+ */
+void cache_service::set_pass_ttl(int ms) {
+    _pass_ttl = ms;
+}
+
+void cache_service::set_max_entry_size(size_t siz) {
+    _max_entry = siz;
+}
+
+void cache_service::purge() {
+    _lru.clear();
+    _index.clear();
+    _bytes = 0;
+}
+
+void cache_service::serve(http_trx &tx) {
+    auto &req = tx->request;
+    if(req->method != "GET" || req->header("range") ||
+       req->header("authorization") || req->header("upgrade")) {
+        _upstream->serve(tx);
+        return;
+    }
+    chunk host = req->header("host");
+    string base = req->method + ' ';
+    base.append(host.data(), host.size());
+    base.append(req->resource().data(), req->resource().size());
+    while(true) {
+        uint64_t now = uv_now(uv_default_loop());
+        P<entry> ent = lookup(base);
+        if(ent && !ent->vary.empty())
+            ent = lookup(variant_key(base, ent, req));
+        if(ent && now < ent->stale_until) {
+            if(ent->pass)
+                _upstream->serve(tx);
+            else if(now < ent->fresh_until)
+                replay(tx, ent, "HIT");
+            else {
+                if(!ent->refreshing && _pending.find(base) == _pending.end())
+                    refresh(base, ent, tx);
+                replay(tx, ent, "STALE");
+            }
+            return;
+        }
+        // Conditional misses would only produce uncacheable 304s
+        if(req->header("if-modified-since") || req->header("if-none-match")) {
+            _upstream->serve(tx);
+            return;
+        }
+        auto pending = _pending.find(base);
+        if(pending == _pending.end())
+            break;
+        pending->second.push_back(fiber::current());
+        fiber::yield();
+    }
+    fetch(base, tx);
+}
+
+P<cache_service::entry> cache_service::lookup(const string &key) {
+    auto it = _index.find(key);
+    if(it == _index.end())
+        return nullptr;
+    P<entry> ent = *it->second;
+    if(ent->vary.empty() && uv_now(uv_default_loop()) >= ent->stale_until) {
+        _bytes -= ent->bytes;
+        _lru.erase(it->second);
+        _index.erase(it);
+        return nullptr;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second);
+    return ent;
+}
+
+string cache_service::variant_key(const string &base, const P<entry> &ent,
+                                  const P<http_request> &req) {
+    string key = base;
+    for(auto &name : ent->vary) {
+        chunk val = req->header(name);
+        key += '\n';
+        key.append(val.data(), val.size());
+    }
+    return key;
+}
+
+void cache_service::fetch(const string &base, http_trx &tx) {
+    _pending[base];
+    auto ent = make_shared<entry>();
+    size_t limit = _max_entry;
+    ent->bytes = 0;
+    ent->pass = false;
+    tx->capture([ent, limit] (const char *buf, int len) {
+        if(ent->pass) return;
+        ent->bytes += len;
+        if(ent->bytes > limit) {
+            ent->pass = true;
+            ent->body.clear();
+        } else {
+            ent->body.emplace_back(buf, len);
+        }
+    });
+    try {
+        _upstream->serve(tx);
+        tx->capture(nullptr);
+        if(tx->header_sent())
+            store(base, tx, move(ent));
+    }
+    catch(exception &ex) {
+        tx->capture(nullptr);
+        wake(base);
+        throw;
+    }
+    wake(base);
+}
+
+void cache_service::wake(const string &base) {
+    auto it = _pending.find(base);
+    if(it == _pending.end())
+        return;
+    auto waiters = move(it->second);
+    _pending.erase(it);
+    for(auto &f : waiters)
+        f->resume(0);
+}
+
+void cache_service::store(const string &base, http_trx &tx, P<entry> ent) {
+    auto resp = tx->get_response();
+    uint64_t now = uv_now(uv_default_loop());
+    int code = resp->code();
+    chunk cc = resp->header("Cache-Control"), vary = resp->header("Vary");
+    long ttl = 0, swr = _stale_ttl, val;
+    if(!ent->pass && resp->cookies.empty() &&
+       (code == 200 || code == 203 || code == 301 || code == 404 || code == 410) &&
+       !find_directive(cc, "no-store") && !find_directive(cc, "private") &&
+       !(vary && vary.find("*") != -1)) {
+        if(_forced_ttl > 0)
+            ttl = _forced_ttl;
+        else if(find_directive(cc, "no-cache"))
+            ttl = 0;
+        else if(find_directive(cc, "s-maxage", &val) || find_directive(cc, "max-age", &val))
+            ttl = val * 1000;
+        else if(resp->header("Expires")) {
+            time_t expires = parse_http_date(resp->header("Expires"));
+            time_t date = resp->header("Date") ?
+                          parse_http_date(resp->header("Date")) : ::time(nullptr);
+            if(expires != -1 && date != -1 && expires > date)
+                ttl = (expires - date) * 1000;
+        }
+        if(find_directive(cc, "stale-while-revalidate", &val))
+            swr = val * 1000;
+    }
+    if(ttl > 0) {
+        auto head = make_shared<http_response>(code);
+        for(auto it = resp->hbegin(); it != resp->hend(); it++) {
+            if(is_hop_header(it->first))
+                continue;
+            if(tx->gzipped() && strcasecmp(it->first.c_str(), "Content-Encoding") == 0)
+                continue; // Body was captured before our own compression
+            head->set_header(it->first, it->second);
+        }
+        stream_buffer sb;
+        sb.append(head);
+        ent->head = sb.dump();
+        // Entries are replayed through the response decoder, make sure it accepts them
+        if(!make_shared<http_response::decoder>()->decode(sb))
+            ttl = 0;
+    }
+    if(ttl <= 0) {
+        if(_pass_ttl <= 0)
+            return;
+        ent->pass = true;
+        ent->body.clear();
+        ent->head = nullptr;
+        ent->key = base;
+        ent->bytes = base.size();
+        ent->stored_at = now;
+        ent->fresh_until = ent->stale_until = now + _pass_ttl;
+        ent->refreshing = false;
+        insert(move(ent));
+        return;
+    }
+    ent->key = base;
+    if(vary) {
+        auto node = make_shared<entry>();
+        const char *p = vary.data(), *end = p + vary.size();
+        while(p < end) {
+            while(p < end && (*p == ' ' || *p == ',')) p++;
+            string name;
+            for(; p < end && *p != ',' && *p != ' '; p++)
+                name.push_back(tolower(*p));
+            if(!name.empty()) node->vary.push_back(move(name));
+        }
+        if(!node->vary.empty()) {
+            node->key = base;
+            node->bytes = base.size();
+            node->pass = node->refreshing = false;
+            node->stored_at = now;
+            node->fresh_until = node->stale_until = UINT64_MAX;
+            insert(node);
+            ent->key = variant_key(base, node, tx->request);
+        }
+    }
+    ent->bytes += ent->key.size() + ent->head.size();
+    ent->stored_at = now;
+    ent->fresh_until = now + ttl;
+    ent->stale_until = ent->fresh_until + swr;
+    ent->refreshing = false;
+    if(ent->bytes <= _capacity)
+        insert(move(ent));
+}
+
+void cache_service::insert(P<entry> ent) {
+    auto it = _index.find(ent->key);
+    if(it != _index.end()) {
+        _bytes -= (*it->second)->bytes;
+        _lru.erase(it->second);
+        _index.erase(it);
+    }
+    _bytes += ent->bytes;
+    _lru.push_front(ent);
+    _index[ent->key] = _lru.begin();
+    while(_bytes > _capacity && _lru.size() > 1) {
+        _bytes -= _lru.back()->bytes;
+        _index.erase(_lru.back()->key);
+        _lru.pop_back();
+    }
+}
+
+void cache_service::refresh(const string &base, const P<entry> &stale, http_trx &tx) {
+    auto req = make_shared<http_request>(*tx->request);
+    req->delete_header("content-length");
+    req->delete_header("if-modified-since");
+    req->delete_header("if-none-match");
+    string peer = tx->connection->peername();
+    auto self = shared_from_this();
+    stale->refreshing = true;
+    fiber::launch([self, base, stale, req, peer] () {
+        try {
+            auto conn = make_shared<http_connection>(make_shared<discard_stream>(), peer);
+            self->fetch(base, make_shared<http_transaction>(conn, req));
+        }
+        catch(exception &ex) {
+            stale->refreshing = false;
+            throw;
+        }
+        stale->refreshing = false;
+    });
+}
+
+void cache_service::replay(http_trx &tx, const P<entry> &ent, const char *state) {
+    stream_buffer sb;
+    auto dec = make_shared<http_response::decoder>();
+    sb.append(ent->head.data(), ent->head.size());
+    if(!dec->decode(sb))
+        throw RTERR("corrupted cache entry");
+    auto cached = dynamic_pointer_cast<http_response>(dec->msg());
+    int code = cached->code();
+    chunk etag = cached->header("ETag"), lastModified = cached->header("Last-Modified");
+    chunk noneMatch = tx->request->header("if-none-match");
+    chunk modifiedSince = tx->request->header("if-modified-since");
+    if(code == 200 && ((etag && noneMatch && noneMatch == etag) ||
+                       (!noneMatch && lastModified && modifiedSince && modifiedSince == lastModified)))
+        code = 304;
+    auto resp = tx->get_response(code);
+    for(auto it = cached->hbegin(); it != cached->hend(); it++)
+        resp->set_header(it->first, it->second);
+    resp->set_header("Age", to_string((uv_now(uv_default_loop()) - ent->stored_at) / 1000));
+    resp->set_header("X-Cache", state);
+    if(code != 304) {
+        for(auto &c : ent->body)
+            tx->write(c.data(), c.size());
+    }
+    tx->finish();
+}
@@ -1,5 +1,7 @@
 #include "xyhttpsvc.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 
@@ -32,6 +34,189 @@ void http_service_chain::match_router::serve(http_trx &tx) {
 
 http_service_chain::match_router::~match_router() {}
 
+using route_handlers = vector<pair<string, P<http_service>>>; // By method
+
+struct router_service::node {
+    string prefix;  // Static text leading here from the parent
+    string indices; // First byte of each static child
+    vector<unique_ptr<node>> children;
+    unique_ptr<node> param;
+    string param_name, wildcard_name;
+    route_handlers handlers, wildcard;
+
+    node *static_child(const string &text);
+    const route_handlers *find(const string &path, size_t pos,
+                               unordered_map<string, string> &params) const;
+};
+
+/**
+ * The node static text leads to from here, splitting edges that only
+ * share the start of it.
+ */
+router_service::node *router_service::node::static_child(const string &text) {
+    node *n = this;
+    size_t pos = 0;
+    while(pos < text.size()) {
+        size_t i = n->indices.find(text[pos]);
+        if(i == string::npos) {
+            n->indices += text[pos];
+            n->children.emplace_back(new node);
+            n->children.back()->prefix = text.substr(pos);
+            return n->children.back().get();
+        }
+        node *c = n->children[i].get();
+        size_t common = 0;
+        while(common < c->prefix.size() && pos + common < text.size() &&
+              c->prefix[common] == text[pos + common])
+            common++;
+        if(common < c->prefix.size()) {
+            unique_ptr<node> mid(new node);
+            mid->prefix = c->prefix.substr(0, common);
+            c->prefix.erase(0, common);
+            mid->indices = c->prefix.substr(0, 1);
+            mid->children.push_back(move(n->children[i]));
+            n->children[i] = move(mid);
+            c = n->children[i].get();
+        }
+        pos += common;
+        n = c;
+    }
+    return n;
+}
+
+/**
+ * Match the path from pos, the prefix of this node being matched already.
+ * Captures are only recorded on the way back from a match, so branches
+ * given up leave nothing behind.
+ */
+const route_handlers *router_service::node::find(const string &path, size_t pos,
+                                                 unordered_map<string, string> &params) const {
+    if(pos == path.size() && !handlers.empty())
+        return &handlers;
+    if(pos < path.size()) {
+        size_t i = indices.find(path[pos]);
+        if(i != string::npos) {
+            const node *c = children[i].get();
+            if(path.compare(pos, c->prefix.size(), c->prefix) == 0) {
+                auto found = c->find(path, pos + c->prefix.size(), params);
+                if(found)
+                    return found;
+            }
+        }
+        if(param && path[pos] != '/') {
+            size_t end = min(path.find('/', pos), path.size());
+            auto found = param->find(path, end, params);
+            if(found) {
+                params[param_name] = path.substr(pos, end - pos);
+                return found;
+            }
+        }
+    }
+    if(!wildcard.empty()) {
+        params[wildcard_name] = path.substr(pos);
+        return &wildcard;
+    }
+    return nullptr;
+}
+
+static void add_handler(route_handlers &handlers, const string &method,
+                        P<http_service> svc, const string &pattern) {
+    for(auto &h : handlers)
+        if(h.first == method)
+            throw RTERR("route %s %s is already taken", method.c_str(), pattern.c_str());
+    handlers.emplace_back(method, move(svc));
+}
+
+router_service::router_service() : _root(new node) {}
+
+router_service::~router_service() {}
+
+void router_service::add(const string &method, const string &pattern, P<http_service> svc) {
+    if(pattern.empty() || pattern[0] != '/')
+        throw RTERR("route pattern should start with '/': %s", pattern.c_str());
+    if(!svc)
+        throw RTERR("provided service is null");
+    node *n = _root.get();
+    size_t pos = 0;
+    while(pos < pattern.size()) {
+        // Static text, up to a segment starting with ':' or '*'
+        size_t end = pos;
+        while(end < pattern.size() && !(end > 0 && pattern[end - 1] == '/' &&
+                                        (pattern[end] == ':' || pattern[end] == '*')))
+            end++;
+        n = n->static_child(pattern.substr(pos, end - pos));
+        if(end == pattern.size())
+            break;
+        size_t segEnd = min(pattern.find('/', end), pattern.size());
+        string name = pattern.substr(end + 1, segEnd - end - 1);
+        if(pattern[end] == '*') {
+            if(segEnd != pattern.size())
+                throw RTERR("'*' should end the route pattern: %s", pattern.c_str());
+            if(name.empty())
+                name = "*";
+            if(!n->wildcard.empty() && n->wildcard_name != name)
+                throw RTERR("'*%s' conflicts with '*%s' in %s", name.c_str(),
+                            n->wildcard_name.c_str(), pattern.c_str());
+            n->wildcard_name = name;
+            add_handler(n->wildcard, method, move(svc), pattern);
+            return;
+        }
+        if(name.empty())
+            throw RTERR("unnamed parameter in route pattern: %s", pattern.c_str());
+        if(!n->param) {
+            n->param.reset(new node);
+            n->param_name = name;
+        } else if(n->param_name != name) {
+            throw RTERR("':%s' conflicts with ':%s' in %s", name.c_str(),
+                        n->param_name.c_str(), pattern.c_str());
+        }
+        n = n->param.get();
+        pos = segEnd;
+    }
+    add_handler(n->handlers, method, move(svc), pattern);
+}
+
+void router_service::mount(const string &prefix, P<http_service> svc) {
+    string base = prefix;
+    while(!base.empty() && base.back() == '/')
+        base.pop_back();
+    if(!base.empty())
+        add(base, svc);
+    add(base + "/*", move(svc));
+}
+
+void router_service::serve(http_trx &tx) {
+    unordered_map<string, string> params;
+    auto handlers = _root->find(tx->request->path(), 0, params);
+    if(!handlers) {
+        if(_default)
+            _default->serve(tx);
+        return;
+    }
+    const string &method = tx->request->method;
+    const P<http_service> *svc = nullptr, *any = nullptr, *get = nullptr;
+    string allow;
+    for(auto &h : *handlers) {
+        if(h.first == method)
+            svc = &h.second;
+        else if(h.first.empty())
+            any = &h.second;
+        else if(h.first == "GET")
+            get = &h.second;
+        allow += allow.empty() ? h.first : ", " + h.first;
+    }
+    if(!svc)
+        svc = any ? any : method == "HEAD" ? get : nullptr;
+    if(!svc) {
+        tx->get_response(405)->set_header("Allow", allow);
+        tx->display_error(405);
+        return;
+    }
+    for(auto &p : params)
+        tx->params[p.first] = move(p.second);
+    (*svc)->serve(tx);
+}
+
 local_file_service::local_file_service(const string &docroot) {
     set_document_root(docroot);
 }
@@ -150,21 +335,342 @@ void local_file_service::serve(http_trx &tx) {
     tx->serve_file(fullpathbuf);
 }
 
-logger_service::logger_service(ostream *os) : _os(*os) {}
+async_log::async_log(const string &path, int flushInterval, size_t capacity)
+        : _path(path), _head(0), _tail(0), _dropped(0), _written(0), _reopen(false),
+          _stop(false), _interval(max(flushInterval, 1)) {
+    _file = fopen(path.c_str(), "a");
+    if(!_file)
+        throw RTERR("failed to open %s: %s", path.c_str(), strerror(errno));
+    size_t size = 4096;
+    while(size < capacity)
+        size <<= 1;
+    _ring.resize(size);
+    _writer = thread(&async_log::write_loop, this);
+}
+
+async_log::~async_log() {
+    {
+        lock_guard<mutex> lock(_lock);
+        _stop = true;
+    }
+    _wakeup.notify_one();
+    _writer.join();
+    fclose(_file);
+}
+
+/**
+ * Copy a record into the ring as a whole, or drop it if there is no room.
+ */
+bool async_log::append(const char *data, size_t len) {
+    size_t head = _head.load(memory_order_relaxed);
+    size_t used = head - _tail.load(memory_order_acquire);
+    if(len > _ring.size() - used) {
+        _dropped++;
+        return false;
+    }
+    size_t pos = head & (_ring.size() - 1);
+    size_t n = min(len, _ring.size() - pos);
+    memcpy(&_ring[pos], data, n);
+    memcpy(&_ring[0], data + n, len - n);
+    _head.store(head + len, memory_order_release);
+    // Not waiting for the interval when filling up fast
+    if(used < _ring.size() / 2 && used + len >= _ring.size() / 2)
+        _wakeup.notify_one();
+    return true;
+}
+
+void async_log::reopen() {
+    _reopen = true;
+    _wakeup.notify_one();
+}
+
+void async_log::write_loop() {
+    unique_lock<mutex> lock(_lock);
+    while(!_stop) {
+        _wakeup.wait_for(lock, chrono::milliseconds(_interval));
+        drain();
+    }
+    drain();
+}
+
+// What was logged before a reopen still goes to the old file
+void async_log::drain() {
+    bool reopen = _reopen.exchange(false);
+    size_t tail = _tail.load(memory_order_relaxed);
+    size_t head = _head.load(memory_order_acquire);
+    if(tail != head) {
+        for(size_t pos = tail; pos != head; ) {
+            size_t off = pos & (_ring.size() - 1);
+            size_t n = min(head - pos, _ring.size() - off);
+            fwrite(&_ring[off], 1, n, _file);
+            pos += n;
+        }
+        fflush(_file);
+        _written += head - tail;
+        _tail.store(head, memory_order_release);
+    }
+    if(reopen) {
+        FILE *file = fopen(_path.c_str(), "a");
+        if(file) {
+            fclose(_file);
+            _file = file;
+        }
+    }
+}
+
+logger_service::logger_service(ostream *os) : _os(os), _stamp(0) {}
+
+logger_service::logger_service(P<async_log> log)
+        : _os(nullptr), _log(move(log)), _stamp(0) {}
+
+// Formatted again only when the second changes
+const char *logger_service::time_label() {
+    time_t now = ::time(nullptr);
+    if(now != _stamp) {
+        _stamp = now;
+        strftime(_label, sizeof(_label), "%Y-%m-%d %H:%M:%S", ::localtime(&now));
+    }
+    return _label;
+}
 
 void logger_service::serve(http_trx &tx) {
-    if(tx->request->resource()[0] == '/') {
-        _os<<"["<<timelabel()<<fmt(" %s] %s %s%s",
-                                   tx->connection->peername().c_str(),
-                                   tx->request->method.c_str(),
-                                   tx->request->header("host").data(),
-                                   tx->request->resource().data())<<endl;
-    } else {
-        _os<<"["<<timelabel()<<fmt(" %s] %s %s",
-                                   tx->connection->peername().c_str(),
-                                   tx->request->method.c_str(),
-                                   tx->request->resource().data())<<endl;
+    chunk resource = tx->request->resource();
+    chunk host;
+    if(resource.size() > 0 && resource[0] == '/')
+        host = tx->request->header("host");
+    char line[2048];
+    int len = snprintf(line, sizeof(line), "[%s %s] %s %.*s%.*s\n", time_label(),
+                       tx->connection->peername().c_str(), tx->request->method.c_str(),
+                       (int)host.size(), host ? host.data() : "", (int)resource.size(), resource.data());
+    if(len < 0)
+        return;
+    if(len >= (int)sizeof(line)) { // Cut overlong lines
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if(_log)
+        _log->append(line, len);
+    else
+        _os->write(line, len).flush();
+}
+
+const string access_log_format::DEFAULT(
+        "[$time $peer] $scheme $method $host$uri $status $bytes $service_time $upstream_time");
+const size_t access_log_format::BINARY_HEADER;
+
+access_log_format::access_log_format(const string &spec)
+        : _binary(spec == "binary"), _stamp(0) {
+    static const pair<const char *, field_type> names[] = {
+        { "time", TIME }, { "peer", PEER }, { "scheme", SCHEME }, { "method", METHOD },
+        { "host", HOST }, { "uri", URI }, { "status", STATUS }, { "bytes", BYTES },
+        { "service_time", SERVICE_TIME }, { "upstream_time", UPSTREAM_TIME } };
+    if(_binary)
+        return;
+    string literal;
+    for(size_t i = 0; i < spec.size(); ) {
+        size_t stop = i + 1;
+        while(stop < spec.size() && (islower(spec[stop]) || spec[stop] == '_'))
+            stop++;
+        if(spec[i] != '$' || stop == i + 1) {
+            literal += spec[i++];
+            continue;
+        }
+        string name = spec.substr(i + 1, stop - i - 1);
+        auto it = find_if(begin(names), end(names), [&name] (const pair<const char *, field_type> &n) {
+            return name == n.first;
+        });
+        if(it == std::end(names))
+            throw RTERR("unknown access log field $%s", name.c_str());
+        if(!literal.empty())
+            _fields.emplace_back(LITERAL, move(literal));
+        literal.clear();
+        _fields.emplace_back(it->second, string());
+        i = stop;
+    }
+    if(!literal.empty())
+        _fields.emplace_back(LITERAL, move(literal));
+}
+
+static void put_text(char *buf, size_t size, size_t &pos, const char *s, size_t len) {
+    if(len == 0) // Empty fields stay visible
+        s = "-", len = 1;
+    len = min(len, size - pos);
+    memcpy(buf + pos, s, len);
+    pos += len;
+}
+
+static void put_number(char *buf, size_t size, size_t &pos, uint64_t n, int minDigits = 1) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while(n > 0 || (int)sizeof(digits) - i < minDigits);
+    put_text(buf, size, pos, digits + i, sizeof(digits) - i);
+}
+
+static void put_millis(char *buf, size_t size, size_t &pos, uint64_t micros) {
+    put_number(buf, size, pos, micros / 1000);
+    put_text(buf, size, pos, ".", 1);
+    put_number(buf, size, pos, micros % 1000, 3);
+}
+
+static void put_le(char *p, uint64_t n, int bytes) {
+    for(int i = 0; i < bytes; i++)
+        p[i] = (char)(n >> (8 * i));
+}
+
+static uint64_t get_le(const char *p, int bytes) {
+    uint64_t n = 0;
+    for(int i = 0; i < bytes; i++)
+        n |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return n;
+}
+
+/**
+ * Put the record into buf, cutting strings that do not fit.
+ * @return Bytes written
+ */
+size_t access_log_format::write(const access_record &rec, char *buf, size_t size) {
+    if(_binary) {
+        size = min<size_t>(size, 0xffff);
+        if(size < BINARY_HEADER)
+            return 0;
+        size_t room = size - BINARY_HEADER;
+        size_t lens[4] = { min<size_t>(rec.method_len, 0xff), rec.peer_len, rec.host_len, rec.uri_len };
+        const char *strs[4] = { rec.method, rec.peer, rec.host, rec.uri };
+        size_t pos = BINARY_HEADER;
+        for(int i = 0; i < 4; i++) {
+            lens[i] = min(lens[i], room);
+            memcpy(buf + pos, strs[i], lens[i]);
+            pos += lens[i];
+            room -= lens[i];
+        }
+        put_le(buf, pos, 2);
+        buf[2] = 1; // Version
+        buf[3] = rec.tls ? 1 : 0;
+        put_le(buf + 4, rec.status, 2);
+        put_le(buf + 6, lens[0], 1);
+        buf[7] = 0;
+        put_le(buf + 8, lens[1], 2);
+        put_le(buf + 10, lens[2], 2);
+        put_le(buf + 12, lens[3], 2);
+        put_le(buf + 14, 0, 2);
+        put_le(buf + 16, rec.time, 8);
+        put_le(buf + 24, rec.bytes, 8);
+        put_le(buf + 32, min<uint64_t>(rec.service_time, 0xffffffff), 4);
+        put_le(buf + 36, min<uint64_t>(rec.upstream_time, 0xffffffff), 4);
+        return pos;
     }
+    if(size == 0)
+        return 0;
+    size--; // Room for the line end, whatever happens
+    size_t pos = 0;
+    for(auto &field : _fields) {
+        switch(field.first) {
+            case LITERAL:
+                put_text(buf, size, pos, field.second.data(), field.second.size());
+                break;
+            case TIME: {
+                time_t now = rec.time / 1000000;
+                if(now != _stamp) {
+                    _stamp = now;
+                    strftime(_label, sizeof(_label), "%Y-%m-%d %H:%M:%S", ::localtime(&now));
+                }
+                put_text(buf, size, pos, _label, strlen(_label));
+                break;
+            }
+            case PEER:
+                put_text(buf, size, pos, rec.peer, rec.peer_len);
+                break;
+            case SCHEME:
+                put_text(buf, size, pos, rec.tls ? "https" : "http", rec.tls ? 5 : 4);
+                break;
+            case METHOD:
+                put_text(buf, size, pos, rec.method, rec.method_len);
+                break;
+            case HOST:
+                put_text(buf, size, pos, rec.host, rec.host_len);
+                break;
+            case URI:
+                put_text(buf, size, pos, rec.uri, rec.uri_len);
+                break;
+            case STATUS:
+                put_number(buf, size, pos, rec.status);
+                break;
+            case BYTES:
+                put_number(buf, size, pos, rec.bytes);
+                break;
+            case SERVICE_TIME:
+                put_millis(buf, size, pos, rec.service_time);
+                break;
+            case UPSTREAM_TIME:
+                put_millis(buf, size, pos, rec.upstream_time);
+                break;
+        }
+    }
+    buf[pos++] = '\n';
+    return pos;
+}
+
+size_t access_log_format::read(const char *buf, size_t len, access_record &rec) {
+    if(len < BINARY_HEADER)
+        return 0;
+    size_t size = get_le(buf, 2);
+    if(buf[2] != 1 || size < BINARY_HEADER)
+        throw RTERR("invalid access log record");
+    if(len < size)
+        return 0;
+    rec.tls = buf[3] & 1;
+    rec.status = get_le(buf + 4, 2);
+    rec.method_len = get_le(buf + 6, 1);
+    rec.peer_len = get_le(buf + 8, 2);
+    rec.host_len = get_le(buf + 10, 2);
+    rec.uri_len = get_le(buf + 12, 2);
+    if(BINARY_HEADER + rec.method_len + rec.peer_len + rec.host_len + rec.uri_len != size)
+        throw RTERR("invalid access log record");
+    rec.time = get_le(buf + 16, 8);
+    rec.bytes = get_le(buf + 24, 8);
+    rec.service_time = get_le(buf + 32, 4);
+    rec.upstream_time = get_le(buf + 36, 4);
+    rec.method = buf + BINARY_HEADER;
+    rec.peer = rec.method + rec.method_len;
+    rec.host = rec.peer + rec.peer_len;
+    rec.uri = rec.host + rec.host_len;
+    return size;
+}
+
+access_log_service::access_log_service(P<async_log> log, const string &format)
+        : _log(move(log)), _format(format) {}
+
+void access_log_service::serve(http_trx &tx) {
+    tx->on_complete([this] (http_transaction &tx, const http_transaction_stats &stats) {
+        record(tx, stats);
+    });
+}
+
+void access_log_service::record(http_transaction &tx, const http_transaction_stats &stats) {
+    access_record rec;
+    rec.time = chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    rec.status = stats.status;
+    rec.tls = stats.tls;
+    rec.bytes = stats.bytes;
+    rec.service_time = stats.service_time;
+    rec.upstream_time = stats.upstream_time;
+    rec.method = tx.request->method.data();
+    rec.method_len = tx.request->method.size();
+    auto &peer = tx.connection->peername();
+    rec.peer = peer.data();
+    rec.peer_len = peer.size();
+    chunk host = tx.request->header("host"), uri = tx.request->resource();
+    rec.host = host.data();
+    rec.host_len = host.size();
+    rec.uri = uri.data();
+    rec.uri_len = uri.size();
+    char buf[2048];
+    size_t len = _format.write(rec, buf, sizeof(buf));
+    _log->append(buf, len);
 }
 
 tls_filter_service::tls_filter_service(int code) : _code(code) {}
@@ -189,39 +695,211 @@ void tls_filter_service::serve(http_trx &tx) {
     }
 }
 
+struct host_dispatch_service::table {
+    struct node {
+        vector<pair<string, int>> children; // By label, sorted
+        P<http_service> exact, wildcard;
+    };
+    vector<node> nodes; // The root first
+    P<http_service> fallback;
+
+    table() : nodes(1) {}
+    int child(int n, const char *label, size_t len) const;
+    int insert(const string &name);
+    void remove(const string &name, bool wildcard);
+};
+
+// Labels are stored in lower case, what is looked up may be in any
+static int compare_label(const string &label, const char *s, size_t len) {
+    size_t n = min(label.size(), len);
+    for(size_t i = 0; i < n; i++) {
+        int diff = (unsigned char)label[i] - tolower((unsigned char)s[i]);
+        if(diff)
+            return diff;
+    }
+    return label.size() < len ? -1 : label.size() > len ? 1 : 0;
+}
+
+int host_dispatch_service::table::child(int n, const char *label, size_t len) const {
+    auto &children = nodes[n].children;
+    size_t lo = 0, hi = children.size();
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = compare_label(children[mid].first, label, len);
+        if(cmp == 0)
+            return children[mid].second;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+int host_dispatch_service::table::insert(const string &name) {
+    int n = 0;
+    size_t end = name.size();
+    while(true) {
+        size_t start = name.rfind('.', end - 1);
+        start = start == string::npos || end == 0 ? 0 : start + 1;
+        string label = name.substr(start, end - start);
+        int c = child(n, label.data(), label.size());
+        if(c < 0) {
+            c = nodes.size();
+            nodes.emplace_back();
+            auto &children = nodes[n].children;
+            auto pos = children.begin();
+            while(pos != children.end() && compare_label(pos->first, label.data(), label.size()) < 0)
+                ++pos;
+            children.emplace(pos, label, c);
+        }
+        n = c;
+        if(start == 0)
+            return n;
+        end = start - 1;
+    }
+}
+
+/**
+ * Drop the service of a name, then the nodes left with neither services
+ * nor children. Names never registered change nothing.
+ */
+void host_dispatch_service::table::remove(const string &name, bool wildcard) {
+    vector<int> path(1, 0);
+    size_t end = name.size();
+    while(true) {
+        size_t start = name.rfind('.', end - 1);
+        start = start == string::npos || end == 0 ? 0 : start + 1;
+        int c = child(path.back(), name.data() + start, end - start);
+        if(c < 0)
+            return;
+        path.push_back(c);
+        if(start == 0)
+            break;
+        end = start - 1;
+    }
+    auto &leaf = nodes[path.back()];
+    (wildcard ? leaf.wildcard : leaf.exact).reset();
+    vector<bool> dead(nodes.size(), false);
+    for(size_t i = path.size() - 1; i > 0; i--) {
+        auto &n = nodes[path[i]];
+        if(!n.children.empty() || n.exact || n.wildcard)
+            break;
+        dead[path[i]] = true;
+        auto &siblings = nodes[path[i - 1]].children;
+        for(auto it = siblings.begin(); it != siblings.end(); ++it) {
+            if(it->second == path[i]) {
+                siblings.erase(it);
+                break;
+            }
+        }
+    }
+    // Renumber the nodes left
+    vector<int> index(nodes.size());
+    size_t kept = 0;
+    for(size_t i = 0; i < nodes.size(); i++) {
+        index[i] = dead[i] ? -1 : kept;
+        if(!dead[i] && kept++ < i)
+            nodes[index[i]] = move(nodes[i]);
+    }
+    nodes.resize(kept);
+    for(auto &n : nodes)
+        for(auto &c : n.children)
+            c.second = index[c.second];
+}
+
+host_dispatch_service::host_dispatch_service() : _table(make_shared<table>()) {}
+
+/**
+ * Apply a change to a copy of the table, then make it current. Requests
+ * being dispatched hold on to the old one.
+ */
+void host_dispatch_service::update(const function<void(table &)> &change) {
+    auto next = make_shared<table>(*atomic_load(&_table));
+    change(*next);
+    atomic_store(&_table, P<const table>(move(next)));
+}
+
+/**
+ * @param hostname A name, or "*.domain" for all names below domain.
+ */
 void host_dispatch_service::register_host(const string &hostname, shared_ptr<http_service> svc) {
     if(!svc) {
         unregister_host(hostname);
         return;
     }
-    _svcmap[hostname] = svc;
-    if(!_default)
-        _default = svc;
+    bool wildcard = hostname.compare(0, 2, "*.") == 0;
+    string name = normalize_hostname(wildcard ? hostname.substr(2) : hostname);
+    if(name.empty())
+        throw RTERR("invalid hostname: %s", hostname.c_str());
+    update([&] (table &t) {
+        auto &n = t.nodes[t.insert(name)];
+        (wildcard ? n.wildcard : n.exact) = svc;
+        if(!t.fallback)
+            t.fallback = svc;
+    });
 }
 
 void host_dispatch_service::unregister_host(const string &hostname) {
-    _svcmap.erase(hostname);
+    bool wildcard = hostname.compare(0, 2, "*.") == 0;
+    string name = normalize_hostname(wildcard ? hostname.substr(2) : hostname);
+    update([&] (table &t) { t.remove(name, wildcard); });
 }
 
 void host_dispatch_service::set_default(shared_ptr<http_service> svc) {
     if(!svc)
         throw RTERR("provided service is null");
-    _default = svc;
+    update([&] (table &t) { t.fallback = svc; });
+}
+
+// The name in a Host header, without port or trailing dot
+static void hostname_span(const char *host, size_t &len) {
+    if(len > 0 && host[0] == '[') { // IPv6 literal
+        auto end = (const char *)memchr(host, ']', len);
+        if(end)
+            len = end - host + 1;
+        return;
+    }
+    auto colon = (const char *)memchr(host, ':', len);
+    if(colon)
+        len = colon - host;
+    if(len > 0 && host[len - 1] == '.')
+        len--;
 }
 
 string host_dispatch_service::normalize_hostname(chunk hostname) {
-    char buf[512];
-    if(hostname.size() > sizeof(buf) - 1)
-        throw RTERR("hostname too long");
-    strcpy(buf, hostname.data());
-    char *portBase = strchr(buf, ':');
-    if(portBase) *portBase = 0;
-    int length = strlen(buf);
-    if(buf[length - 1] == '.') {
-        buf[length - 1] = 0;
-        length--;
+    size_t len = hostname.size();
+    hostname_span(hostname.data(), len);
+    string name(hostname.data(), len);
+    for(auto &c : name)
+        c = tolower((unsigned char)c);
+    return name;
+}
+
+P<http_service> host_dispatch_service::find(const char *host, size_t len) const {
+    auto t = atomic_load(&_table);
+    hostname_span(host, len);
+    const P<http_service> *wildcard = nullptr;
+    int n = 0;
+    size_t end = len;
+    while(len > 0) {
+        // Wildcards here cover what is left, as it has one more label
+        if(t->nodes[n].wildcard)
+            wildcard = &t->nodes[n].wildcard;
+        size_t start = end;
+        while(start > 0 && host[start - 1] != '.')
+            start--;
+        n = t->child(n, host + start, end - start);
+        if(n < 0)
+            break;
+        if(start == 0) {
+            if(t->nodes[n].exact)
+                return t->nodes[n].exact;
+            break;
+        }
+        end = start - 1;
     }
-    return string(buf, length);
+    return wildcard ? *wildcard : t->fallback;
 }
 
 void host_dispatch_service::serve(http_trx &tx) {
@@ -230,12 +908,9 @@ void host_dispatch_service::serve(http_trx &tx) {
         tx->display_error(400);
         return;
     }
-    string hostName = normalize_hostname(host);
-    auto svc = _svcmap[hostName];
+    auto svc = find(host.data(), host.size());
     if(svc)
         svc->serve(tx);
-    else if(_default)
-        _default->serve(tx);
 }
 
 proxy_pass_service::proxy_pass_service() : _cur(0) {}
@@ -244,12 +919,14 @@ proxy_pass_service::proxy_pass_service(const string &host, int port) : _cur(0) {
     append(host, port);
 }
 
-void proxy_pass_service::append(shared_ptr<ip_endpoint> ep) {
+void proxy_pass_service::append(shared_ptr<ip_endpoint> ep, bool http2) {
     _svcs.push_back(ep);
+    _http2.push_back(http2);
+    _h2conns.emplace_back();
 }
 
-void proxy_pass_service::append(const string &host, int port) {
-    append(make_shared<ip_endpoint>(host, port));
+void proxy_pass_service::append(const string &host, int port, bool http2) {
+    append(make_shared<ip_endpoint>(host, port), http2);
 }
 
 void proxy_pass_service::serve(http_trx &tx) {
@@ -257,11 +934,34 @@ void proxy_pass_service::serve(http_trx &tx) {
         return;
     if(_cur >= count())
         _cur = 0;
+    int i = _cur++;
+    if(_http2[i]) {
+        tx->forward_to(http2_upstream(i));
+        return;
+    }
     auto upstream = make_shared<tcp_stream>();
-    upstream->connect(_svcs[_cur++]);
+    upstream->connect(_svcs[i]);
     tx->forward_to(upstream);
 }
 
+/**
+ * The shared connection to a backend, reconnected once it is closed or
+ * going away.
+ */
+P<http2_connection> proxy_pass_service::http2_upstream(int i) {
+    if(_h2conns[i] && _h2conns[i]->usable())
+        return _h2conns[i];
+    auto &ep = _svcs[i];
+    auto strm = make_shared<tcp_stream>();
+    strm->connect(ep);
+    if(_h2conns[i] && _h2conns[i]->usable()) // Another request connected meanwhile
+        return _h2conns[i];
+    auto conn = make_shared<http2_connection>(strm, ep->straddr() + ":" + to_string(ep->port()));
+    conn->open();
+    _h2conns[i] = conn;
+    return conn;
+}
+
 lambda_service::lambda_service(const function<void(http_trx &)> &func)
 : _func(func) {}
 
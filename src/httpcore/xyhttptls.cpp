@@ -1,5 +1,30 @@
 #include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <climits>
+#include <ctime>
+#include <sys/stat.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
+#ifdef __linux__
+# include <linux/tls.h>
+# include <netinet/tcp.h>
+# include <sys/socket.h>
+# ifndef TCP_ULP
+#  define TCP_ULP 31
+# endif
+# ifndef SOL_TLS
+#  define SOL_TLS 282
+# endif
+#endif
 #include "xyhttptls.h"
 
 using namespace std;
@@ -21,25 +46,117 @@ static const char *sslerror_to_string(int err_code)
     }
 }
 
+#define TLS_TX_BATCH 0x10000
+#define TLS_RECORD_OVERHEAD 0x60
+
+char *tls_stream::cipher_queue::reserve(size_t nbytes) {
+    if(cap - tail >= nbytes)
+        return data + tail;
+    if(head > 0) { // Move the unconsumed bytes to the front first
+        memmove(data, data + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+    if(cap - tail < nbytes) {
+        size_t newCap = max(tail + nbytes, cap * 2);
+        char *p = (char *)realloc(data, newCap);
+        if(!p) throw bad_alloc();
+        data = p;
+        cap = newCap;
+    }
+    return data + tail;
+}
+
+void tls_stream::cipher_queue::consume(size_t nbytes) {
+    head += nbytes;
+    if(head >= tail)
+        head = tail = 0;
+}
+
+void tls_stream::cipher_queue::swap(cipher_queue &other) {
+    std::swap(data, other.data);
+    std::swap(head, other.head);
+    std::swap(tail, other.tail);
+    std::swap(cap, other.cap);
+}
+
+tls_stream::cipher_queue::~cipher_queue() {
+    free(data);
+}
+
+/**
+ * A BIO working on a cipher_queue of ours, in place of a memory BIO which
+ * would need a copy for every record going in or out.
+ */
+BIO *tls_stream::queue_bio(cipher_queue *q) {
+    static BIO_METHOD *method = [] () {
+        BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                     "tls_stream queue");
+        if(!m) return m;
+        BIO_meth_set_write(m, [] (BIO *bio, const char *buf, int length) {
+            auto *self = (cipher_queue *)BIO_get_data(bio);
+            BIO_clear_retry_flags(bio);
+            if(length <= 0)
+                return 0;
+            memcpy(self->reserve(length), buf, length);
+            self->tail += length;
+            return length;
+        });
+        BIO_meth_set_read(m, [] (BIO *bio, char *buf, int length) {
+            auto *self = (cipher_queue *)BIO_get_data(bio);
+            BIO_clear_retry_flags(bio);
+            if(self->size() == 0) {
+                BIO_set_retry_read(bio);
+                return -1;
+            }
+            int n = (int)min<size_t>(length, self->size());
+            memcpy(buf, self->data + self->head, n);
+            self->consume(n);
+            return n;
+        });
+        BIO_meth_set_ctrl(m, [] (BIO *bio, int cmd, long, void *) -> long {
+            auto *self = (cipher_queue *)BIO_get_data(bio);
+            if(cmd == BIO_CTRL_PENDING)
+                return (long)self->size();
+            return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+        });
+        BIO_meth_set_create(m, [] (BIO *bio) {
+            BIO_set_init(bio, 1);
+            return 1;
+        });
+        return m;
+    }();
+    BIO *bio = method ? BIO_new(method) : nullptr;
+    if(bio) BIO_set_data(bio, q);
+    return bio;
+}
+
 tls_stream::tls_stream(const P<tls_context> &ctx)
         : tls_stream(*ctx) {}
 
 tls_stream::tls_stream(const tls_context &ctx) :
-        _handshake_ok(false), _chelo_recv(false) {
+        _handshake_ok(false), _handshaking(false), _chelo_recv(false), _offload(ctx.handshake_offload()),
+        _want_ktls(ctx.ktls()), _ktls(false),
+        _small_record(ctx._small_record), _record_idle(ctx._record_idle),
+        _record_size(SSL3_RT_MAX_PLAIN_LENGTH), _record_boost(ctx._record_boost),
+        _tx_streak(0), _last_tx(0) {
     _ssl = SSL_new(ctx.ctx());
     if(!_ssl)
         throw RTERR("Failed to create SSL instance");
-    _txbio = BIO_new(BIO_s_mem());
-    _rxbio = BIO_new(BIO_s_mem());
+    _txbio = queue_bio(&_txq);
+    _rxbio = queue_bio(&_rxq);
     if(!_rxbio || !_txbio) {
         SSL_free(_ssl);
         BIO_free(_rxbio);
         BIO_free(_txbio);
         throw RTERR("Failed to create SSL instance");
     }
-    BIO_set_close(_rxbio, BIO_CLOSE);
-    BIO_set_close(_txbio, BIO_CLOSE);
     SSL_set_bio(_ssl, _rxbio, _txbio);
+    SSL_set_app_data(_ssl, this);
+#ifdef SSL_OP_NO_RENEGOTIATION
+    // Renegotiation would make a writer wait for the reader's input
+    SSL_set_options(_ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
 }
 
 void tls_stream::accept(uv_stream_t *svr) {
@@ -47,13 +164,96 @@ void tls_stream::accept(uv_stream_t *svr) {
     SSL_set_accept_state(_ssl);
 }
 
+struct handshake_work {
+    uv_work_t req;
+    SSL *ssl;
+    int result;
+    const char *error;
+    P<fiber> _fiber;
+};
+
+/**
+ * Run one server handshake step on the libuv thread pool. The SSL object
+ * only touches our cipher queues, and the fiber owning it waits until the step
+ * is done, so no other thread uses it meanwhile.
+ */
+int tls_stream::offload_handshake() {
+    auto *work = new handshake_work;
+    work->req.data = work;
+    work->ssl = _ssl;
+    work->error = nullptr;
+    work->_fiber = fiber::current();
+    int r = uv_queue_work(uv_default_loop(), &work->req, [] (uv_work_t *req) {
+        auto *self = (handshake_work *)req->data;
+        self->result = SSL_get_error(self->ssl, SSL_do_handshake(self->ssl));
+        // The error queue is per thread, take the reason while we are here
+        if(self->result == SSL_ERROR_SSL)
+            self->error = ERR_reason_error_string(ERR_peek_last_error());
+        ERR_clear_error();
+    }, [] (uv_work_t *req, int status) {
+        auto *self = (handshake_work *)req->data;
+        P<fiber> f = move(self->_fiber);
+        f->resume(status);
+    });
+    if(r < 0) {
+        delete work;
+        throw IOERR(r);
+    }
+    int status = fiber::yield();
+    int result = work->result;
+    const char *error = work->error;
+    delete work;
+    if(status < 0)
+        throw IOERR(status);
+    if(result == SSL_ERROR_SSL)
+        throw RTERR("TLS Error: %s", error ? error : "SSL error");
+    return result;
+}
+
 void tls_stream::do_handshake() {
+    // Readers and writers share one handshake, run by whoever comes first
+    while(!_handshake_ok && _handshaking) {
+        _handshake_waiters.push_back(fiber::current());
+        if(fiber::yield() < 0)
+            throw RTERR("TLS handshake failed");
+    }
+    if(_handshake_ok) return;
+    _handshaking = true;
+    try {
+        handshake_step();
+    }
+    catch(runtime_error &ex) {
+        _handshaking = false;
+        auto waiters = move(_handshake_waiters);
+        for(auto &f : waiters)
+            f->resume(-1);
+        throw;
+    }
+    _handshaking = false;
+    auto waiters = move(_handshake_waiters);
+    for(auto &f : waiters)
+        f->resume(0);
+}
+
+void tls_stream::handshake_step() {
     while(!_handshake_ok) {
-        int r = SSL_get_error(_ssl, SSL_do_handshake(_ssl));
+        // Offload only steps with input to process, such as a ClientHello
+        int r = _offload && SSL_is_server(_ssl) && BIO_ctrl_pending(_rxbio) > 0 ?
+                offload_handshake() : SSL_get_error(_ssl, SSL_do_handshake(_ssl));
         if(handle_want(r))
             continue;
         else if(r == SSL_ERROR_NONE) {
             _handshake_ok = true;
+            const unsigned char *proto;
+            unsigned int protoLen;
+            SSL_get0_alpn_selected(_ssl, &proto, &protoLen);
+            _alpn.assign((const char *)proto, protoLen);
+            if(SSL_is_server(_ssl)) {
+                tls_context *ctx = tls_context::from(SSL_get_SSL_CTX(_ssl));
+                if(ctx) ctx->count_handshake(SSL_session_reused(_ssl));
+            }
+            if(_want_ktls)
+                _ktls = enable_ktls();
             return;
         } else {
             throw RTERR("TLS Error: %s", sslerror_to_string(r));
@@ -61,79 +261,133 @@ void tls_stream::do_handshake() {
     }
 }
 
+char *tls_stream::_prepare_rx(size_t nbytes) {
+    if(!_ssl)
+        return stream::_prepare_rx(nbytes);
+    return _rxq.reserve(nbytes); // Ciphertext goes straight to OpenSSL's queue
+}
+
 void tls_stream::_commit_rx(char *base, int nread) {
     if(!_ssl) {
         stream::_commit_rx(base, nread);
         return;
     }
     if(nread > 0) {
-        if(_chelo_recv) {
-            BIO_write(_rxbio, base, nread);
-        } else if(base[0] == 22) {
-            BIO_write(_rxbio, base, nread);
+        if(_chelo_recv || base[0] == 22) {
+            _rxq.tail += nread;
             _chelo_recv = true;
         } else {
-            buffer.commit(nread);
+            buffer.append(base, nread);
             _handshake_ok = true;
             SSL_free(_ssl);
             _ssl = nullptr;
         }
     }
+    // The reader may release the stream, touch no members after resuming
+    auto waiters = move(_rx_waiters);
     reading_fiber->resume(nread);
+    for(auto &f : waiters)
+        f->resume(nread);
 }
 
 void tls_stream::read(const shared_ptr<decoder> &decoder) {
+    do_handshake(); // A writer running the handshake may be reading meanwhile
     if(reading_fiber) throw RTERR("stream is read-busy");
-    do_handshake();
     if(!_ssl) return stream::read(decoder);
     if(buffer.size() > 0 && decoder->decode(buffer))
         return;
     while(true) {
-        char *buf = buffer.prepare(0x8000);
-        int nread = SSL_read(_ssl, buf, 0x8000);
-        if(nread < 0) {
-            nread = SSL_get_error(_ssl, nread);
-            if(handle_want(nread))
-                continue;
-            else
-                throw RTERR("TLS error: %s", sslerror_to_string(nread));
-        } else if(nread > 0) {
+        // Decrypt all records received so far into one region. Plaintext
+        // never outgrows its ciphertext, except what OpenSSL already holds.
+        size_t room = max<size_t>(_rxq.size() + SSL_pending(_ssl), SSL3_RT_MAX_PLAIN_LENGTH);
+        char *buf = buffer.prepare(room);
+        size_t nread = 0;
+        int r = SSL_ERROR_NONE;
+        while(nread < room) {
+            int n = SSL_read(_ssl, buf + nread, (int)min<size_t>(room - nread, INT_MAX));
+            if(n <= 0) {
+                r = n < 0 ? SSL_get_error(_ssl, n) : SSL_ERROR_WANT_READ;
+                break;
+            }
+            nread += n;
+        }
+        if(nread > 0) {
             buffer.commit(nread);
             if(decoder->decode(buffer))
                 return;
-        } else
-            handle_want(SSL_ERROR_WANT_READ);
+        }
+        if(r != SSL_ERROR_NONE && !handle_want(r))
+            throw RTERR("TLS error: %s", sslerror_to_string(r));
     }
 }
 
 void tls_stream::write(const char *buf, int length) {
-    if(reading_fiber) throw RTERR("half-duplex stream is read-busy");
     do_handshake();
-    if(!_ssl) {
+    if(!_ssl || _ktls) {
         stream::write(buf, length);
         return;
     }
-    while(true) {
-        int r = SSL_get_error(_ssl, SSL_write(_ssl, buf, length));
-        if(handle_want(r))
-            continue;
-        else if(r == SSL_ERROR_NONE)
-            return;
-        throw RTERR("TLS error: %s", sslerror_to_string(r));
+    uint64_t now = uv_now(uv_default_loop());
+    if(now - _last_tx >= (uint64_t)_record_idle)
+        _tx_streak = 0;
+    // Batches of records go out in one socket write each, bounding the queue
+    while(length > 0) {
+        int n = min(length, TLS_TX_BATCH);
+        int record = SSL3_RT_MAX_PLAIN_LENGTH;
+        if(_small_record > 0 && _tx_streak < _record_boost) {
+            record = _small_record;
+            n = (int)min<size_t>(n, _record_boost - _tx_streak);
+        }
+        // Lowering the maximum also lowers the split size, raise both back
+        if(record != _record_size && SSL_set_max_send_fragment(_ssl, record) &&
+           SSL_set_split_send_fragment(_ssl, record))
+            _record_size = record;
+        _txq.reserve(n + (n / _record_size + 1) * TLS_RECORD_OVERHEAD);
+        int r = SSL_get_error(_ssl, SSL_write(_ssl, buf, n));
+        bool again = handle_want(r);
+        if(r == SSL_ERROR_NONE) {
+            buf += n;
+            length -= n;
+            _tx_streak += n;
+        } else if(!again)
+            throw RTERR("TLS error: %s", sslerror_to_string(r));
     }
+    _last_tx = uv_now(uv_default_loop());
+}
+
+/**
+ * Send the records queued so far. The queue is swapped out first, so
+ * other fibers may produce records while this write is in flight; libuv
+ * keeps the order of queued writes.
+ */
+void tls_stream::flush_tx() {
+    if(_txq.size() == 0)
+        return;
+    // OpenSSL no longer knows our sequence number, e.g. for an alert
+    // refusing renegotiation, so the connection can't go on
+    if(_ktls) throw RTERR("TLS record produced after kernel TLS took over");
+    cipher_queue out;
+    out.swap(_txq);
+    _txq.swap(_tx_spare);
+    stream::write(out.data + out.head, (int)out.size());
+    out.consume(out.size());
+    if(!_tx_spare.data)
+        _tx_spare.swap(out);
 }
 
 bool tls_stream::handle_want(int r) {
-    int pendingBytes = BIO_ctrl_pending(_txbio);
-    if(pendingBytes > 0) {
-        char *buf = new char[pendingBytes];
-        BIO_read(_txbio, buf, pendingBytes);
-        stream::write(buf, pendingBytes);
-        delete[] buf;
-    }
+    flush_tx();
     if(r == SSL_ERROR_WANT_WRITE)
         return true;
     else if(r == SSL_ERROR_WANT_READ) {
+        if(reading_fiber && reading_fiber != fiber::current()) {
+            // Another fiber is receiving already, wait for its data
+            _rx_waiters.push_back(fiber::current());
+            auto status = fiber::yield();
+            if(status < 0)
+                throw IOERR(status);
+            return true;
+        }
         auto status = _do_read();
         if(status < 0)
             throw IOERR(status);
@@ -142,23 +396,226 @@ bool tls_stream::handle_want(int r) {
     return false;
 }
 
+void tls_stream::sendfile(int fd, size_t offset, size_t length) {
+    do_handshake();
+    if(_ssl && !_ktls)
+        copy_file(fd, offset, length); // Has to pass through SSL_write()
+    else
+        stream::sendfile(fd, offset, length);
+}
+
+#ifdef __linux__
+// TLS 1.2 PRF (RFC 5246 section 5) with the cipher suite's digest
+static bool tls12_prf(const EVP_MD *md, const unsigned char *secret, size_t secretLen,
+                      const string &labelSeed, unsigned char *out, size_t outLen) {
+    unsigned char a[EVP_MAX_MD_SIZE], block[EVP_MAX_MD_SIZE];
+    unsigned int aLen, blockLen;
+    string input;
+    if(!HMAC(md, secret, secretLen, (const unsigned char *)labelSeed.data(),
+             labelSeed.size(), a, &aLen))
+        return false;
+    while(outLen > 0) {
+        input.assign((char *)a, aLen);
+        input.append(labelSeed);
+        if(!HMAC(md, secret, secretLen, (const unsigned char *)input.data(), input.size(),
+                 block, &blockLen))
+            return false;
+        size_t n = min<size_t>(blockLen, outLen);
+        memcpy(out, block, n);
+        out += n;
+        outLen -= n;
+        if(!HMAC(md, secret, secretLen, a, aLen, a, &aLen))
+            return false;
+    }
+    return true;
+}
+
+#endif
+
+/**
+ * Hand our sending direction over to the kernel after the handshake.
+ * Receiving keeps going through OpenSSL. Any failure leaves the stream on
+ * the user-space path.
+ * @return Whether the kernel encrypts what we write from now on.
+ */
+bool tls_stream::enable_ktls() {
+#ifdef __linux__
+    if(!_ssl) return false;
+    const SSL_CIPHER *cipher = SSL_get_current_cipher(_ssl);
+    const EVP_MD *md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : nullptr;
+    int version = SSL_version(_ssl), nid = cipher ? SSL_CIPHER_get_cipher_nid(cipher) : 0;
+    size_t keyLen, ivLen;
+    switch(nid) {
+        case NID_aes_128_gcm: keyLen = 16; break;
+        case NID_aes_256_gcm: keyLen = 32; break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        case NID_chacha20_poly1305: keyLen = 32; break;
+#endif
+        default: return false;
+    }
+    // TLS 1.3 peers may request a KeyUpdate at any time, and OpenSSL would
+    // answer it with keys the kernel doesn't have. TLS 1.2 renegotiation is
+    // disabled, so nothing else is sent by OpenSSL after the handshake.
+    if(!md || version != TLS1_2_VERSION)
+        return false;
+    bool server = SSL_is_server(_ssl);
+    unsigned char key[32], iv[12];
+    // key_block = client key, server key, client IV, server IV
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH], keyBlock[88];
+    unsigned char random[2 * SSL3_RANDOM_SIZE];
+    size_t masterLen = SSL_SESSION_get_master_key(SSL_get_session(_ssl), master, sizeof(master));
+    ivLen = nid == NID_aes_128_gcm || nid == NID_aes_256_gcm ? 4 : 12;
+    SSL_get_server_random(_ssl, random, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(_ssl, random + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+    string labelSeed = "key expansion" + string((char *)random, sizeof(random));
+    bool derived = tls12_prf(md, master, masterLen, labelSeed, keyBlock, 2 * (keyLen + ivLen));
+    OPENSSL_cleanse(master, sizeof(master));
+    if(!derived) return false;
+    memcpy(key, keyBlock + (server ? keyLen : 0), keyLen);
+    memcpy(iv, keyBlock + 2 * keyLen + (server ? ivLen : 0), ivLen);
+    OPENSSL_cleanse(keyBlock, sizeof(keyBlock));
+    uint64_t seq = 1; // Our Finished went out with these keys
+    unsigned char recSeq[8];
+    for(int i = 7; i >= 0; i--, seq >>= 8)
+        recSeq[i] = seq & 0xff;
+
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+    } info;
+    socklen_t infoLen;
+    memset(&info, 0, sizeof(info));
+    // GCM records carry an explicit nonce; any unique value will do
+    if(nid == NID_aes_128_gcm) {
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, key, 16);
+        memcpy(info.gcm128.salt, iv, 4);
+        memcpy(info.gcm128.iv, recSeq, 8);
+        memcpy(info.gcm128.rec_seq, recSeq, 8);
+        infoLen = sizeof(info.gcm128);
+    } else if(nid == NID_aes_256_gcm) {
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, key, 32);
+        memcpy(info.gcm256.salt, iv, 4);
+        memcpy(info.gcm256.iv, recSeq, 8);
+        memcpy(info.gcm256.rec_seq, recSeq, 8);
+        infoLen = sizeof(info.gcm256);
+    }
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    else {
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(info.chacha.key, key, 32);
+        memcpy(info.chacha.iv, iv, 12);
+        memcpy(info.chacha.rec_seq, recSeq, 8);
+        infoLen = sizeof(info.chacha);
+    }
+#endif
+    info.gcm128.info.version = TLS_1_2_VERSION;
+    OPENSSL_cleanse(key, sizeof(key));
+
+    uv_os_fd_t fd;
+    bool ok = uv_fileno((uv_handle_t *)handle, &fd) == 0 &&
+              setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+              setsockopt(fd, SOL_TLS, TLS_TX, &info, infoLen) == 0;
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ok;
+#else
+    return false;
+#endif
+}
+
 bool tls_stream::has_tls() {
     return _ssl != NULL;
 }
 
+/**
+ * Protocol selected with ALPN, such as "h2". Completes the handshake first.
+ */
+string tls_stream::alpn_protocol() {
+    do_handshake();
+    return _alpn;
+}
+
 void tls_stream::connect(const string &host, int port) {
     if(_handshake_ok)
         throw RTERR("TLS socket already connected");
     tcp_stream::connect(host, port);
     SSL_set_connect_state(_ssl);
+    _peer = fmt("%s:%d", host.c_str(), port);
+    if(!_server_name.empty())
+        _peer = _server_name + "@" + _peer;
+    tls_context *ctx = tls_context::from(SSL_get_SSL_CTX(_ssl));
+    SSL_SESSION *sess = ctx ? ctx->client_session(_peer) : nullptr;
+    if(sess) SSL_set_session(_ssl, sess);
     _chelo_recv = true;
 }
 
+/**
+ * Name the host we want by SNI, for servers with several virtual hosts
+ * on one address. Call before connect().
+ */
+void tls_stream::set_server_name(const string &name) {
+    if(!SSL_set_tlsext_host_name(_ssl, name.c_str()))
+        throw RTERR("Invalid TLS server name: %s", name.c_str());
+    _server_name = name;
+}
+
 tls_stream::~tls_stream() {
-    if(_ssl) SSL_free(_ssl);
+    if(_ssl) {
+        // Sessions freed without a shutdown get invalidated, but the
+        // transport ending after a finished exchange is not a truncation
+        if(_handshake_ok)
+            SSL_set_shutdown(_ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        SSL_free(_ssl);
+    }
 }
 
-tls_context::tls_context() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_callback(SSL *ssl, unsigned char *keyName, unsigned char *iv,
+                               EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+#else
+static int ticket_key_callback(SSL *ssl, unsigned char *keyName, unsigned char *iv,
+                               EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc) {
+#endif
+    tls_context *ctx = tls_context::from(SSL_get_SSL_CTX(ssl));
+    if(!ctx || !ctx->session_tickets())
+        return 0;
+    unsigned char hmacKey[32];
+    int r = ctx->session_tickets()->lookup(keyName, iv, cctx, hmacKey, enc);
+    if(r <= 0)
+        return r;
+    // TLS 1.3 clients use each ticket once, so always hand out a new one
+    if(!enc && SSL_version(ssl) >= TLS1_3_VERSION)
+        r = 2;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)hmacKey, 32),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    if(!EVP_MAC_CTX_set_params(hctx, params))
+        r = -1;
+#else
+    if(!HMAC_Init_ex(hctx, hmacKey, 32, EVP_sha256(), nullptr))
+        r = -1;
+#endif
+    OPENSSL_cleanse(hmacKey, sizeof(hmacKey));
+    return r;
+}
+
+static int context_index() {
+    static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+tls_context::tls_context()
+    : _cache_size(SSL_SESSION_CACHE_MAX_SIZE_DEFAULT), _cache_timeout(300),
+      _hits(0), _misses(0), _offload(false), _ktls(false),
+      _small_record(1369), _record_idle(1000), _record_boost(0x100000),
+      _ocsp_interval(3600), _ocsp_timer(nullptr) {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     _ctx = SSL_CTX_new(SSLv23_method());
 #else
@@ -167,6 +624,11 @@ tls_context::tls_context() {
     if(!_ctx)
         throw RTERR("Failed to create SSL CTX instance");
     SSL_CTX_set_options(_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    SSL_CTX_set_ex_data(_ctx, context_index(), this);
+    SSL_CTX_set_session_id_context(_ctx, (const unsigned char *)"xyhttpd", 7);
+    SSL_CTX_sess_set_new_cb(_ctx, new_session_callback);
+    SSL_CTX_set_alpn_select_cb(_ctx, alpn_callback, nullptr);
+    set_session_cache(_cache_size, _cache_timeout);
 }
 
 tls_context::tls_context(const char *file, const char *key) : tls_context() {
@@ -179,9 +641,121 @@ void tls_context::use_certificate(const char *file) {
                     ERR_reason_error_string(ERR_get_error()));
 }
 
+/**
+ * Use a certificate chain and its private key. A context holds one
+ * certificate per key type: with both an ECDSA and an RSA pair, clients
+ * supporting ECDSA get it and the others fall back to RSA. Loading a
+ * pair of a type already present replaces it.
+ * @param file PEM certificate chain, leaf certificate first.
+ * @param key PEM private key.
+ */
 void tls_context::use_certificate(const char *file, const char *key) {
-    use_certificate(file);
-    SSL_CTX_use_PrivateKey_file(_ctx, key, SSL_FILETYPE_PEM);
+    int type = load_certificate(file, key);
+    for(auto &it : _cert_files) {
+        if(it.type == type) {
+            it.file = file;
+            it.key = key;
+            return;
+        }
+    }
+    _cert_files.push_back({ type, file, key });
+    // Our order (ECDSA first by default) decides when both would do
+    SSL_CTX_set_options(_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+}
+
+int tls_context::load_certificate(const string &file, const string &key) {
+    BIO *bio = BIO_new_file(file.c_str(), "r");
+    if(!bio)
+        throw RTERR("Failed to open certificate file %s", file.c_str());
+    X509 *leaf = PEM_read_bio_X509_AUX(bio, nullptr, nullptr, nullptr), *ca;
+    STACK_OF(X509) *chain = sk_X509_new_null();
+    while((ca = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)))
+        sk_X509_push(chain, ca);
+    BIO_free(bio);
+    ERR_clear_error(); // Reading past the last certificate
+    EVP_PKEY *pkey = nullptr;
+    if((bio = BIO_new_file(key.c_str(), "r"))) {
+        pkey = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+        BIO_free(bio);
+    }
+    int type = pkey ? EVP_PKEY_base_id(pkey) : EVP_PKEY_NONE;
+    const char *error = !leaf ? "no certificate found" : !pkey ? "unreadable private key" : nullptr;
+    if(!error) {
+        // Running handshakes may switch to this context meanwhile
+        lock_guard<mutex> guard(_cert_lock);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        bool ok = SSL_CTX_use_cert_and_key(_ctx, leaf, pkey, chain, 1) == 1;
+#else
+        bool ok = SSL_CTX_use_certificate(_ctx, leaf) && SSL_CTX_use_PrivateKey(_ctx, pkey) &&
+                  SSL_CTX_set1_chain(_ctx, chain);
+#endif
+        if(!ok) {
+            error = ERR_reason_error_string(ERR_get_error());
+            if(!error) error = "key does not match the certificate";
+        }
+    }
+    X509_free(leaf);
+    EVP_PKEY_free(pkey);
+    sk_X509_pop_free(chain, X509_free);
+    if(error)
+        throw RTERR("Failed to use certificate %s: %s", file.c_str(), error);
+    return type;
+}
+
+/**
+ * Read the certificate and key files again, e.g. after renewal, for this
+ * context and the SNI contexts registered on it. New handshakes use the
+ * new certificates; established connections are not affected.
+ */
+void tls_context::reload_certificates() {
+    for(auto &it : _cert_files)
+        load_certificate(it.file, it.key);
+    if(!_ocsp_path.empty()) {
+        try {
+            set_ocsp_staple(_ocsp_path, _ocsp_interval);
+        }
+        catch(runtime_error &ex) {
+            lock_guard<mutex> guard(_cert_lock);
+            _ocsp.clear(); // Responses for the old certificates are of no use
+            cerr << ex.what() << endl;
+        }
+    }
+    for(auto &it : _others)
+        it.second->reload_certificates();
+}
+
+// Compare host names case-insensitively, the way SNI matches them
+static int compare_host(const string &a, const char *b, size_t bLen) {
+    size_t n = min(a.size(), bLen);
+    for(size_t i = 0; i < n; i++) {
+        int x = tolower((unsigned char)a[i]), y = tolower((unsigned char)b[i]);
+        if(x != y) return x - y;
+    }
+    return a.size() < bLen ? -1 : a.size() > bLen ? 1 : 0;
+}
+
+/**
+ * Find the context registered for a host name, without allocating. An
+ * exact name wins over a wildcard, which covers a single label only.
+ */
+tls_context *tls_context::find_context(const char *name) const {
+    struct host_key { const char *name; size_t len; };
+    auto less = [] (const sni_entry &e, const host_key &k) {
+        return compare_host(e.name, k.name, k.len) < 0;
+    };
+    auto find = [&less] (const vector<sni_entry> &entries, host_key key) -> tls_context * {
+        auto it = lower_bound(entries.begin(), entries.end(), key, less);
+        return it != entries.end() && compare_host(it->name, key.name, key.len) == 0 ?
+               it->ctx : nullptr;
+    };
+    size_t len = strlen(name);
+    if(len > 0 && name[len - 1] == '.')
+        len--; // Absolute form
+    tls_context *found = find(_sni_exact, { name, len });
+    const char *dot = (const char *)memchr(name, '.', len);
+    if(!found && dot && dot > name)
+        found = find(_sni_wildcard, { dot, len - (dot - name) });
+    return found;
 }
 
 int tls_context::sni_callback(SSL *ssl, int *ad, void *arg) {
@@ -192,29 +766,540 @@ int tls_context::sni_callback(SSL *ssl, int *ad, void *arg) {
     if(hostNamePtr == NULL)
         return SSL_TLSEXT_ERR_OK; // No hostname (eg. connect via IP address)
 
-    string hostName(hostNamePtr);
     tls_context *self = static_cast<tls_context *>(arg);
-    if(self->_others.find(hostName) != self->_others.end())
-        SSL_set_SSL_CTX(ssl, self->_others[hostName]->_ctx);
+    tls_context *target = self->find_context(hostNamePtr);
+    if(target) {
+        lock_guard<mutex> guard(target->_cert_lock);
+        SSL_set_SSL_CTX(ssl, target->_ctx);
+    }
     return SSL_TLSEXT_ERR_OK;
 }
 
+/**
+ * Serve a host name with another context, chosen by SNI.
+ * @param hostname Exact name, or a wildcard like *.example.com matching
+ *        one label in place of the asterisk.
+ */
 void tls_context::register_context(const string &hostname, P<tls_context> ctx) {
     if(_others.empty()) {
         SSL_CTX_set_tlsext_servername_callback(_ctx, tls_context::sni_callback);
         SSL_CTX_set_tlsext_servername_arg(_ctx, this);
     }
+    apply_shared_settings(*ctx);
     _others[hostname] = ctx;
+    rebuild_sni_index();
+}
+
+void tls_context::rebuild_sni_index() {
+    _sni_exact.clear();
+    _sni_wildcard.clear();
+    for(auto &it : _others) {
+        if(it.first.compare(0, 2, "*.") == 0)
+            _sni_wildcard.push_back({ it.first.substr(1), it.second.get() });
+        else
+            _sni_exact.push_back({ it.first, it.second.get() });
+    }
+    auto less = [] (const sni_entry &a, const sni_entry &b) {
+        return compare_host(a.name, b.name.data(), b.name.size()) < 0;
+    };
+    sort(_sni_exact.begin(), _sni_exact.end(), less);
+    sort(_sni_wildcard.begin(), _sni_wildcard.end(), less);
+}
+
+tls_context *tls_context::from(SSL_CTX *ctx) {
+    return static_cast<tls_context *>(SSL_CTX_get_ex_data(ctx, context_index()));
+}
+
+/**
+ * Configure the server-side session cache and the lifetime of sessions,
+ * including those resumed from tickets. Applies to registered SNI
+ * contexts as well.
+ * @param size Maximum cached sessions, 0 disables the cache.
+ * @param timeout Session lifetime in seconds.
+ */
+void tls_context::set_session_cache(long size, long timeout) {
+    _cache_size = size;
+    _cache_timeout = timeout;
+    SSL_CTX_set_session_cache_mode(_ctx, size > 0 ?
+            SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_CLIENT : SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_sess_set_cache_size(_ctx, size);
+    SSL_CTX_set_timeout(_ctx, timeout);
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+/**
+ * Encrypt session tickets with managed, rotating keys. Sharing one key
+ * set between contexts (or processes behind the same address) lets
+ * clients resume on any of them.
+ */
+void tls_context::set_session_tickets(P<tls_ticket_keys> keys) {
+    _tickets = move(keys);
+    if(_tickets)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(_ctx, ticket_key_callback);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(_ctx, ticket_key_callback);
+#endif
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+void tls_context::apply_shared_settings(tls_context &sub) {
+    if(&sub == this) return;
+    // OpenSSL resumes against the context a handshake started with, but
+    // keep sub-contexts consistent in case they are used on their own.
+    sub.set_session_cache(_cache_size, _cache_timeout);
+    if(_tickets)
+        sub.set_session_tickets(_tickets);
+    sub.set_ktls(_ktls);
+    sub.set_record_sizing(_small_record, _record_boost, _record_idle);
+    sub._alpn = _alpn;
+    if(!_ocsp_dir.empty() && sub._ocsp.empty()) {
+        try {
+            sub.set_ocsp_staple(_ocsp_dir, _ocsp_interval);
+        }
+        catch(runtime_error &ex) {} // Not every certificate needs a response
+    }
+}
+
+/**
+ * Let the kernel encrypt outgoing records after the handshake (kTLS),
+ * so that files can be sent with sendfile(2). Only TLS 1.2 sessions are
+ * handed over. Streams silently keep encrypting in user space if the
+ * kernel, the protocol version or the cipher suite does not support it.
+ */
+void tls_context::set_ktls(bool enable) {
+    _ktls = enable;
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+/**
+ * Size the records of new streams dynamically. After an idle period the
+ * first bytes go in records small enough for a single TCP segment, so
+ * the peer can decrypt them without waiting for more packets. Once the
+ * connection is streaming, records grow to 16 KB to save framing and
+ * per-record crypto. Records sent by the kernel (kTLS) are not affected.
+ * @param smallRecord Plaintext bytes per small record, 0 to always send full records.
+ * @param boostAfter Bytes to send in small records before growing them.
+ * @param idleTimeout Milliseconds without writes after which records shrink again.
+ */
+void tls_context::set_record_sizing(int smallRecord, size_t boostAfter, int idleTimeout) {
+    if(smallRecord > 0)
+        smallRecord = max(512, min(smallRecord, SSL3_RT_MAX_PLAIN_LENGTH));
+    _small_record = smallRecord;
+    _record_boost = boostAfter;
+    _record_idle = idleTimeout;
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+/**
+ * Offer application protocols with ALPN, most preferred first. Servers
+ * pick the first of theirs the client supports; clients send the list.
+ * @param protocols Protocol names such as "h2" and "http/1.1", empty to disable.
+ */
+void tls_context::set_alpn_protocols(const vector<string> &protocols) {
+    string wire;
+    for(auto &proto : protocols) {
+        if(proto.empty() || proto.size() > 255)
+            throw RTERR("invalid ALPN protocol name: %s", proto.c_str());
+        wire.push_back((char)proto.size());
+        wire.append(proto);
+    }
+    if(SSL_CTX_set_alpn_protos(_ctx, (const unsigned char *)wire.data(), wire.size()) != 0)
+        throw RTERR("Failed to set ALPN protocols");
+    _alpn = move(wire);
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+int tls_context::alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                               const unsigned char *in, unsigned int inlen, void *) {
+    tls_context *self = from(SSL_get_SSL_CTX(ssl));
+    if(!self || self->_alpn.empty())
+        return SSL_TLSEXT_ERR_NOACK;
+    if(SSL_select_next_proto((unsigned char **)out, outlen,
+                             (const unsigned char *)self->_alpn.data(), self->_alpn.size(),
+                             in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void tls_context::count_handshake(bool resumed) {
+    if(resumed) _hits++;
+    else _misses++;
+}
+
+uint64_t tls_context::session_hits() const {
+    uint64_t n = _hits;
+    for(auto &it : _others)
+        if(it.second.get() != this) n += it.second->_hits;
+    return n;
+}
+
+uint64_t tls_context::session_misses() const {
+    uint64_t n = _misses;
+    for(auto &it : _others)
+        if(it.second.get() != this) n += it.second->_misses;
+    return n;
+}
+
+SSL_SESSION *tls_context::client_session(const string &peer) {
+    auto it = _client_sessions.find(peer);
+    if(it == _client_sessions.end())
+        return nullptr;
+    if(!SSL_SESSION_is_resumable(it->second)) {
+        SSL_SESSION_free(it->second);
+        _client_sessions.erase(it);
+        return nullptr;
+    }
+    return it->second;
+}
+
+/**
+ * Remember sessions offered to our client connections, keyed by peer,
+ * so that the next connection to the same upstream can resume.
+ */
+int tls_context::new_session_callback(SSL *ssl, SSL_SESSION *sess) {
+    if(SSL_is_server(ssl))
+        return 0;
+    auto *strm = static_cast<tls_stream *>(SSL_get_app_data(ssl));
+    tls_context *self = from(SSL_get_SSL_CTX(ssl));
+    if(!strm || !self || strm->_peer.empty())
+        return 0;
+    auto it = self->_client_sessions.find(strm->_peer);
+    if(it != self->_client_sessions.end()) {
+        SSL_SESSION_free(it->second);
+        it->second = sess;
+    } else {
+        if(self->_client_sessions.size() >= (size_t)max(self->_cache_size, 1L)) {
+            SSL_SESSION_free(self->_client_sessions.begin()->second);
+            self->_client_sessions.erase(self->_client_sessions.begin());
+        }
+        self->_client_sessions[strm->_peer] = sess;
+    }
+    return 1; // The reference is ours now
 }
 
 void tls_context::unregister_context(const string &hostname) {
     _others.erase(hostname);
+    rebuild_sni_index();
+}
+
+/*
+ * The OCSP response stapled for one certificate of a tls_context.
+ * Handshakes only copy the cached bytes; reading and checking a newer
+ * response happens on the libuv thread pool.
+ */
+struct tls_context::ocsp_staple {
+    X509 *cert = nullptr;
+    string file;
+    OCSP_CERTID *id = nullptr;
+    mutex lock; // Offloaded handshakes staple from worker threads
+    chunk response;
+    time_t next_update = 0;
+    bool refreshing = false;
+
+    ~ocsp_staple() {
+        OCSP_CERTID_free(id);
+        X509_free(cert);
+    }
+};
+
+/**
+ * Read a DER encoded OCSP response and check that it tells the
+ * certificate is good right now. Signatures are left to the clients.
+ */
+static bool load_ocsp_response(const string &file, OCSP_CERTID *id, string &der,
+                               time_t &nextUpdate, string &error) {
+    ifstream in(file, ios::binary);
+    if(!in) {
+        error = "cannot open " + file;
+        return false;
+    }
+    der.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    error.clear();
+    const unsigned char *p = (const unsigned char *)der.data();
+    OCSP_RESPONSE *resp = d2i_OCSP_RESPONSE(nullptr, &p, der.size());
+    OCSP_BASICRESP *basic = resp && OCSP_response_status(resp) ==
+            OCSP_RESPONSE_STATUS_SUCCESSFUL ? OCSP_response_get1_basic(resp) : nullptr;
+    int status, reason, days, secs;
+    ASN1_GENERALIZEDTIME *thisUpd, *nextUpd;
+    if(!basic)
+        error = "not a successful OCSP response";
+    else if(!OCSP_resp_find_status(basic, id, &status, &reason, nullptr, &thisUpd, &nextUpd))
+        error = "certificate not covered by the response";
+    else if(status != V_OCSP_CERTSTATUS_GOOD)
+        error = string("certificate status is ") + OCSP_cert_status_str(status);
+    else if(!OCSP_check_validity(thisUpd, nextUpd, 300, -1))
+        error = "response expired or not yet valid";
+    else if(nextUpd && ASN1_TIME_diff(&days, &secs, nullptr, nextUpd))
+        nextUpdate = time(nullptr) + days * 86400L + secs;
+    else
+        nextUpdate = 0;
+    OCSP_BASICRESP_free(basic);
+    OCSP_RESPONSE_free(resp);
+    ERR_clear_error();
+    return error.empty();
+}
+
+/**
+ * Staple OCSP responses to handshakes of clients asking for one. The
+ * responses are read again every refresh interval without holding
+ * handshakes up; a stale one is dropped once expired.
+ * @param path DER response file, or a directory holding one per
+ *        certificate named after its serial (uppercase hex, e.g.
+ *        0A1B2C.der). SNI contexts registered later look theirs up in
+ *        the same directory.
+ * @param refreshInterval Seconds between reloads, 0 to load only once.
+ */
+void tls_context::set_ocsp_staple(const string &path, int refreshInterval) {
+    struct stat st;
+    bool isDir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    vector<P<ocsp_staple>> staples;
+    string error;
+    // One response per certificate we hold (e.g. ECDSA and RSA)
+    for(int r = SSL_CTX_set_current_cert(_ctx, SSL_CERT_SET_FIRST); r == 1;
+        r = SSL_CTX_set_current_cert(_ctx, SSL_CERT_SET_NEXT)) {
+        X509 *cert = SSL_CTX_get0_certificate(_ctx), *issuer = nullptr;
+        STACK_OF(X509) *chain = nullptr;
+        SSL_CTX_get0_chain_certs(_ctx, &chain);
+        for(int i = 0; chain && i < sk_X509_num(chain) && !issuer; i++)
+            if(X509_check_issued(sk_X509_value(chain, i), cert) == X509_V_OK)
+                issuer = sk_X509_value(chain, i);
+        if(!issuer && X509_check_issued(cert, cert) == X509_V_OK)
+            issuer = cert;
+        if(!issuer) {
+            error = "issuer certificate not in the chain";
+            continue;
+        }
+        auto staple = make_shared<ocsp_staple>();
+        X509_up_ref(cert);
+        staple->cert = cert;
+        staple->file = path;
+        if(isDir) {
+            BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), nullptr);
+            char *hex = bn ? BN_bn2hex(bn) : nullptr;
+            staple->file = path + "/" + (hex ? hex : "") + ".der";
+            OPENSSL_free(hex);
+            BN_free(bn);
+        }
+        staple->id = OCSP_cert_to_id(nullptr, cert, issuer);
+        if(!staple->id)
+            continue;
+        string der;
+        if(load_ocsp_response(staple->file, staple->id, der, staple->next_update, error))
+            staple->response = chunk(der.data(), der.size());
+        else if(!isDir)
+            continue; // A single file covers one of our certificates
+        staples.push_back(staple);
+    }
+    ERR_clear_error();
+    if(staples.empty())
+        throw RTERR("Unusable OCSP response: %s", error.empty() ? "no certificate" : error.c_str());
+
+    {
+        lock_guard<mutex> guard(_cert_lock);
+        _ocsp = move(staples);
+    }
+    _ocsp_path = path;
+    _ocsp_dir = isDir ? path : string();
+    _ocsp_interval = refreshInterval;
+    if(!_ocsp_timer) {
+        _ocsp_timer = mem_alloc<uv_timer_t>();
+        if(uv_timer_init(uv_default_loop(), _ocsp_timer) < 0) {
+            free(_ocsp_timer);
+            _ocsp_timer = nullptr;
+            throw bad_alloc();
+        }
+        _ocsp_timer->data = this;
+        uv_unref((uv_handle_t *)_ocsp_timer);
+    }
+    uv_timer_stop(_ocsp_timer);
+    if(refreshInterval > 0) {
+        uint64_t interval = (uint64_t)refreshInterval * 1000;
+        uv_timer_start(_ocsp_timer, [] (uv_timer_t *t) {
+            auto *self = static_cast<tls_context *>(t->data);
+            fiber::launch([self] () { self->refresh_ocsp_staple(); });
+        }, interval, interval);
+    }
+    SSL_CTX_set_tlsext_status_cb(_ctx, ocsp_status_callback);
+    for(auto &it : _others)
+        apply_shared_settings(*it.second);
+}
+
+/**
+ * Read the OCSP response files again on the thread pool and staple them
+ * from now on. Called by the refresh timer, or directly from a fiber.
+ */
+void tls_context::refresh_ocsp_staple() {
+    struct ocsp_work {
+        uv_work_t req;
+        P<ocsp_staple> staple;
+        string der, error;
+        time_t next_update;
+        bool ok;
+        P<fiber> _fiber;
+    };
+    vector<P<ocsp_staple>> staples = _ocsp;
+    // The context may go away meanwhile, only the staples are used below
+    for(auto &staple : staples) {
+        if(staple->refreshing)
+            continue;
+        auto *work = new ocsp_work;
+        work->req.data = work;
+        work->staple = staple;
+        work->_fiber = fiber::current();
+        int r = uv_queue_work(uv_default_loop(), &work->req, [] (uv_work_t *req) {
+            auto *self = (ocsp_work *)req->data;
+            self->ok = load_ocsp_response(self->staple->file, self->staple->id,
+                                          self->der, self->next_update, self->error);
+        }, [] (uv_work_t *req, int status) {
+            auto *self = (ocsp_work *)req->data;
+            P<fiber> f = move(self->_fiber);
+            f->resume(status);
+        });
+        if(r < 0) {
+            delete work;
+            throw IOERR(r);
+        }
+        staple->refreshing = true;
+        int status = fiber::yield();
+        staple->refreshing = false;
+        {
+            lock_guard<mutex> guard(staple->lock);
+            if(status == 0 && work->ok) {
+                staple->response = chunk(work->der.data(), work->der.size());
+                staple->next_update = work->next_update;
+            } else if(staple->next_update && staple->next_update <= time(nullptr)) {
+                staple->response = chunk();
+            }
+        }
+        if(status == 0 && !work->ok)
+            cerr << "OCSP response not refreshed: " << work->error << endl;
+        delete work;
+    }
+}
+
+int tls_context::ocsp_status_callback(SSL *ssl, void *) {
+    tls_context *ctx = from(SSL_get_SSL_CTX(ssl));
+    X509 *cert = SSL_get_certificate(ssl);
+    P<ocsp_staple> staple;
+    if(ctx) {
+        lock_guard<mutex> guard(ctx->_cert_lock);
+        for(auto &it : ctx->_ocsp)
+            if(it->cert == cert)
+                staple = it;
+    }
+    if(!staple)
+        return SSL_TLSEXT_ERR_NOACK;
+    lock_guard<mutex> guard(staple->lock);
+    size_t len = staple->response.size();
+    if(len == 0 || (staple->next_update && staple->next_update <= time(nullptr)))
+        return SSL_TLSEXT_ERR_NOACK;
+    auto *der = (unsigned char *)OPENSSL_malloc(len);
+    if(!der)
+        return SSL_TLSEXT_ERR_NOACK;
+    memcpy(der, staple->response.data(), len);
+    SSL_set_tlsext_status_ocsp_resp(ssl, der, len);
+    return SSL_TLSEXT_ERR_OK;
 }
 
 tls_context::~tls_context() {
+    if(_ocsp_timer)
+        uv_close((uv_handle_t *)_ocsp_timer, (uv_close_cb) free);
+    for(auto &it : _client_sessions)
+        SSL_SESSION_free(it.second);
+    // Streams may still hold references to the SSL_CTX
+    SSL_CTX_set_ex_data(_ctx, context_index(), nullptr);
     SSL_CTX_free(_ctx);
 }
 
+tls_ticket_keys::tls_ticket_keys(int rotateInterval, int graceWindow)
+    : _grace((uint64_t)graceWindow * 1000) {
+    rotate();
+    _timer = mem_alloc<uv_timer_t>();
+    if(uv_timer_init(uv_default_loop(), _timer) < 0) {
+        free(_timer);
+        throw bad_alloc();
+    }
+    _timer->data = this;
+    if(rotateInterval > 0) {
+        uint64_t interval = (uint64_t)rotateInterval * 1000;
+        uv_timer_start(_timer, [] (uv_timer_t *t) {
+            static_cast<tls_ticket_keys *>(t->data)->rotate();
+        }, interval, interval);
+        uv_unref((uv_handle_t *)_timer);
+    }
+}
+
+tls_ticket_keys::~tls_ticket_keys() {
+    uv_close((uv_handle_t *)_timer, (uv_close_cb) free);
+    OPENSSL_cleanse(_keys.data(), _keys.size() * sizeof(ticket_key));
+}
+
+/**
+ * Start sealing new tickets with a fresh key. The previous key keeps
+ * opening tickets until the grace window has passed.
+ */
+void tls_ticket_keys::rotate() {
+    ticket_key key;
+    if(RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+       RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+       RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)
+        throw RTERR("Failed to generate session ticket key");
+    key.retired_at = 0;
+    lock_guard<mutex> guard(_lock);
+    if(!_keys.empty())
+        _keys.front().retired_at = uv_hrtime() / 1000000;
+    _keys.insert(_keys.begin(), key);
+    expire();
+}
+
+void tls_ticket_keys::expire() {
+    uint64_t now = uv_hrtime() / 1000000;
+    for(auto it = _keys.begin() + 1; it != _keys.end();) {
+        if(now - it->retired_at >= _grace) {
+            OPENSSL_cleanse(&*it, sizeof(ticket_key));
+            it = _keys.erase(it);
+        } else it++;
+    }
+}
+
+/**
+ * Select the key to seal (enc = 1) or open (enc = 0) a ticket.
+ * @param hmacKey Receives a copy of the 32-byte HMAC key.
+ * @return 1 to accept, 2 to accept and issue a renewed ticket, 0 for an
+ *         unknown or expired key, -1 on failure.
+ */
+int tls_ticket_keys::lookup(unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cctx,
+                            unsigned char *hmacKey, int enc) {
+    lock_guard<mutex> guard(_lock);
+    if(enc) {
+        const ticket_key &key = _keys.front();
+        if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        memcpy(keyName, key.name, sizeof(key.name));
+        if(!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv))
+            return -1;
+        memcpy(hmacKey, key.hmac_key, sizeof(key.hmac_key));
+        return 1;
+    }
+    expire();
+    for(size_t i = 0; i < _keys.size(); i++) {
+        const ticket_key &key = _keys[i];
+        if(memcmp(keyName, key.name, sizeof(key.name)) != 0)
+            continue;
+        if(!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv))
+            return -1;
+        memcpy(hmacKey, key.hmac_key, sizeof(key.hmac_key));
+        return i == 0 ? 1 : 2;
+    }
+    return 0;
+}
+
 https_server::https_server(P<tls_context> ctx, P<http_service> svc)
         : http_server(move(svc)), _ctx(move(ctx)) {}
 
@@ -250,6 +1335,8 @@ static void https_server_on_connection(uv_stream_t* strm, int status) {
 }
 
 void https_server::do_listen(int backlog) {
+    if(_http2)
+        _ctx->set_alpn_protocols({ "h2", "http/1.1" });
     int r = uv_listen((uv_stream_t *)_server, backlog, https_server_on_connection);
     if(r < 0)
         throw runtime_error(uv_strerror(r));
@@ -1,6 +1,14 @@
 #include "xystream.h"
 #include <cstring>
+#include <cerrno>
 #include <iostream>
+#ifndef _WIN32
+# include <sys/socket.h>
+# include <unistd.h>
+#endif
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
 
 using namespace std;
 
@@ -169,7 +177,7 @@ class stream::callbacks {
 public:
     static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
         stream *self = (stream *)handle->data;
-        buf->base = self->buffer.prepare(suggested_size);
+        buf->base = self->_prepare_rx(suggested_size);
         buf->len = buf->base ? suggested_size : 0;
     }
 
@@ -224,6 +232,78 @@ void stream::write(const char *chunk, int length)
         throw IOERR(status);
 }
 
+/**
+ * Send length bytes of file fd starting at offset. Socket streams use
+ * sendfile(2) on Linux, so file data never enters user space.
+ */
+void stream::sendfile(int fd, size_t offset, size_t length) {
+#ifdef __linux__
+    uv_os_fd_t sock;
+    if(handle && uv_fileno((uv_handle_t *)handle, &sock) == 0) {
+        uv_poll_t *poller = nullptr;
+        int dupfd = -1, error = 0;
+        off_t off = offset;
+        while(length > 0) {
+            ssize_t n = ::sendfile(sock, fd, &off, min<size_t>(length, 0x40000000));
+            if(n > 0) {
+                length -= n;
+            } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // libuv owns the socket, so watch a duplicate for writability
+                if(!poller) {
+                    if((dupfd = dup(sock)) < 0) break;
+                    poller = mem_alloc<uv_poll_t>();
+                    if(uv_poll_init(uv_default_loop(), poller, dupfd) < 0) {
+                        free(poller);
+                        poller = nullptr;
+                        break;
+                    }
+                }
+                poller->data = fiber::current().get();
+                uv_poll_start(poller, UV_WRITABLE, [] (uv_poll_t *p, int status, int) {
+                    uv_poll_stop(p);
+                    ((fiber *)p->data)->resume(status);
+                });
+                if((error = fiber::yield()) < 0) break;
+            } else if(n == 0 || errno == EINVAL || errno == ENOSYS) {
+                break; // Let the copying path handle it
+            } else {
+                error = -errno;
+                break;
+            }
+        }
+        if(poller) // Closing the handle unregisters the fd immediately
+            uv_close((uv_handle_t *)poller, (uv_close_cb) free);
+        if(dupfd >= 0)
+            ::close(dupfd);
+        if(error < 0)
+            throw IOERR(error);
+        offset = off;
+    }
+#endif
+    if(length > 0)
+        copy_file(fd, offset, length);
+}
+
+void stream::copy_file(int fd, size_t offset, size_t length) {
+    if(lseek(fd, offset, SEEK_SET) == -1)
+        throw RTERR("seek failed: %s", strerror(errno));
+    char *buf = new char[0x10000];
+    try {
+        while(length > 0) {
+            int avail = ::read(fd, buf, min<size_t>(0x10000, length));
+            if(avail <= 0)
+                throw RTERR("file truncated while sending");
+            write(buf, avail);
+            length -= avail;
+        }
+    }
+    catch(runtime_error &ex) {
+        delete[] buf;
+        throw;
+    }
+    delete[] buf;
+}
+
 void stream::write(const shared_ptr<message> &msg) {
     int size = msg->serialize_size();
     char *buf = new char[size];
@@ -236,6 +316,15 @@ void stream::write(const chunk &str) {
     write(str.data(), str.size());
 }
 
+/**
+ * Provide room for the next socket read, handed to _commit_rx() afterwards.
+ * @param nbytes Byte count to prepare.
+ * @return The address data should be received at.
+ */
+char *stream::_prepare_rx(size_t nbytes) {
+    return buffer.prepare(nbytes);
+}
+
 void stream::_commit_rx(char *base, int nread) {
     if(nread < 0) {
         reading_fiber->resume(nread);
@@ -270,10 +359,129 @@ int stream::_do_read() {
     return status;
 }
 
+/**
+ * Make a pending read fail as if the connection had, from another fiber.
+ * @param status The error the reader gets, such as UV_ECONNABORTED.
+ */
+void stream::cancel_read(int status) {
+    if(!reading_fiber)
+        return;
+    uv_timer_stop(_timeOuter);
+    reading_fiber->resume(status);
+}
+
 void stream::set_timeout(int timeout) {
     _timeout = timeout;
 }
 
+timer_wheel::entry::entry() : _prev(nullptr), _next(nullptr), _due(0), _wheel(nullptr) {}
+
+timer_wheel::entry::~entry() {
+    cancel();
+}
+
+void timer_wheel::entry::unlink() {
+    _prev->_next = _next;
+    _next->_prev = _prev;
+    _prev = _next = nullptr;
+}
+
+void timer_wheel::entry::cancel() {
+    if(!_next)
+        return;
+    unlink();
+    if(--_wheel->_size == 0)
+        _wheel->stop();
+}
+
+timer_wheel::timer_wheel(int tickMs, int slots)
+        : _slots(max(slots, 1)), _tick(0), _size(0), _tick_ms(max(tickMs, 1)), _timer(nullptr) {
+    for(auto &head : _slots)
+        head._prev = head._next = &head;
+}
+
+timer_wheel::~timer_wheel() {
+    for(auto &head : _slots) {
+        while(head._next != &head)
+            head._next->cancel();
+        head._prev = head._next = nullptr;
+    }
+    stop();
+}
+
+/**
+ * The timer only exists while something is scheduled, an idle wheel
+ * leaves no handle on the loop.
+ */
+void timer_wheel::start() {
+    _timer = mem_alloc<uv_timer_t>();
+    if(uv_timer_init(uv_default_loop(), _timer) < 0) {
+        free(_timer);
+        _timer = nullptr;
+        throw runtime_error("failed to setup timer wheel");
+    }
+    _timer->data = this;
+    uv_unref((uv_handle_t *)_timer); // Whatever is timed keeps the loop alive
+    uv_timer_start(_timer, on_tick, _tick_ms, _tick_ms);
+}
+
+void timer_wheel::stop() {
+    if(!_timer)
+        return;
+    uv_close((uv_handle_t *)_timer, (uv_close_cb) free);
+    _timer = nullptr;
+}
+
+void timer_wheel::link(entry &head, entry &e) {
+    e._prev = head._prev;
+    e._next = &head;
+    head._prev->_next = &e;
+    head._prev = &e;
+}
+
+void timer_wheel::schedule(entry &e, uint64_t delayMs) {
+    e.cancel();
+    if(!_timer)
+        start();
+    e._wheel = this;
+    e._due = _tick + max<uint64_t>((delayMs + _tick_ms - 1) / _tick_ms, 1);
+    link(_slots[e._due % _slots.size()], e);
+    _size++;
+}
+
+void timer_wheel::on_tick(uv_timer_t *timer) {
+    auto self = (timer_wheel *)timer->data;
+    uint64_t tick = ++self->_tick;
+    entry &head = self->_slots[tick % self->_slots.size()];
+    // Take the slot over, callbacks may schedule or cancel anything
+    entry pending;
+    if(head._next == &head)
+        return;
+    pending._next = head._next;
+    pending._prev = head._prev;
+    pending._next->_prev = pending._prev->_next = &pending;
+    head._prev = head._next = &head;
+    while(pending._next != &pending) {
+        entry *e = pending._next;
+        e->unlink();
+        if(e->_due > tick) { // Later turn
+            self->link(head, *e);
+            continue;
+        }
+        self->_size--;
+        if(e->callback)
+            e->callback();
+    }
+    pending._prev = pending._next = nullptr;
+    if(self->_size == 0)
+        self->stop();
+}
+
+timer_wheel &timer_wheel::shared() {
+    static timer_wheel *wheel = new timer_wheel(); // Lives as long as the loop
+    return *wheel;
+}
+
 static void stream_on_shutdown(uv_shutdown_t* req, int status) {
     auto self = (stream::write_request *)req->data;
     shared_ptr<fiber> f = move(self->_fiber);
@@ -295,6 +503,34 @@ bool stream::has_tls() {
     return false;
 }
 
+/**
+ * Application protocol negotiated with ALPN, empty if none.
+ */
+string stream::alpn_protocol() {
+    return string();
+}
+
+/**
+ * Check without blocking whether an idle stream is still usable. Streams
+ * with unconsumed data or closed by the peer are considered dead.
+ * @return false if the stream should not be reused.
+ */
+bool stream::alive() {
+    if(!handle || reading_fiber || buffer.size() > 0 ||
+       uv_is_closing((uv_handle_t *)handle))
+        return false;
+#ifndef _WIN32
+    uv_os_fd_t fd;
+    char peek;
+    if(uv_fileno((uv_handle_t *)handle, &fd) < 0)
+        return false;
+    ssize_t r = recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+    return true;
+#endif
+}
+
 tcp_stream::tcp_stream() {
     uv_tcp_t *h = mem_alloc<uv_tcp_t>();
     if(uv_tcp_init(uv_default_loop(), h) < 0) {
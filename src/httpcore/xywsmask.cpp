@@ -0,0 +1,106 @@
+#include "xyhttp.h"
+
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define XY_MASK_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define XY_MASK_NEON
+#endif
+
+/*
+ * WebSocket payload masking kernels. Each one XORs as many whole vectors as
+ * fit in len with the key repeated across them, returning the byte count
+ * done, which is always a multiple of 4 so the key stays in phase for the
+ * rest. The widest one the CPU supports is picked at startup.
+ */
+using mask_kernel = size_t (*)(unsigned char *p, size_t len, uint32_t key);
+
+static size_t mask_word(unsigned char *p, size_t len, uint32_t key) {
+    uint64_t k = (uint64_t)key << 32 | key;
+    size_t n = 0;
+    for(; n + 8 <= len; n += 8) {
+        uint64_t v;
+        memcpy(&v, p + n, 8);
+        v ^= k;
+        memcpy(p + n, &v, 8);
+    }
+    return n;
+}
+
+#ifdef XY_MASK_X86
+__attribute__((target("sse2")))
+static size_t mask_sse2(unsigned char *p, size_t len, uint32_t key) {
+    __m128i k = _mm_set1_epi32((int)key);
+    size_t n = 0;
+    for(; n + 16 <= len; n += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + n));
+        _mm_storeu_si128((__m128i *)(p + n), _mm_xor_si128(v, k));
+    }
+    return n + mask_word(p + n, len - n, key);
+}
+
+__attribute__((target("avx2")))
+static size_t mask_avx2(unsigned char *p, size_t len, uint32_t key) {
+    __m256i k = _mm256_set1_epi32((int)key);
+    size_t n = 0;
+    for(; n + 64 <= len; n += 64) { // Two vectors per turn keep both ports busy
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + n));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + n + 32));
+        _mm256_storeu_si256((__m256i *)(p + n), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *)(p + n + 32), _mm256_xor_si256(b, k));
+    }
+    if(n + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + n));
+        _mm256_storeu_si256((__m256i *)(p + n), _mm256_xor_si256(a, k));
+        n += 32;
+    }
+    return n + mask_word(p + n, len - n, key);
+}
+#endif
+
+#ifdef XY_MASK_NEON
+static size_t mask_neon(unsigned char *p, size_t len, uint32_t key) {
+    uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(key));
+    size_t n = 0;
+    for(; n + 16 <= len; n += 16)
+        vst1q_u8(p + n, veorq_u8(vld1q_u8(p + n), k));
+    return n + mask_word(p + n, len - n, key);
+}
+#endif
+
+static mask_kernel select_mask_kernel() {
+#ifdef XY_MASK_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return mask_avx2;
+    if(__builtin_cpu_supports("sse2"))
+        return mask_sse2;
+#elif defined(XY_MASK_NEON)
+    return mask_neon;
+#endif
+    return mask_word;
+}
+
+static const mask_kernel mask_payload = select_mask_kernel();
+
+void websocket_frame::apply_mask(char *buf, size_t len, const char *key, size_t pos) {
+    auto p = (unsigned char *)buf;
+    auto k = (const unsigned char *)key;
+    // Bytewise up to an aligned address, short buffers entirely
+    size_t head = len < 32 ? len : (size_t)(-(uintptr_t)p & 31);
+    for(size_t i = 0; i < head; i++)
+        p[i] ^= k[(pos + i) & 3];
+    p += head, len -= head, pos += head;
+    if(len == 0)
+        return;
+    // The key as it lines up from here on
+    unsigned char rotated[4] = { k[pos & 3], k[(pos + 1) & 3], k[(pos + 2) & 3], k[(pos + 3) & 3] };
+    uint32_t k32;
+    memcpy(&k32, rotated, 4);
+    size_t n = mask_payload(p, len, k32);
+    for(; n < len; n++)
+        p[n] ^= rotated[n & 3];
+}
@@ -10,6 +10,7 @@
 using namespace std;
 
 shared_ptr<http_server> server;
+shared_ptr<async_log> accessLog;
 
 class signal_watcher {
 public:
@@ -29,6 +30,19 @@ private:
             case SIGTERM:
                 uv_stop(uv_default_loop());
                 break;
+#ifdef SIGHUP
+            case SIGHUP: { // Pick up renewed certificates and rotated logs
+                if(accessLog) accessLog->reopen();
+                auto tlsServer = dynamic_pointer_cast<https_server>(server);
+                try {
+                    if(tlsServer) tlsServer->ctx()->reload_certificates();
+                }
+                catch(runtime_error &ex) {
+                    cerr << "Failed to reload certificates: " << ex.what() << endl;
+                }
+                break;
+            }
+#endif
         }
     }
     uv_signal_t sig;
@@ -45,19 +59,33 @@ string pwd() {
 
 void print_usage(const char *progname) {
     printf("\n"
-           "Usage: %s [-Dh] [-r htdocs] [-b 0.0.0.0:8080] [-d index.php]\n"
-           "       [-f FcgiProvider] [-p 127.0.0.1:90]\n\n", progname);
+           "Usage: %s [-Dh] [-r htdocs] [-b 0.0.0.0:8080] [-d index.php] [-o ocsp.der]\n"
+           "       [-f FcgiProvider] [-w 1:4] [-p 127.0.0.1:90] [-c 1] [-l access.log] [-L format]\n\n", progname);
     puts("   -h\tShow this help information");
     puts("   -r\tSet path to document root directory. If not set, current working ");
     puts("     \tdirectory is used for convenience file sharing.");
     puts("   -b\tSet bind address and port");
     puts("   -s\tEnable TLS and use provided X509 certificate chain : PEM key pair");
+    puts("     \tGive it twice to serve both an ECDSA and an RSA certificate.");
+    puts("     \tCertificates are read again on SIGHUP.");
+    puts("   -o\tStaple the OCSP response in this DER file, or in <serial>.der of");
+    puts("     \tthis directory. The response is reloaded every hour.");
     puts("   -d\tAdd default document search name.");
     puts("   -f\tAdd dynamic page suffix and its FastCGI handler.");
     puts("     \tTCP IP:port pair or UNIX domain socket path is accepted.");
+    puts("     \tA handler starting with ! is a worker command (e.g. php=!php-cgi),");
+    puts("     \twhose processes are spawned and supervised by tinyhttpd.");
+    puts("   -w\tSet minimum and maximum count of spawned FastCGI workers.");
     puts("   -p\tAdd proxy pass backend service. If multiple services are specified,");
     puts("     \tthey will be used in a round-robin machanism for load balancing.");
-    puts("   -l\tSpecify HTTP access log file name.");
+    puts("     \tA backend given with h2c:// (e.g. h2c://127.0.0.1:90) is spoken to");
+    puts("     \tin HTTP/2, over one multiplexed connection.");
+    puts("   -c\tCache dynamic responses in memory for the specified seconds, even if");
+    puts("     \tbackends do not send Cache-Control. Concurrent misses are collapsed.");
+    puts("   -l\tSpecify HTTP access log file name. It is written in the background");
+    puts("     \tand reopened on SIGHUP.");
+    puts("   -L\tLog requests as they complete, in this format (e.g. \"$status $bytes");
+    puts("     \t$service_time $uri\"), or \"binary\" for records xylogdump prints.");
     puts("   -D\tBecome a background daemon process.");
     puts("");
 }
@@ -181,8 +209,13 @@ int main(int argc, char *argv[])
     int opt;
     shared_ptr<tls_context> ctx;
     bool daemonize = false;
-    unique_ptr<ostream> logStream;
-    while ((opt = getopt(argc, argv, "r:b:f:d:p:t:s:l:Dh")) != -1) {
+    int cacheTtl = 0;
+    int minWorkers = 1, maxWorkers = 4;
+    const char *ocspPath = nullptr;
+    vector<pair<string, string>> managedHandlers;
+    string logPath;
+    const char *logFormat = nullptr;
+    while ((opt = getopt(argc, argv, "r:b:f:d:p:t:s:o:l:L:c:w:Dh")) != -1) {
         switch(opt) {
             case 'r':
                 fileService->set_document_root(optarg);
@@ -200,18 +233,24 @@ int main(int argc, char *argv[])
                 }
                 break;
             case 's':
-                if(ctx) {
-                    printf("Duplicate -s.\n");
-                    return EXIT_FAILURE;
-                }
                 portBase = strchr(optarg, ':');
                 if(!portBase) {
                     printf("TLS private key not specified.\n");
                     return EXIT_FAILURE;
                 }
-                ctx = make_shared<tls_context>();
                 *portBase = 0;
+                if(ctx) { // Another key type, e.g. RSA next to ECDSA
+                    ctx->use_certificate(optarg, portBase + 1);
+                    break;
+                }
+                ctx = make_shared<tls_context>();
                 ctx->use_certificate(optarg, portBase + 1);
+                ctx->set_session_tickets(make_shared<tls_ticket_keys>());
+                ctx->set_handshake_offload(true);
+                ctx->set_ktls(true);
+                break;
+            case 'o':
+                ocspPath = optarg;
                 break;
             case 'f': {
                 portBase = strchr(optarg, '=');
@@ -223,7 +262,10 @@ int main(int argc, char *argv[])
                 strcpy(suffix, optarg);
                 strcpy(backend, portBase + 1);
                 portBase = strchr(backend, ':');
-                if(portBase && backend[0] != '/') {
+                if(backend[0] == '!') {
+                    // Spawned after daemonizing so workers stay our children
+                    managedHandlers.emplace_back(suffix, backend + 1);
+                } else if(portBase && backend[0] != '/') {
                     *portBase = 0;
                     fileService->register_fcgi(suffix,
                             make_shared<tcp_fcgi_provider>(backend, atoi(portBase + 1)));
@@ -232,28 +274,47 @@ int main(int argc, char *argv[])
                 }
                 break;
             }
-            case 'p':
-                strcpy(backend, optarg);
+            case 'p': {
+                bool h2c = strncmp(optarg, "h2c://", 6) == 0;
+                strcpy(backend, h2c ? optarg + 6 : optarg);
                 portBase = strchr(backend, ':');
                 if(portBase) {
                     *portBase = 0;
-                    proxyService->append(backend, atoi(portBase + 1));
+                    proxyService->append(backend, atoi(portBase + 1), h2c);
                 } else {
-                    proxyService->append(backend, 80);
+                    proxyService->append(backend, 80, h2c);
                 }
                 break;
+            }
             case 'd':
                 fileService->add_default_name(optarg);
                 break;
+            case 'c':
+                cacheTtl = atoi(optarg);
+                if(cacheTtl <= 0) {
+                    printf("Invalid cache TTL - %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                minWorkers = atoi(optarg);
+                portBase = strchr(optarg, ':');
+                maxWorkers = portBase ? atoi(portBase + 1) : minWorkers;
+                if(minWorkers < 0 || maxWorkers < 1 || maxWorkers < minWorkers) {
+                    printf("Invalid worker count - %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'l':
-                logStream.reset(new ofstream(optarg, ios_base::app | ios_base::out));
+                logPath = optarg;
+                break;
+            case 'L':
+                logFormat = optarg;
                 break;
             case 'D':
                 daemonize = true;
-                if(!logStream) {
-                    string logFile = fmt("/tmp/tinyhttpd-%d-access.log", getpid());
-                    logStream.reset(new ofstream(logFile, ios_base::out));
-                }
+                if(logPath.empty())
+                    logPath = fmt("/tmp/tinyhttpd-%d-access.log", getpid());
                 break;
             default:
             case 'h':
@@ -261,18 +322,78 @@ int main(int argc, char *argv[])
                 return EXIT_FAILURE;
         }
     }
+    if(logFormat) {
+        if(logPath.empty()) {
+            printf("Completion logging requires -l.\n");
+            return EXIT_FAILURE;
+        }
+        try {
+            access_log_format check(logFormat);
+        }
+        catch(runtime_error &ex) {
+            printf("Invalid log format: %s\n", ex.what());
+            return EXIT_FAILURE;
+        }
+    }
+    if(ocspPath) {
+        if(!ctx) {
+            printf("OCSP stapling requires -s.\n");
+            return EXIT_FAILURE;
+        }
+        try {
+            ctx->set_ocsp_staple(ocspPath);
+        }
+        catch(runtime_error &ex) {
+            printf("Failed to staple OCSP response: %s\n", ex.what());
+            return EXIT_FAILURE;
+        }
+    }
 #ifndef _WIN32
     if(daemonize) become_daemon();
     signal(SIGPIPE, SIG_IGN);
 #endif
+    if(!logPath.empty()) {
+        try { // After forking, the writer thread would not survive it
+            accessLog = make_shared<async_log>(logPath);
+        }
+        catch(runtime_error &ex) {
+            printf("Failed to open access log: %s\n", ex.what());
+            return EXIT_FAILURE;
+        }
+    }
     register_mimetypes(fileService);
+    for(auto &handler : managedHandlers) {
+        try {
+            fileService->register_fcgi(handler.first, make_shared<managed_fcgi_provider>(
+                    handler.second, minWorkers, maxWorkers));
+        }
+        catch(runtime_error &ex) {
+            printf("Failed to start FastCGI workers: %s\n", ex.what());
+            return EXIT_FAILURE;
+        }
+    }
     try {
         auto svcChain = make_shared<http_service_chain>();
         if(ctx) svcChain->append<tls_filter_service>(302);
-        svcChain->append<logger_service>(logStream ? logStream.get() : &cout);
-        svcChain->append(fileService);
-        if(proxyService->count() > 0) svcChain->append(proxyService);
+        if(logFormat)
+            svcChain->append<access_log_service>(accessLog, logFormat);
+        else if(accessLog)
+            svcChain->append<logger_service>(accessLog);
+        else
+            svcChain->append<logger_service>(&cout);
+        auto backends = make_shared<http_service_chain>();
+        backends->append(fileService);
+        if(proxyService->count() > 0) backends->append(proxyService);
+        if(cacheTtl > 0) {
+            auto cache = make_shared<cache_service>(backends);
+            cache->set_forced_ttl(cacheTtl * 1000);
+            cache->set_stale_ttl(cacheTtl * 1000);
+            svcChain->append(cache);
+        } else {
+            svcChain->append(backends);
+        }
         server = ctx ? make_shared<https_server>(ctx, svcChain) : make_shared<http_server>(svcChain);
+        server->set_http2(true);
         server->listen(bindAddr, port);
         if(!daemonize) printf("Service running at %s:%d.\n", bindAddr, port);
     }
@@ -281,6 +402,9 @@ int main(int argc, char *argv[])
     }
     signal_watcher watchint(SIGINT);
     signal_watcher watchterm(SIGTERM);
+#ifdef SIGHUP
+    signal_watcher watchhup(SIGHUP);
+#endif
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
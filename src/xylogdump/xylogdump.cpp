@@ -0,0 +1,94 @@
+#include "xyhttpsvc.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+void print_usage(const char *progname) {
+    printf("\n"
+           "Usage: %s [-h] [-f format] [access.log ...]\n\n", progname);
+    puts("   -h\tShow this help information");
+    puts("   -f\tPrint records in this text format, e.g. \"$time $status $uri\".");
+    puts("     \tDefaults to the text format of access_log_service.");
+    puts("");
+    puts("Binary access logs are read from the files given, or standard input.");
+    puts("");
+}
+
+/**
+ * Print every record of a binary access log as text.
+ * @return Whether the log was read to the end without errors
+ */
+static bool dump(FILE *in, access_log_format &text) {
+    vector<char> buf(0x10000 * 2);
+    size_t avail = 0;
+    char line[0x10000];
+    while(true) {
+        size_t n = fread(buf.data() + avail, 1, buf.size() - avail, in);
+        avail += n;
+        size_t pos = 0;
+        try {
+            access_record rec;
+            while(size_t used = access_log_format::read(buf.data() + pos, avail - pos, rec)) {
+                fwrite(line, 1, text.write(rec, line, sizeof(line)), stdout);
+                pos += used;
+            }
+        }
+        catch(runtime_error &ex) {
+            fprintf(stderr, "%s\n", ex.what());
+            return false;
+        }
+        memmove(buf.data(), buf.data() + pos, avail - pos);
+        avail -= pos;
+        if(n == 0) {
+            if(avail > 0)
+                fprintf(stderr, "Log ends within a record.\n");
+            return avail == 0 && !ferror(in);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    string format = access_log_format::DEFAULT;
+    int opt;
+    while((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch(opt) {
+            case 'f':
+                format = optarg;
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    unique_ptr<access_log_format> text;
+    try {
+        text.reset(new access_log_format(format));
+    }
+    catch(runtime_error &ex) {
+        printf("Invalid format: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+    if(text->binary()) {
+        printf("Records can only be printed in a text format.\n");
+        return EXIT_FAILURE;
+    }
+    if(optind == argc)
+        return dump(stdin, *text) ? EXIT_SUCCESS : EXIT_FAILURE;
+    bool ok = true;
+    for(int i = optind; i < argc; i++) {
+        FILE *in = fopen(argv[i], "rb");
+        if(!in) {
+            perror(argv[i]);
+            ok = false;
+            continue;
+        }
+        ok = dump(in, *text) && ok;
+        fclose(in);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,56 @@
+#include <xyhttp.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Throughput of WebSocket payload masking against the bytewise loop it
+ * replaced. Usage: bench-wsmask [payload bytes]
+ */
+
+static void mask_bytewise(char *buf, size_t len, const char *key) {
+    for(size_t i = 0; i < len; i++)
+        buf[i] ^= key[i % 4];
+}
+
+template<typename F>
+static double measure(const char *name, vector<char> &buf, size_t offset, F func) {
+    auto start = chrono::steady_clock::now();
+    size_t total = 0;
+    double elapsed;
+    do {
+        for(int i = 0; i < 64; i++) {
+            func(buf.data() + offset, buf.size() - offset);
+            total += buf.size() - offset;
+        }
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while(elapsed < 0.5);
+    double mbps = total / elapsed / 1048576;
+    printf("%-24s %10.1f MB/s\n", name, mbps);
+    return mbps;
+}
+
+int main(int argc, char *argv[]) {
+    size_t len = argc > 1 ? strtoul(argv[1], nullptr, 10) : 131072;
+    const char key[4] = { '\x37', '\xfa', '\x21', '\x3d' };
+    vector<char> buf(len + 1);
+    for(size_t i = 0; i < buf.size(); i++)
+        buf[i] = (char)i;
+    printf("payload %zu bytes\n", len);
+    for(size_t offset = 0; offset < 2; offset++) {
+        char label[64];
+        snprintf(label, sizeof(label), "bytewise%s", offset ? " (unaligned)" : "");
+        double base = measure(label, buf, offset, [&key] (char *p, size_t n) {
+            mask_bytewise(p, n, key);
+        });
+        snprintf(label, sizeof(label), "apply_mask%s", offset ? " (unaligned)" : "");
+        double fast = measure(label, buf, offset, [&key] (char *p, size_t n) {
+            websocket_frame::apply_mask(p, n, key);
+        });
+        printf("%-24s %10.1fx\n", "speedup", fast / base);
+    }
+    return 0;
+}
@@ -1,5 +1,16 @@
 #include <xystream.h>
 #include <xyhttpsvc.h>
+#include <xyhttptls.h>
+#include <xyhttp2.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/ocsp.h>
+#include <openssl/sha.h>
+#include <sys/stat.h>
+#include <map>
+#include <fstream>
+#include <thread>
+#include <zlib.h>
 #include <gtest/gtest.h>
 
 using namespace std;
@@ -10,6 +21,66 @@ static void handle_walker(uv_handle_t* handle, void* arg) {
     *(int *)arg += 1;
 }
 
+// Write a throwaway self-signed P-256 (or RSA) certificate
+static void make_test_certificate(const char *certFile, const char *keyFile,
+                                  const char *cn = "localhost", bool rsa = false) {
+    EVP_PKEY *pkey = nullptr;
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(rsa ? EVP_PKEY_RSA : EVP_PKEY_EC, nullptr);
+    EVP_PKEY_keygen_init(pctx);
+    if(rsa)
+        EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048);
+    else
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(pctx, &pkey);
+    EVP_PKEY_CTX_free(pctx);
+    X509 *x509 = X509_new();
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 86400);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)cn, -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    X509_sign(x509, pkey, EVP_sha256());
+    FILE *fp = fopen(certFile, "w");
+    PEM_write_X509(fp, x509);
+    fclose(fp);
+    fp = fopen(keyFile, "w");
+    PEM_write_PrivateKey(fp, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+    fclose(fp);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+}
+
+// Sign an OCSP response telling the self-signed certificate is good
+static string make_test_ocsp_response(const char *certFile, const char *keyFile, long validSecs) {
+    FILE *fp = fopen(certFile, "r");
+    X509 *x509 = PEM_read_X509(fp, nullptr, nullptr, nullptr);
+    fclose(fp);
+    fp = fopen(keyFile, "r");
+    EVP_PKEY *pkey = PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr);
+    fclose(fp);
+    OCSP_BASICRESP *basic = OCSP_BASICRESP_new();
+    ASN1_TIME *thisUpd = X509_gmtime_adj(nullptr, 0);
+    ASN1_TIME *nextUpd = X509_gmtime_adj(nullptr, validSecs);
+    OCSP_basic_add1_status(basic, OCSP_cert_to_id(nullptr, x509, x509), V_OCSP_CERTSTATUS_GOOD,
+                           0, nullptr, thisUpd, nextUpd);
+    OCSP_basic_sign(basic, x509, pkey, EVP_sha256(), nullptr, 0);
+    OCSP_RESPONSE *resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic);
+    unsigned char *der = nullptr;
+    int len = i2d_OCSP_RESPONSE(resp, &der);
+    string result((char *)der, len);
+    OPENSSL_free(der);
+    OCSP_RESPONSE_free(resp);
+    OCSP_BASICRESP_free(basic);
+    ASN1_TIME_free(thisUpd);
+    ASN1_TIME_free(nextUpd);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return result;
+}
+
 TEST(IO, FiberMultilevel) {
     bool checkpoints[10];
     shared_ptr<fiber> f1, f2, f3;
@@ -264,6 +335,50 @@ TEST(IO, TcpConnectFail) {
     ASSERT_TRUE(checkpoint_finished);
 }
 
+static void put_h2_frame(string &out, int type, int flags, uint32_t id, const string &payload) {
+    http2_frame frame(type, flags, id, payload);
+    size_t base = out.size();
+    out.resize(base + frame.serialize_size());
+    frame.serialize(&out[base]);
+}
+
+static void put_h2_request(string &out, hpack_encoder &enc, uint32_t id,
+                           const char *method, const char *path, bool endStream) {
+    string block;
+    enc.encode(":method", method, block);
+    enc.encode(":scheme", "http", block);
+    enc.encode(":path", path, block);
+    enc.encode(":authority", "localhost", block);
+    put_h2_frame(out, http2_frame::HEADERS,
+                 http2_frame::END_HEADERS | (endStream ? http2_frame::END_STREAM : 0), id, block);
+}
+
+// Read HTTP/2 responses until count streams have ended: ID => status, body
+static map<uint32_t, pair<string, string>> read_h2_responses(const P<stream> &client, size_t count) {
+    map<uint32_t, pair<string, string>> responses;
+    hpack_decoder dec;
+    auto frame_decoder = make_shared<http2_frame::decoder>();
+    size_t ended = 0;
+    while(ended < count) {
+        auto frame = client->read<http2_frame>(frame_decoder);
+        auto &resp = responses[frame->stream_id()];
+        if(frame->type() == http2_frame::HEADERS) {
+            http2_header_list headers;
+            dec.decode(frame->payload().data(), frame->payload().size(), headers);
+            resp.first = headers.at(0).second;
+        } else if(frame->type() == http2_frame::DATA) {
+            resp.second.append(frame->payload().data(), frame->payload().size());
+        } else if(frame->type() == http2_frame::RST_STREAM || frame->type() == http2_frame::GOAWAY) {
+            throw runtime_error("HTTP/2 stream or connection reset");
+        } else {
+            continue;
+        }
+        if(frame->flags() & http2_frame::END_STREAM)
+            ended++;
+    }
+    return responses;
+}
+
 TEST(IO, HttpServer) {
     bool checkpoint_forward = false;
     auto chain = make_shared<http_service_chain>();
@@ -385,6 +500,30 @@ TEST(IO, HttpServer) {
     ASSERT_EQ(handle_count, 1); // Should be the tcp server
 }
 
+TEST(IO, HttpHead) {
+    http_server server(make_shared<lambda_service>([] (http_trx &tx) {
+        tx->get_response()->set_header("X-Handler", "hello");
+        tx->write("Hello world");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        auto client = make_shared<tcp_stream>();
+        client->connect("127.0.0.1", TEST_BIND_PORT);
+        client->write("HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        auto resp = client->read<http_response>(make_shared<http_response::decoder>());
+        ASSERT_EQ(resp->code(), 200);
+        ASSERT_TRUE(resp->header("X-Handler") == "hello");
+        checkpoint_finished = true;
+        uv_stop(uv_default_loop());
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
 TEST(IO, HttpClient) {
     auto chain = make_shared<http_service_chain>();
     http_server server(chain);
@@ -454,8 +593,237 @@ TEST(IO, HttpClient) {
     ASSERT_EQ(handle_count, 1); // Should be the tcp server
 }
 
+TEST(IO, Router) {
+    auto router = make_shared<router_service>();
+    http_server server(router);
+    auto reply = [] (function<string(http_trx &)> body) {
+        return make_shared<lambda_service>([body] (http_trx &tx) {
+            tx->write(body(tx));
+            tx->finish();
+        });
+    };
+    router->add("GET", "/", reply([] (http_trx &) { return string("root"); }));
+    router->add("GET", "/users", reply([] (http_trx &) { return string("users"); }));
+    router->add("GET", "/users/:id", reply([] (http_trx &tx) { return "user " + tx->params["id"]; }));
+    router->add("POST", "/users/:id", reply([] (http_trx &tx) { return "post " + tx->params["id"]; }));
+    router->add("GET", "/users/me", reply([] (http_trx &) { return string("me"); }));
+    router->add("GET", "/users/:id/posts/:post", reply([] (http_trx &tx) {
+        return tx->params["id"] + "/" + tx->params["post"];
+    }));
+    router->add("/static/*file", reply([] (http_trx &tx) { return "file " + tx->params["file"]; }));
+    router->mount("/api/", reply([] (http_trx &tx) { return "api " + tx->params["*"]; }));
+    router->set_default(reply([] (http_trx &) { return string("default"); }));
+    ASSERT_ANY_THROW(router->add("GET", "/users/:uid/friends", reply(nullptr)));
+    ASSERT_ANY_THROW(router->add("GET", "/users/:id", reply(nullptr)));
+    ASSERT_ANY_THROW(router->add("GET", "/files/*rest/more", reply(nullptr)));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        auto client_stream = make_shared<tcp_stream>();
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+        auto client = make_shared<http_client>(client_stream);
+        auto fetch = [&client] (const string &method, const string &path) {
+            auto req = make_shared<http_request>();
+            req->method = method;
+            req->set_header("Connection", "keep-alive");
+            req->set_header("Host", "localhost");
+            req->set_resource(path);
+            auto resp = client->send(req);
+            string body;
+            while(client->data_available())
+                body += client->read().to_string();
+            return to_string(resp->code()) + " " + body;
+        };
+        ASSERT_EQ(fetch("GET", "/"), "200 root");
+        ASSERT_EQ(fetch("GET", "/users"), "200 users");
+        ASSERT_EQ(fetch("GET", "/users/42"), "200 user 42");
+        ASSERT_EQ(fetch("POST", "/users/42"), "200 post 42");
+        ASSERT_EQ(fetch("GET", "/users/me"), "200 me");
+        ASSERT_EQ(fetch("GET", "/users/mel"), "200 user mel");
+        ASSERT_EQ(fetch("GET", "/users/me/posts/7"), "200 me/7"); // Back off to the capture
+        ASSERT_EQ(fetch("GET", "/users/"), "200 default");
+        ASSERT_EQ(fetch("PUT", "/static/css/site.css"), "200 file css/site.css");
+        ASSERT_EQ(fetch("GET", "/api"), "200 api ");
+        ASSERT_EQ(fetch("GET", "/api/v1/things"), "200 api v1/things");
+        ASSERT_EQ(fetch("GET", "/apis"), "200 default");
+        ASSERT_EQ(fetch("DELETE", "/users/42").substr(0, 4), "405 ");
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, HostDispatch) {
+    auto svc = [] () { return make_shared<lambda_service>([] (http_trx &) {}); };
+    auto first = svc(), exact = svc(), wildcard = svc(), deeper = svc(), ipv6 = svc();
+    host_dispatch_service dispatch;
+    auto find = [&dispatch] (const string &host) { return dispatch.find(host.data(), host.size()); };
+    ASSERT_EQ(find("example.com"), nullptr);
+    dispatch.register_host("first.test", first);
+    dispatch.register_host("www.Example.com", exact);
+    dispatch.register_host("*.example.com", wildcard);
+    dispatch.register_host("*.api.example.com", deeper);
+    dispatch.register_host("[::1]", ipv6);
+    ASSERT_ANY_THROW(dispatch.register_host("*.", svc()));
+    // The first host registered is the default
+    ASSERT_EQ(find("first.test"), first);
+    ASSERT_EQ(find("unknown.test"), first);
+    ASSERT_EQ(find("example.com"), first);
+    ASSERT_EQ(find("www.example.com"), exact);
+    ASSERT_EQ(find("WWW.EXAMPLE.COM:8080"), exact);
+    ASSERT_EQ(find("www.example.com."), exact);
+    ASSERT_EQ(find("img.example.com"), wildcard);
+    ASSERT_EQ(find("a.b.example.com"), wildcard);
+    ASSERT_EQ(find("api.example.com"), wildcard);
+    ASSERT_EQ(find("v1.api.example.com"), deeper);
+    ASSERT_EQ(find("x.www.example.com"), wildcard);
+    ASSERT_EQ(find("[::1]:8080"), ipv6);
+    ASSERT_EQ(find("[::2]"), first);
+    ASSERT_EQ(host_dispatch_service::normalize_hostname("Foo.Example.com.:80"), "foo.example.com");
+
+    auto other = svc();
+    dispatch.set_default(other);
+    dispatch.unregister_host("*.example.com");
+    ASSERT_EQ(find("img.example.com"), other);
+    ASSERT_EQ(find("www.example.com"), exact);
+    dispatch.unregister_host("www.example.com");
+    ASSERT_EQ(find("www.example.com"), other);
+    // Nodes left empty go, what is still registered stays found
+    dispatch.unregister_host("never.registered.example.com");
+    dispatch.unregister_host("*.nowhere.test");
+    ASSERT_EQ(find("v1.api.example.com"), deeper);
+    dispatch.unregister_host("*.api.example.com");
+    ASSERT_EQ(find("v1.api.example.com"), other);
+    ASSERT_EQ(find("first.test"), first);
+    ASSERT_EQ(find("[::1]"), ipv6);
+    dispatch.register_host("www.example.com", exact);
+    ASSERT_EQ(find("www.example.com"), exact);
+    ASSERT_EQ(find("img.example.com"), other);
+}
+
+TEST(IO, AsyncLog) {
+    string path = fmt("/tmp/xyhttpd-test-%d.log", getpid());
+    string rotated = path + ".1";
+    unlink(path.c_str());
+    unlink(rotated.c_str());
+    auto readAll = [] (const string &name) {
+        ifstream in(name);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    };
+    auto log = make_shared<async_log>(path, 10, 4096);
+    string record(3000, 'a');
+    record.back() = '\n';
+    ASSERT_TRUE(log->append(record.data(), record.size()));
+    ASSERT_FALSE(log->append(record.data(), record.size())); // No room left
+    ASSERT_EQ(log->dropped(), 1);
+    for(int i = 0; i < 100 && log->written() < record.size(); i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    ASSERT_EQ(log->written(), record.size());
+    ASSERT_EQ(readAll(path), record);
+    // Room again once written, the ring wraps around
+    ASSERT_TRUE(log->append(record.data(), record.size()));
+    for(int i = 0; i < 100 && log->written() < 2 * record.size(); i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    ASSERT_EQ(rename(path.c_str(), rotated.c_str()), 0);
+    log->reopen();
+    struct stat st;
+    for(int i = 0; i < 100 && stat(path.c_str(), &st) < 0; i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    ASSERT_TRUE(log->append("rotated\n", 8));
+    log.reset(); // Drains what is left
+    ASSERT_EQ(readAll(rotated), record + record);
+    ASSERT_EQ(readAll(path), "rotated\n");
+    unlink(path.c_str());
+    unlink(rotated.c_str());
+}
+
+TEST(IO, AccessLog) {
+    string path = fmt("/tmp/xyhttpd-test-%d.log", getpid());
+    unlink(path.c_str());
+    auto log = make_shared<async_log>(path);
+    vector<http_transaction_stats> seen;
+    { // The services hold the log while the server is around
+        auto chain = make_shared<http_service_chain>();
+        chain->append<access_log_service>(log, "$status $bytes $method $host$uri $scheme");
+        chain->append<access_log_service>(log, "binary");
+        chain->append<lambda_service>([&seen] (http_trx &tx) {
+            tx->on_complete([&seen] (http_transaction &, const http_transaction_stats &stats) {
+                seen.push_back(stats);
+            });
+            if(tx->request->path() == "/missing") {
+                tx->display_error(404);
+                return;
+            }
+            tx->write("hello");
+            tx->finish();
+        });
+        http_server server(chain);
+        server.listen("127.0.0.1", TEST_BIND_PORT);
+
+        bool checkpoint_finished = false;
+        fiber::launch([&checkpoint_finished] () {
+            auto client_stream = make_shared<tcp_stream>();
+            client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+            auto client = make_shared<http_client>(client_stream);
+            for(auto path : { "/hello?x=1", "/missing" }) {
+                auto req = make_shared<http_request>();
+                req->method = "GET";
+                req->set_header("Connection", "keep-alive");
+                req->set_header("Host", "localhost");
+                req->set_resource(path);
+                client->send(req);
+                while(client->data_available())
+                    client->read();
+            }
+            uv_stop(uv_default_loop());
+            checkpoint_finished = true;
+        });
+        uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+        ASSERT_TRUE(checkpoint_finished);
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    }
+
+    ASSERT_EQ(seen.size(), 2);
+    ASSERT_EQ(seen[0].status, 200);
+    ASSERT_EQ(seen[0].bytes, 5);
+    ASSERT_EQ(seen[0].upstream_time, 0);
+    ASSERT_FALSE(seen[0].tls);
+    ASSERT_EQ(seen[1].status, 404);
+    ASSERT_GT(seen[1].bytes, 0);
+    log.reset();
+    ifstream in(path, ios::binary);
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    unlink(path.c_str());
+    // Text and binary records of each request, in turn
+    access_log_format text("$status $bytes $method $host$uri $scheme");
+    vector<string> lines;
+    const char *p = data.data(), *end = p + data.size();
+    while(p < end) {
+        auto eol = (const char *)memchr(p, '\n', end - p);
+        ASSERT_NE(eol, nullptr);
+        lines.emplace_back(p, eol + 1);
+        access_record rec;
+        size_t used = access_log_format::read(eol + 1, end - eol - 1, rec);
+        ASSERT_GT(used, 0);
+        ASSERT_EQ(rec.peer_len, 9);
+        char buf[256];
+        lines.emplace_back(buf, text.write(rec, buf, sizeof(buf)));
+        p = eol + 1 + used;
+    }
+    ASSERT_EQ(lines.size(), 4);
+    ASSERT_EQ(lines[0], "200 5 GET localhost/hello?x=1 http\n");
+    ASSERT_EQ(lines[1], lines[0]);
+    ASSERT_EQ(lines[2].substr(0, 4), "404 ");
+    ASSERT_EQ(lines[3], lines[2]);
+    ASSERT_ANY_THROW(access_log_format("$status $nonsense"));
+}
+
 TEST(IO, WebSocket) {
-    bool checkpoint_received = false, checkpoint_closed = false;
+    bool checkpoint_received = false, checkpoint_closed = false, checkpoint_finished = false;
     http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
         if(tx->request->path() != "/connect") {
             tx->display_error(404);
@@ -470,11 +838,12 @@ TEST(IO, WebSocket) {
             ws->send(msg);
         }
         checkpoint_closed = true;
+        if(checkpoint_finished) // Leave nothing running on our stack
+            uv_stop(uv_default_loop());
     }));
     server.listen("127.0.0.1", TEST_BIND_PORT);
 
-    bool checkpoint_finished = false;
-    fiber::launch([&checkpoint_finished] () {
+    fiber::launch([&checkpoint_finished, &checkpoint_closed] () {
         auto client = make_shared<tcp_stream>();
         client->connect("127.0.0.1", TEST_BIND_PORT);
         auto req = make_shared<http_request>();
@@ -499,8 +868,9 @@ TEST(IO, WebSocket) {
         ASSERT_EQ(echo->opcode(), 10); // PING will be respond by PONG
         client->write(make_shared<websocket_frame>(8, nullptr));
 
-        uv_stop(uv_default_loop());
         checkpoint_finished = true;
+        if(checkpoint_closed)
+            uv_stop(uv_default_loop());
     });
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
     ASSERT_TRUE(checkpoint_received);
@@ -513,4 +883,1930 @@ TEST(IO, WebSocket) {
     int handle_count = 0;
     uv_walk(uv_default_loop(), handle_walker, &handle_count);
     ASSERT_EQ(handle_count, 1); // Should be the tcp server
-}
\ No newline at end of file
+}
+
+TEST(IO, HttpCache) {
+    int origin_hits = 0;
+    auto chain = make_shared<http_service_chain>();
+    http_server server(chain);
+    chain->route<lambda_service>("/origin", [&origin_hits] (http_trx &tx) {
+        origin_hits++;
+        tx->get_response()->set_header("Cache-Control", "public, max-age=60");
+        tx->write("Cached content");
+        tx->finish();
+    });
+    chain->route<cache_service>("/page", make_shared<lambda_service>([] (http_trx &tx) {
+        tx->request->set_resource("/origin");
+        tx->forward_to("127.0.0.1", TEST_BIND_PORT);
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    // Concurrent misses are collapsed into one upstream fetch
+    int clients_finished = 0;
+    for(int i = 0; i < 3; i++) {
+        fiber::launch([&clients_finished] () {
+            [] () {
+                auto client_stream = make_shared<tcp_stream>();
+                client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+                auto client = make_shared<http_client>(client_stream);
+                auto req = make_shared<http_request>();
+                req->method = "GET";
+                req->set_header("Connection", "keep-alive");
+                req->set_header("Host", "localhost");
+                req->set_resource("/page");
+                for(int j = 0; j < 2; j++) {
+                    stream_buffer sb_content;
+                    auto resp = client->send(req);
+                    ASSERT_EQ(resp->code(), 200);
+                    while(client->data_available()) {
+                        chunk data = client->read();
+                        sb_content.append(data.data(), data.size());
+                    }
+                    ASSERT_EQ(sb_content.size(), 14);
+                    ASSERT_EQ(memcmp(sb_content.data(), "Cached content", 14), 0);
+                }
+                auto resp = client->send(req);
+                ASSERT_TRUE(resp->header("X-Cache") == "HIT");
+                while(client->data_available()) client->read();
+            }();
+            // Stop even if assertions failed, nothing may be left running
+            if(++clients_finished == 3)
+                uv_stop(uv_default_loop());
+        });
+    }
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(clients_finished, 3);
+    ASSERT_EQ(origin_hits, 1);
+    // Give fibers a chance to finish
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+// Suspend the running fiber for a while
+static void sleep_fiber(int ms) {
+    uv_timer_t *timer = new uv_timer_t;
+    P<fiber> self = fiber::current();
+    uv_timer_init(uv_default_loop(), timer);
+    timer->data = &self;
+    uv_timer_start(timer, [] (uv_timer_t *t) { (*(P<fiber> *)t->data)->resume(0); }, ms, 0);
+    fiber::yield();
+    uv_close((uv_handle_t *)timer, [] (uv_handle_t *h) { delete (uv_timer_t *)h; });
+}
+
+/*
+ * Cache tests share this: an origin at /origin, counted in hits, served
+ * through the cache at /page. The client fiber always stops the loop.
+ */
+class http_cache_test {
+public:
+    int hits, in_flight, max_in_flight;
+    P<cache_service> cache;
+
+    explicit http_cache_test(const function<void(http_trx &, int)> &origin)
+            : hits(0), in_flight(0), max_in_flight(0), _chain(make_shared<http_service_chain>()),
+              _server(_chain) {
+        _chain->route<lambda_service>("/origin", [this, origin] (http_trx &tx) {
+            in_flight++;
+            max_in_flight = max(max_in_flight, in_flight);
+            origin(tx, ++hits);
+            in_flight--;
+        });
+        cache = make_shared<cache_service>(make_shared<lambda_service>([] (http_trx &tx) {
+            tx->request->set_resource("/origin");
+            tx->forward_to("127.0.0.1", TEST_BIND_PORT);
+        }));
+        _chain->append<http_service_chain::match_router>("/page", cache);
+        _server.listen("127.0.0.1", TEST_BIND_PORT);
+    }
+
+    // "X-Cache body" of GET /page
+    static string fetch(const char *lang = nullptr) {
+        auto client_stream = make_shared<tcp_stream>();
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+        http_client client(client_stream);
+        auto req = make_shared<http_request>();
+        req->method = "GET";
+        req->set_header("Host", "localhost");
+        if(lang) req->set_header("Accept-Language", lang);
+        req->set_resource("/page");
+        auto resp = client.send(req);
+        chunk state = resp->header("X-Cache");
+        string result = state ? state.to_string() : "MISS";
+        result += ' ';
+        while(client.data_available())
+            result += client.read().to_string();
+        return result;
+    }
+
+    void run(const function<void()> &scenario) {
+        bool finished = false;
+        fiber::launch([&scenario, &finished] () {
+            scenario();
+            finished = true;
+            uv_stop(uv_default_loop());
+        });
+        if(!finished)
+            uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+        ASSERT_TRUE(finished);
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+    }
+private:
+    P<http_service_chain> _chain;
+    http_server _server;
+};
+
+TEST(IO, HttpCacheStaleWhileRevalidate) {
+    http_cache_test t([] (http_trx &tx, int hit) {
+        tx->write("v" + to_string(hit));
+        tx->finish();
+    });
+    t.cache->set_forced_ttl(50);
+    t.cache->set_stale_ttl(60000);
+    t.run([&t] () {
+        ASSERT_EQ(t.fetch(), "MISS v1");
+        ASSERT_EQ(t.fetch(), "HIT v1");
+        sleep_fiber(100);
+        // Served stale at once, refreshed in the background
+        ASSERT_EQ(t.fetch(), "STALE v1");
+        for(int i = 0; i < 100 && t.hits < 2; i++)
+            sleep_fiber(10);
+        ASSERT_EQ(t.fetch(), "HIT v2");
+    });
+    ASSERT_EQ(t.hits, 2);
+}
+
+TEST(IO, HttpCacheVary) {
+    http_cache_test t([] (http_trx &tx, int) {
+        tx->get_response()->set_header("Cache-Control", "max-age=60");
+        tx->get_response()->set_header("Vary", "Accept-Language");
+        tx->write(tx->request->header("accept-language").to_string());
+        tx->finish();
+    });
+    t.run([&t] () {
+        ASSERT_EQ(t.fetch("en"), "MISS en");
+        ASSERT_EQ(t.fetch("fr"), "MISS fr");
+        ASSERT_EQ(t.fetch("en"), "HIT en");
+        ASSERT_EQ(t.fetch("fr"), "HIT fr");
+    });
+    ASSERT_EQ(t.hits, 2);
+}
+
+TEST(IO, HttpCacheHitForPass) {
+    http_cache_test t([] (http_trx &tx, int) {
+        sleep_fiber(50);
+        tx->get_response()->set_header("Cache-Control", "private");
+        tx->write("private");
+        tx->finish();
+    });
+    t.run([&t] () {
+        ASSERT_EQ(t.fetch(), "MISS private");
+        ASSERT_EQ(t.cache->count(), 1); // The pass marker
+        // Known to be uncacheable, so requests are no longer collapsed
+        int done = 0;
+        P<fiber> self = fiber::current();
+        for(int i = 0; i < 2; i++) {
+            fiber::launch([&done, self] () {
+                EXPECT_EQ(http_cache_test::fetch(), "MISS private");
+                if(++done == 2)
+                    self->resume(0);
+            });
+        }
+        if(done < 2)
+            fiber::yield();
+    });
+    ASSERT_EQ(t.hits, 3);
+    ASSERT_EQ(t.max_in_flight, 2);
+}
+
+TEST(IO, HttpCacheForcedTtl) {
+    http_cache_test t([] (http_trx &tx, int) {
+        tx->get_response()->set_header("Cache-Control", "no-cache");
+        tx->write("forced");
+        tx->finish();
+    });
+    t.cache->set_forced_ttl(60000);
+    t.run([&t] () {
+        ASSERT_EQ(t.fetch(), "MISS forced");
+        ASSERT_EQ(t.fetch(), "HIT forced");
+    });
+    ASSERT_EQ(t.hits, 1);
+}
+
+TEST(IO, FcgiKeepConn) {
+    int accepted = 0;
+    tcp_server fcgi_server("127.0.0.1", TEST_BIND_PORT + 1);
+    fcgi_server.serve([&accepted] (shared_ptr<tcp_stream> strm) {
+        auto dec = make_shared<fcgi_message::decoder>();
+        bool keep_conn = true;
+        accepted++;
+        try {
+            while(keep_conn) {
+                auto msg = strm->read<fcgi_message>(dec);
+                if(msg->msgtype() == fcgi_message::FCGI_BEGIN_REQUEST)
+                    keep_conn = msg->data().data()[2] & fcgi_connection::FCGI_KEEP_CONN;
+                if(msg->msgtype() != fcgi_message::FCGI_STDIN || msg->data().size() > 0)
+                    continue;
+                const char out[] = "Content-Type: text/plain\r\n\r\nFastCGI";
+                const char end[8] = { 0 };
+                strm->write(make_shared<fcgi_message>(
+                        fcgi_message::FCGI_STDOUT, 0, out, sizeof(out) - 1));
+                strm->write(make_shared<fcgi_message>(
+                        fcgi_message::FCGI_END_REQUEST, 0, end, 8));
+            }
+        }
+        catch(runtime_error &ex) {}
+    });
+    auto provider = make_shared<tcp_fcgi_provider>("127.0.0.1", TEST_BIND_PORT + 1);
+    http_server server(make_shared<lambda_service>([provider] (http_trx &tx) {
+        tx->forward_to(provider->get_connection());
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        auto client_stream = make_shared<tcp_stream>();
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+        auto client = make_shared<http_client>(client_stream);
+        auto req = make_shared<http_request>();
+        req->method = "GET";
+        req->set_header("Connection", "keep-alive");
+        req->set_header("Host", "localhost");
+        req->set_resource("/index.php");
+        for(int i = 0; i < 3; i++) {
+            stream_buffer sb_content;
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            while(client->data_available()) {
+                chunk data = client->read();
+                sb_content.append(data.data(), data.size());
+            }
+            ASSERT_EQ(sb_content.size(), 7);
+            ASSERT_EQ(memcmp(sb_content.data(), "FastCGI", 7), 0);
+        }
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    ASSERT_EQ(accepted, 1); // All requests share one pooled connection
+    ASSERT_EQ(provider->pool()->idle_count(), 1);
+    provider->pool()->clear();
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, FcgiPooledConnClosed) {
+    int accepted = 0;
+    tcp_server fcgi_server("127.0.0.1", TEST_BIND_PORT + 1);
+    fcgi_server.serve([&accepted] (shared_ptr<tcp_stream> strm) {
+        auto dec = make_shared<fcgi_message::decoder>();
+        int id = ++accepted, requests = 0;
+        try {
+            while(true) {
+                auto msg = strm->read<fcgi_message>(dec);
+                if(msg->msgtype() != fcgi_message::FCGI_STDIN || msg->data().size() > 0)
+                    continue;
+                // The first connection goes away as its second request arrives,
+                // the second one right after its first response
+                if(id == 1 && ++requests == 2)
+                    return;
+                const char end[8] = { 0 };
+                strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_STDOUT, 1, "FastCGI", 7));
+                strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_END_REQUEST, 1, end, 8));
+                if(id == 2)
+                    return;
+            }
+        }
+        catch(runtime_error &ex) {}
+    });
+    auto provider = make_shared<tcp_fcgi_provider>("127.0.0.1", TEST_BIND_PORT + 1);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        for(int i = 0; i < 3; i++) {
+            auto conn = provider->get_connection();
+            chunk out = conn->read();
+            ASSERT_EQ(string(out.data(), out.size()), "FastCGI");
+            ASSERT_FALSE(conn->read());
+            conn.reset();
+            sleep_fiber(50);
+        }
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    ASSERT_EQ(accepted, 3);
+    provider->pool()->clear();
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, FcgiParams) {
+    string params, input;
+    tcp_server fcgi_server("127.0.0.1", TEST_BIND_PORT + 1);
+    fcgi_server.serve([&] (shared_ptr<tcp_stream> strm) {
+        auto dec = make_shared<fcgi_message::decoder>();
+        try {
+            while(true) {
+                auto msg = strm->read<fcgi_message>(dec);
+                if(msg->msgtype() == fcgi_message::FCGI_PARAMS)
+                    params.append(msg->data().data(), msg->data().size());
+                if(msg->msgtype() != fcgi_message::FCGI_STDIN)
+                    continue;
+                if(msg->data().size() > 0) {
+                    input.append(msg->data().data(), msg->data().size());
+                    continue;
+                }
+                const char end[8] = { 0 };
+                strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_STDOUT, 1, "done", 4));
+                strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_END_REQUEST, 1, end, 8));
+            }
+        }
+        catch(runtime_error &ex) {}
+    });
+    auto provider = make_shared<tcp_fcgi_provider>("127.0.0.1", TEST_BIND_PORT + 1);
+    string big(100000, 'v'), body(200000, 'b');
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto conn = provider->get_connection();
+        conn->set_env("SHORT", "1");
+        conn->set_env("BIG", big);
+        conn->set_env("SHORT", "2");
+        conn->write(body.data(), body.size());
+        chunk out = conn->read();
+        ASSERT_EQ(string(out.data(), out.size()), "done");
+        ASSERT_FALSE(conn->read());
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    // PARAMS spans several records; pairs are in insertion order, SHORT replaced
+    string expected = string("\x05\x01" "SHORT" "2") + "\x03\x80\x01\x86\xa0" "BIG" + big;
+    ASSERT_EQ(params, expected);
+    ASSERT_EQ(input, body);
+    provider->pool()->clear();
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, FcgiMultiplex) {
+    int accepted = 0, max_concurrency = 0;
+    tcp_server fcgi_server("127.0.0.1", TEST_BIND_PORT + 1);
+    fcgi_server.serve([&] (shared_ptr<tcp_stream> strm) {
+        auto dec = make_shared<fcgi_message::decoder>();
+        int concurrency = 0;
+        accepted++;
+        try {
+            while(true) {
+                auto msg = strm->read<fcgi_message>(dec);
+                if(msg->msgtype() == fcgi_message::FCGI_GET_VALUES) {
+                    const char values[] = "\x0f\x01" "FCGI_MPXS_CONNS1";
+                    strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_GET_VALUES_RESULT,
+                                                          0, values, sizeof(values) - 1));
+                } else if(msg->msgtype() == fcgi_message::FCGI_BEGIN_REQUEST) {
+                    max_concurrency = max(max_concurrency, ++concurrency);
+                } else if(msg->msgtype() == fcgi_message::FCGI_STDIN && msg->data().size() == 0) {
+                    // Respond to the oldest request last to exercise demultiplexing
+                    if(concurrency < 3) continue;
+                    for(int id = 3; id > 0; id--) {
+                        string out = "Content-Type: text/plain\r\n\r\nRequest " + to_string(id);
+                        const char end[8] = { 0 };
+                        strm->write(make_shared<fcgi_message>(
+                                fcgi_message::FCGI_STDOUT, id, out.data(), out.size()));
+                        strm->write(make_shared<fcgi_message>(
+                                fcgi_message::FCGI_END_REQUEST, id, end, 8));
+                    }
+                    concurrency = 0;
+                }
+            }
+        }
+        catch(runtime_error &ex) {}
+    });
+    auto provider = make_shared<tcp_fcgi_provider>("127.0.0.1", TEST_BIND_PORT + 1);
+    provider->set_multiplex(true);
+    http_server server(make_shared<lambda_service>([provider] (http_trx &tx) {
+        tx->forward_to(provider->get_connection());
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    int clients_finished = 0;
+    for(int i = 0; i < 3; i++) {
+        fiber::launch([&clients_finished] () {
+            auto client_stream = make_shared<tcp_stream>();
+            client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+            auto client = make_shared<http_client>(client_stream);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("Connection", "keep-alive");
+            req->set_header("Host", "localhost");
+            req->set_resource("/index.php");
+            stream_buffer sb_content;
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            while(client->data_available()) {
+                chunk data = client->read();
+                sb_content.append(data.data(), data.size());
+            }
+            ASSERT_EQ(memcmp(sb_content.data(), "Request ", 8), 0);
+            if(++clients_finished == 3)
+                uv_stop(uv_default_loop());
+        });
+    }
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(clients_finished, 3);
+    ASSERT_EQ(accepted, 1);
+    ASSERT_EQ(max_concurrency, 3);
+    provider->set_multiplex(false);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, FcgiMultiplexRetire) {
+    int accepted = 0, closed = 0;
+    tcp_server fcgi_server("127.0.0.1", TEST_BIND_PORT + 1);
+    fcgi_server.serve([&] (shared_ptr<tcp_stream> strm) {
+        auto dec = make_shared<fcgi_message::decoder>();
+        accepted++;
+        try {
+            while(true) {
+                auto msg = strm->read<fcgi_message>(dec);
+                if(msg->msgtype() == fcgi_message::FCGI_GET_VALUES) {
+                    const char values[] = "\x0f\x01" "FCGI_MPXS_CONNS1" "\x0d\x01" "FCGI_MAX_REQS1";
+                    strm->write(make_shared<fcgi_message>(fcgi_message::FCGI_GET_VALUES_RESULT,
+                                                          0, values, sizeof(values) - 1));
+                } else if(msg->msgtype() == fcgi_message::FCGI_STDIN && msg->data().size() == 0) {
+                    const char end[8] = { 0 };
+                    strm->write(make_shared<fcgi_message>(
+                            fcgi_message::FCGI_STDOUT, msg->request_id(), "done", 4));
+                    strm->write(make_shared<fcgi_message>(
+                            fcgi_message::FCGI_END_REQUEST, msg->request_id(), end, 8));
+                }
+            }
+        }
+        catch(runtime_error &ex) {
+            closed++;
+        }
+    });
+    auto provider = make_shared<tcp_fcgi_provider>("127.0.0.1", TEST_BIND_PORT + 1);
+    provider->set_multiplex(true);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto c1 = provider->get_connection();
+        auto c2 = provider->get_connection(); // The first connection is full
+        ASSERT_EQ(accepted, 2);
+        for(auto c : { c1, c2 }) {
+            chunk out = c->read();
+            ASSERT_EQ(string(out.data(), out.size()), "done");
+            ASSERT_FALSE(c->read());
+        }
+        c1.reset();
+        sleep_fiber(50);
+        ASSERT_EQ(closed, 1); // No longer current, closed once idle
+        c2.reset();
+        sleep_fiber(50);
+        ASSERT_EQ(closed, 1); // Still current
+        provider->set_multiplex(false);
+        sleep_fiber(50);
+        ASSERT_EQ(closed, 2);
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, FcgiManagedWorkers) {
+    // Workers never accept, but connecting only needs their listening socket
+    auto provider = make_shared<managed_fcgi_provider>("sleep 30", 1, 2);
+    provider->set_max_requests(2);
+    ASSERT_EQ(provider->worker_count(), 1);
+
+    bool checkpoint_finished = false;
+    P<fcgi_connection> c1, c2;
+    fiber::launch([&] () {
+        c1 = provider->get_connection();
+        ASSERT_EQ(provider->idle_count(), 0);
+        c2 = provider->get_connection();
+        ASSERT_EQ(provider->worker_count(), 2);
+        fiber::launch([&] () {
+            auto c3 = provider->get_connection();
+            c3.reset();
+            ASSERT_EQ(provider->waiting(), 0);
+            ASSERT_EQ(provider->worker_count(), 2); // Unfinished requests are not counted
+            c2.reset();
+            ASSERT_EQ(provider->idle_count(), 2);
+            uv_stop(uv_default_loop());
+            checkpoint_finished = true;
+        });
+        ASSERT_EQ(provider->waiting(), 1);
+        c1.reset(); // Hands the worker to the queued request
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    provider.reset();
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsSessionResumption) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto keys = make_shared<tls_ticket_keys>();
+    ctx->set_session_tickets(keys);
+    https_server server(ctx, make_shared<lambda_service>([] (http_trx &tx) {
+        tx->write("Hello TLS");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto client_ctx = make_shared<tls_context>();
+        for(int i = 0; i < 3; i++) {
+            if(i == 2) keys->rotate(); // Tickets from the previous key still resume
+            auto client_stream = make_shared<tls_stream>(client_ctx);
+            client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+            auto client = make_shared<http_client>(client_stream);
+            auto req = make_shared<http_request>();
+            req->set_header("Host", "localhost");
+            req->set_resource("/");
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            while(client->data_available()) client->read();
+        }
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    ASSERT_EQ(ctx->session_misses(), 1);
+    ASSERT_EQ(ctx->session_hits(), 2);
+    ASSERT_EQ(keys->key_count(), 2);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsHandshakeOffload) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    ctx->set_handshake_offload(true);
+    https_server server(ctx, make_shared<lambda_service>([] (http_trx &tx) {
+        tx->write("Hello TLS");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    int completed = 0;
+    auto client_ctx = make_shared<tls_context>();
+    for(int i = 0; i < 8; i++) {
+        fiber::launch([&] () {
+            auto client_stream = make_shared<tls_stream>(client_ctx);
+            client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+            auto client = make_shared<http_client>(client_stream);
+            auto req = make_shared<http_request>();
+            req->set_header("Host", "localhost");
+            req->set_resource("/");
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            while(client->data_available()) client->read();
+            if(++completed == 8)
+                uv_stop(uv_default_loop());
+        });
+    }
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(completed, 8);
+    ASSERT_EQ(ctx->session_hits() + ctx->session_misses(), 8);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, SendFile) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    string content;
+    for(int i = 0; content.size() < 0x800000; i++)
+        content += to_string(i) + ",";
+    FILE *fp = fopen("/tmp/xyhttpd-test.bin", "wb");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+    auto svc = make_shared<lambda_service>([] (http_trx &tx) {
+        tx->serve_file("/tmp/xyhttpd-test.bin");
+    });
+    http_server server(svc);
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    // The client negotiates TLS 1.3, which is never handed to the kernel, so
+    // only the SSL_write() fallback is covered here
+    ctx->set_ktls(true);
+    https_server tls_server(ctx, svc);
+    tls_server.listen("127.0.0.1", TEST_BIND_PORT + 1);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto client_ctx = make_shared<tls_context>();
+        for(int i = 0; i < 2; i++) {
+            P<stream> client_stream;
+            if(i == 0) {
+                auto tcp = make_shared<tcp_stream>();
+                tcp->connect("127.0.0.1", TEST_BIND_PORT);
+                client_stream = tcp;
+            } else {
+                auto tls = make_shared<tls_stream>(client_ctx);
+                tls->connect("127.0.0.1", TEST_BIND_PORT + 1);
+                client_stream = tls;
+            }
+            auto client = make_shared<http_client>(client_stream);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("Host", "localhost");
+            req->set_resource("/");
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            string body;
+            while(client->data_available()) {
+                chunk data = client->read();
+                body.append(data.data(), data.size());
+            }
+            ASSERT_TRUE(body == content);
+        }
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsRecordSizing) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    ctx->set_record_sizing(600, 0x2000);
+    string content(0x10000, 'x');
+    https_server server(ctx, make_shared<lambda_service>([&content] (http_trx &tx) {
+        tx->write(content);
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    // Relay the connection and note the length of every record the server sends
+    vector<int> records;
+    tcp_server relay("127.0.0.1", TEST_BIND_PORT + 1);
+    relay.serve([&records] (shared_ptr<tcp_stream> down) {
+        auto up = make_shared<tcp_stream>();
+        up->connect("127.0.0.1", TEST_BIND_PORT);
+        fiber::launch([up, down, &records] () {
+            stream_buffer pending;
+            try {
+                while(true) {
+                    auto data = up->read<string_message>(make_shared<string_decoder>());
+                    pending.append(data->data(), data->str().size());
+                    while(pending.size() >= 5) {
+                        int len = ((unsigned char)pending[3] << 8) | (unsigned char)pending[4];
+                        if(pending.size() < (size_t)len + 5) break;
+                        records.push_back(len);
+                        pending.pull(len + 5);
+                    }
+                    down->write(data->str());
+                }
+            }
+            catch(runtime_error &ex) {}
+        });
+        try {
+            while(true)
+                up->write(down->read<string_message>(make_shared<string_decoder>())->str());
+        }
+        catch(runtime_error &ex) {}
+    });
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto client_stream = make_shared<tls_stream>(make_shared<tls_context>());
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT + 1);
+        auto client = make_shared<http_client>(client_stream);
+        auto req = make_shared<http_request>();
+        req->set_header("Host", "localhost");
+        req->set_resource("/");
+        auto resp = client->send(req);
+        ASSERT_EQ(resp->code(), 200);
+        size_t received = 0;
+        while(client->data_available())
+            received += client->read().size();
+        ASSERT_EQ(received, content.size());
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    // Small records until 8 KB went out, full-sized ones afterwards
+    int small = 0, full = 0;
+    for(int len : records) {
+        if(len > 600 && len < 650) small++;
+        if(len > 0x4000) full++;
+    }
+    ASSERT_GE(small, 8);
+    ASSERT_GE(full, 3);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsFullDuplex) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    bool checkpoint_server = false;
+    https_server server(ctx, make_shared<lambda_service>([&checkpoint_server] (http_trx &tx) {
+        tx->get_response(101);
+        auto strm = tx->upgrade();
+        // Push while the transaction fiber is blocked reading
+        fiber::launch([strm] () {
+            for(int i = 0; i < 3; i++)
+                strm->write("push;");
+        });
+        auto msg = strm->read<string_message>(make_shared<string_decoder>(4));
+        ASSERT_EQ(string(msg->data(), 4), "done");
+        checkpoint_server = true;
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto tls = make_shared<tls_stream>(make_shared<tls_context>());
+        tls->connect("127.0.0.1", TEST_BIND_PORT);
+        P<stream> client = tls;
+        client->write("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        auto resp = client->read<http_response>(make_shared<http_response::decoder>());
+        ASSERT_EQ(resp->code(), 101);
+        fiber::launch([&checkpoint_finished, client] () {
+            string pushed;
+            while(pushed.size() < 15) {
+                auto msg = client->read<string_message>(make_shared<string_decoder>());
+                pushed.append(msg->data(), msg->str().size());
+            }
+            ASSERT_EQ(pushed, "push;push;push;");
+            checkpoint_finished = true;
+            uv_stop(uv_default_loop());
+        });
+        // Written while the reader fiber waits for the pushes
+        client->write("done");
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_server);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsHandshakeDuplex) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    https_server server(ctx, make_shared<lambda_service>([] (http_trx &tx) {
+        tx->write("Hello TLS");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        auto tls = make_shared<tls_stream>(make_shared<tls_context>());
+        tls->connect("127.0.0.1", TEST_BIND_PORT);
+        P<stream> client = tls;
+        // The writer runs the handshake and waits for the server's reply,
+        // the reader starts while it does
+        fiber::launch([client] () {
+            client->write("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        });
+        while(!client->reading_fiber)
+            sleep_fiber(0);
+        auto resp = client->read<http_response>(make_shared<http_response::decoder>());
+        ASSERT_EQ(resp->code(), 200);
+        checkpoint_finished = true;
+        uv_stop(uv_default_loop());
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsOcspStapling) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    mkdir("/tmp/xyhttpd-ocsp", 0755);
+    auto put_response = [] (const string &der) {
+        FILE *fp = fopen("/tmp/xyhttpd-ocsp/01.der", "wb"); // Named after the serial
+        fwrite(der.data(), 1, der.size(), fp);
+        fclose(fp);
+    };
+    string first = make_test_ocsp_response("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key", 3600);
+    put_response(first);
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    ctx->set_ocsp_staple("/tmp/xyhttpd-ocsp");
+    https_server server(ctx, make_shared<lambda_service>([] (http_trx &tx) {
+        tx->write("Hello TLS");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    static string stapled;
+    auto fetch_staple = [] () {
+        stapled.clear();
+        auto client_ctx = make_shared<tls_context>();
+        SSL_CTX_set_tlsext_status_type(client_ctx->ctx(), TLSEXT_STATUSTYPE_ocsp);
+        SSL_CTX_set_tlsext_status_cb(client_ctx->ctx(), +[] (SSL *ssl, void *) {
+            const unsigned char *der;
+            long len = SSL_get_tlsext_status_ocsp_resp(ssl, &der);
+            if(len > 0) stapled.assign((const char *)der, len);
+            return 1;
+        });
+        auto client_stream = make_shared<tls_stream>(client_ctx);
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+        auto client = make_shared<http_client>(client_stream);
+        auto req = make_shared<http_request>();
+        req->set_header("Host", "localhost");
+        req->set_resource("/");
+        auto resp = client->send(req);
+        while(client->data_available()) client->read();
+        return resp->code();
+    };
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        ASSERT_EQ(fetch_staple(), 200);
+        ASSERT_TRUE(stapled == first);
+        // A newer response is picked up by the next refresh
+        string second = make_test_ocsp_response("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key", 7200);
+        put_response(second);
+        ctx->refresh_ocsp_staple();
+        ASSERT_EQ(fetch_staple(), 200);
+        ASSERT_TRUE(stapled == second);
+        // A broken file keeps the last good response stapled
+        put_response("garbage");
+        ctx->refresh_ocsp_staple();
+        ASSERT_EQ(fetch_staple(), 200);
+        ASSERT_TRUE(stapled == second);
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TlsCertificateSelection) {
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    make_test_certificate("/tmp/xyhttpd-rsa.crt", "/tmp/xyhttpd-rsa.key", "localhost", true);
+    make_test_certificate("/tmp/xyhttpd-exact.crt", "/tmp/xyhttpd-exact.key", "exact");
+    make_test_certificate("/tmp/xyhttpd-wild.crt", "/tmp/xyhttpd-wild.key", "wildcard");
+    auto ctx = make_shared<tls_context>("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    ctx->use_certificate("/tmp/xyhttpd-rsa.crt", "/tmp/xyhttpd-rsa.key");
+    ctx->register_context("a.example.com", make_shared<tls_context>(
+            "/tmp/xyhttpd-exact.crt", "/tmp/xyhttpd-exact.key"));
+    ctx->register_context("*.example.com", make_shared<tls_context>(
+            "/tmp/xyhttpd-wild.crt", "/tmp/xyhttpd-wild.key"));
+    https_server server(ctx, make_shared<lambda_service>([] (http_trx &tx) {
+        tx->write("Hello TLS");
+        tx->finish();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    // Report the name and key type of the certificate a handshake got
+    static string peer;
+    auto handshake = [] (const char *serverName, const char *sigalgs) {
+        peer.clear();
+        auto client_ctx = make_shared<tls_context>();
+        if(sigalgs)
+            SSL_CTX_set1_sigalgs_list(client_ctx->ctx(), sigalgs);
+        SSL_CTX_set_verify(client_ctx->ctx(), SSL_VERIFY_PEER, [] (int, X509_STORE_CTX *store) {
+            if(X509_STORE_CTX_get_error_depth(store) == 0) {
+                X509 *cert = X509_STORE_CTX_get_current_cert(store);
+                char cn[64] = "";
+                X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, cn, sizeof(cn));
+                EVP_PKEY *key = X509_get0_pubkey(cert);
+                peer = string(cn) + (EVP_PKEY_base_id(key) == EVP_PKEY_RSA ? "/RSA" : "/EC");
+            }
+            return 1;
+        });
+        auto client_stream = make_shared<tls_stream>(client_ctx);
+        if(serverName)
+            client_stream->set_server_name(serverName);
+        client_stream->connect("127.0.0.1", TEST_BIND_PORT);
+        auto client = make_shared<http_client>(client_stream);
+        auto req = make_shared<http_request>();
+        req->set_header("Host", "localhost");
+        req->set_resource("/");
+        auto resp = client->send(req);
+        while(client->data_available()) client->read();
+        return peer;
+    };
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        ASSERT_EQ(handshake(nullptr, nullptr), "localhost/EC");
+        ASSERT_EQ(handshake(nullptr, "RSA-PSS+SHA256:RSA+SHA256"), "localhost/RSA");
+        ASSERT_EQ(handshake("a.example.com", nullptr), "exact/EC");
+        ASSERT_EQ(handshake("B.Example.com", nullptr), "wildcard/EC");
+        ASSERT_EQ(handshake("x.b.example.com", nullptr), "localhost/EC");
+        ASSERT_EQ(handshake("example.com", nullptr), "localhost/EC");
+        // Renewed certificates are picked up without restarting
+        make_test_certificate("/tmp/xyhttpd-wild.crt", "/tmp/xyhttpd-wild.key", "renewed");
+        ctx->reload_certificates();
+        ASSERT_EQ(handshake("c.example.com", nullptr), "renewed/EC");
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, Http2Server) {
+    // HPACK round trip, including Huffman strings and dynamic table hits
+    hpack_encoder enc;
+    hpack_decoder dec;
+    string block;
+    enc.encode(":status", "200", block);
+    enc.encode("content-type", "text/html; charset=utf-8", block);
+    enc.encode("x-custom", "\xff\x01 binary", block);
+    enc.encode("content-type", "text/html; charset=utf-8", block);
+    http2_header_list headers;
+    dec.decode(block.data(), block.size(), headers);
+    ASSERT_EQ(headers.size(), 4);
+    ASSERT_EQ(headers[2].second, "\xff\x01 binary");
+    ASSERT_EQ(headers[3].second, "text/html; charset=utf-8");
+    ASSERT_EQ(enc.size(), dec.size());
+
+    auto chain = make_shared<http_service_chain>();
+    chain->route<lambda_service>("/hello", [] (http_trx &tx) {
+        tx->write("Hello world");
+        tx->finish();
+    });
+    chain->route<lambda_service>("/echo", [] (http_trx &tx) {
+        tx->write(tx->postdata.data(), tx->postdata.size());
+        tx->finish();
+    });
+    chain->route<lambda_service>("/large-data", [] (http_trx &tx) {
+        for(int i = 0; i < 16384; i++)
+            tx->write("abcdefghAbcdefghabcdEfghABCDEFGH");
+        tx->finish();
+    });
+    http_server server(chain);
+    server.set_http2(true);
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+    make_test_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    https_server tls_server(chain);
+    tls_server.set_http2(true);
+    tls_server.use_certificate("/tmp/xyhttpd-test.crt", "/tmp/xyhttpd-test.key");
+    tls_server.listen("127.0.0.1", TEST_BIND_PORT + 1);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        // h2c with prior knowledge, three streams at once
+        auto client = make_shared<tcp_stream>();
+        client->connect("127.0.0.1", TEST_BIND_PORT);
+        hpack_encoder enc;
+        string out = http2_connection::PREFACE;
+        put_h2_frame(out, http2_frame::SETTINGS, 0, 0, string("\0\x04\0\x10\0\0", 6));
+        put_h2_frame(out, http2_frame::WINDOW_UPDATE, 0, 0, string("\0\x10\0\0", 4));
+        put_h2_request(out, enc, 1, "GET", "/large-data", true);
+        put_h2_request(out, enc, 3, "GET", "/hello", true);
+        put_h2_request(out, enc, 5, "POST", "/echo", false); // No length, the body decides
+        put_h2_frame(out, http2_frame::DATA, 0, 5, "ping ");
+        put_h2_frame(out, http2_frame::DATA, http2_frame::END_STREAM, 5, "pong");
+        client->write(out.data(), out.size());
+        auto responses = read_h2_responses(client, 3);
+        ASSERT_EQ(responses[1].first, "200");
+        ASSERT_EQ(responses[1].second.size(), 16384 * 32);
+        ASSERT_EQ(responses[3].first, "200");
+        ASSERT_EQ(responses[3].second, "Hello world");
+        ASSERT_EQ(responses[5].second, "ping pong");
+
+        // HTTP/1.1 clients are still served on the same port
+        auto h1strm = make_shared<tcp_stream>();
+        h1strm->connect("127.0.0.1", TEST_BIND_PORT);
+        auto h1 = make_shared<http_client>(h1strm);
+        auto req = make_shared<http_request>();
+        req->set_header("Host", "localhost");
+        req->set_resource("/hello");
+        ASSERT_EQ(h1->send(req)->code(), 200);
+        ASSERT_EQ(h1->read().to_string(), "Hello world");
+
+        // ALPN picks h2 over TLS
+        auto client_ctx = make_shared<tls_context>();
+        client_ctx->set_alpn_protocols({ "h2", "http/1.1" });
+        auto tls = make_shared<tls_stream>(client_ctx);
+        tls->connect("127.0.0.1", TEST_BIND_PORT + 1);
+        ASSERT_EQ(tls->alpn_protocol(), "h2");
+        hpack_encoder tlsEnc;
+        out = http2_connection::PREFACE;
+        put_h2_frame(out, http2_frame::SETTINGS, 0, 0, "");
+        put_h2_request(out, tlsEnc, 1, "GET", "/hello", true);
+        P<stream> tlsClient = tls;
+        tlsClient->write(out.data(), out.size());
+        responses = read_h2_responses(tlsClient, 1);
+        ASSERT_EQ(responses[1].second, "Hello world");
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, Http2Upstream) {
+    auto chain = make_shared<http_service_chain>();
+    chain->route<lambda_service>("/hello", [] (http_trx &tx) {
+        tx->get_response()->set_header("X-Seen-By", tx->request->header("x-forwarded-for"));
+        tx->write("Hello world");
+        tx->finish();
+    });
+    chain->route<lambda_service>("/echo", [] (http_trx &tx) {
+        tx->write(tx->postdata.data(), tx->postdata.size());
+        tx->finish();
+    });
+    http_server backend(chain);
+    backend.set_http2(true);
+    backend.listen("127.0.0.1", TEST_BIND_PORT);
+    auto proxy = make_shared<proxy_pass_service>("127.0.0.1", TEST_BIND_PORT);
+    proxy->set_http2(true);
+    http_server frontend(proxy);
+    frontend.listen("127.0.0.1", TEST_BIND_PORT + 1);
+    http_server h1backend(chain); // HTTP/1.1 only
+    h1backend.listen("127.0.0.1", TEST_BIND_PORT + 2);
+    auto mixed = make_shared<proxy_pass_service>();
+    mixed->append("127.0.0.1", TEST_BIND_PORT, true);
+    mixed->append("127.0.0.1", TEST_BIND_PORT + 2);
+    ASSERT_TRUE(mixed->http2(0));
+    ASSERT_FALSE(mixed->http2(1));
+    http_server mixedFrontend(mixed);
+    mixedFrontend.listen("127.0.0.1", TEST_BIND_PORT + 3);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&checkpoint_finished] () {
+        // Several requests in flight over one connection
+        auto strm = make_shared<tcp_stream>();
+        strm->connect("127.0.0.1", TEST_BIND_PORT);
+        auto conn = make_shared<http2_connection>(strm, "backend");
+        conn->open();
+        int pending = 3;
+        string bodies[3];
+        auto waiter = fiber::current();
+        for(int i = 0; i < 3; i++) {
+            fiber::launch([conn, i, waiter, &pending, &bodies] () {
+                http2_client client(conn);
+                auto req = make_shared<http_request>();
+                req->method = i == 2 ? "POST" : "GET";
+                req->set_header("host", "localhost");
+                req->set_resource(i == 2 ? "/echo" : "/hello");
+                auto resp = client.send(req, i == 2 ? chunk("ping pong") : chunk(nullptr));
+                EXPECT_EQ(resp->code(), 200);
+                EXPECT_TRUE(resp->header("Content-Length"));
+                while(client.data_available()) {
+                    chunk data = client.read();
+                    if(data) bodies[i] += data.to_string();
+                }
+                if(--pending == 0)
+                    waiter->resume(0);
+            });
+        }
+        fiber::yield();
+        ASSERT_EQ(bodies[0], "Hello world");
+        ASSERT_EQ(bodies[1], "Hello world");
+        ASSERT_EQ(bodies[2], "ping pong");
+        ASSERT_TRUE(conn->usable());
+
+        // proxy_pass_service forwards HTTP/1.1 requests over h2c
+        auto h1strm = make_shared<tcp_stream>();
+        h1strm->connect("127.0.0.1", TEST_BIND_PORT + 1);
+        auto h1 = make_shared<http_client>(h1strm);
+        for(int i = 0; i < 2; i++) {
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("Host", "localhost");
+            req->set_header("Connection", "keep-alive");
+            req->set_resource("/hello");
+            auto resp = h1->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            ASSERT_EQ(resp->header("X-Seen-By").to_string(), "127.0.0.1");
+            string body;
+            while(h1->data_available())
+                body += h1->read().to_string();
+            ASSERT_EQ(body, "Hello world");
+        }
+
+        // h2c is chosen per backend, taking turns with a plain one
+        for(int i = 0; i < 4; i++) {
+            auto conn = make_shared<tcp_stream>();
+            conn->connect("127.0.0.1", TEST_BIND_PORT + 3);
+            auto client = make_shared<http_client>(conn);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("Host", "localhost");
+            req->set_resource("/hello");
+            auto resp = client->send(req);
+            ASSERT_EQ(resp->code(), 200);
+            string body;
+            while(client->data_available())
+                body += client->read().to_string();
+            ASSERT_EQ(body, "Hello world");
+        }
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketMask) {
+    const char key[4] = { '\x12', '\x34', '\x56', '\x78' };
+    vector<char> data(300), expected(300);
+    for(size_t i = 0; i < data.size(); i++)
+        data[i] = (char)(i * 7);
+    // Every head alignment, tail length and key phase against the plain loop
+    for(size_t offset = 0; offset < 40; offset++) {
+        for(size_t len = 0; offset + len <= data.size(); len += 13) {
+            for(size_t pos = 0; pos < 4; pos++) {
+                vector<char> buf(data);
+                expected = data;
+                for(size_t i = 0; i < len; i++)
+                    expected[offset + i] ^= key[(pos + i) % 4];
+                websocket_frame::apply_mask(buf.data() + offset, len, key, pos);
+                ASSERT_EQ(buf, expected);
+            }
+        }
+    }
+
+    // Masked frames decode back to what was sent
+    string payload(70000, 'x');
+    for(size_t i = 0; i < payload.size(); i++)
+        payload[i] = (char)(i % 251);
+    auto frame = make_shared<websocket_frame>(2, chunk(payload.data(), payload.size()));
+    frame->set_mask(key);
+    vector<char> wire(frame->serialize_size());
+    frame->serialize(wire.data());
+    ASSERT_EQ((unsigned char)wire[1], 0x80 | 127);
+    stream_buffer stb;
+    stb.append(wire.data(), wire.size());
+    websocket_frame::decoder dec(0x100000);
+    ASSERT_TRUE(dec.decode(stb));
+    auto decoded = dynamic_pointer_cast<websocket_frame>(dec.msg());
+    ASSERT_EQ(decoded->payload().to_string(), payload);
+    ASSERT_EQ(stb.size(), 0);
+}
+
+TEST(IO, WebSocketDeflateNegotiation) {
+    websocket_deflate policy;
+    policy.tx_window_bits = 10;
+    policy.rx_window_bits = 12;
+    vector<websocket_deflate> negotiated;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket(policy);
+        negotiated.push_back(ws->deflate_params());
+        try {
+            while(ws->poll())
+                ws->send(ws->read());
+        }
+        catch(runtime_error &ex) {}
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto handshake = [] (const char *offer) {
+            auto client = make_shared<tcp_stream>();
+            client->connect("127.0.0.1", TEST_BIND_PORT);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("upgrade", "websocket");
+            req->set_header("host", "localhost");
+            req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+            req->set_header("sec-websocket-extensions", offer);
+            req->set_resource("/");
+            client->write(req);
+            auto resp = client->read<http_response>(make_shared<http_response::decoder>());
+            EXPECT_EQ(resp->code(), 101);
+            auto ext = resp->header("Sec-WebSocket-Extensions");
+            return make_pair(client, ext ? string(ext.data(), ext.size()) : string());
+        };
+
+        // Our window can only be limited if the client says it can be
+        ASSERT_EQ(handshake("permessage-deflate").second, "");
+        ASSERT_FALSE(negotiated.back().enabled);
+
+        // 256-byte windows and unknown parameters pass an offer over
+        auto accepted = handshake("permessage-deflate; server_max_window_bits=8, "
+                                  "permessage-deflate; x_foo, "
+                                  "permessage-deflate; client_max_window_bits; "
+                                  "server_no_context_takeover");
+        ASSERT_EQ(accepted.second, "permessage-deflate; server_no_context_takeover; "
+                                   "server_max_window_bits=10; client_max_window_bits=12");
+        auto &params = negotiated.back();
+        ASSERT_TRUE(params.enabled);
+        ASSERT_EQ(params.tx_window_bits, 10);
+        ASSERT_EQ(params.rx_window_bits, 12);
+        ASSERT_TRUE(params.tx_no_context_takeover);
+        ASSERT_FALSE(params.rx_no_context_takeover);
+
+        // Round trip, each reply compressed without reference to the last
+        auto client = accepted.first;
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+        z_stream tx, rx;
+        memset(&tx, 0, sizeof(tx));
+        ASSERT_EQ(deflateInit2(&tx, 6, Z_DEFLATED, -12, 8, Z_DEFAULT_STRATEGY), Z_OK);
+        string text;
+        for(int i = 0; i < 2000; i++)
+            text += to_string(i) + " bottles of beer on the wall\n";
+        chunk replies[2];
+        for(int i = 0; i < 2; i++) {
+            string packed(text.size() + 64, '\0');
+            tx.next_in = (Bytef *)&text[0];
+            tx.avail_in = text.size();
+            tx.next_out = (Bytef *)&packed[0];
+            tx.avail_out = packed.size();
+            ASSERT_EQ(deflate(&tx, Z_SYNC_FLUSH), Z_OK);
+            packed.resize(packed.size() - tx.avail_out - 4);
+            auto frame = make_shared<websocket_frame>(0x41, chunk(packed));
+            frame->set_mask("\x12\x34\x56\x78");
+            client->write(frame);
+
+            auto reply = client->read<websocket_frame>(dec);
+            ASSERT_TRUE(reply->deflated());
+            replies[i] = reply->payload();
+            memset(&rx, 0, sizeof(rx));
+            ASSERT_EQ(inflateInit2(&rx, -10), Z_OK);
+            string input = replies[i].to_string() + string("\0\0\xff\xff", 4);
+            string inflated(text.size(), '\0');
+            rx.next_in = (Bytef *)&input[0];
+            rx.avail_in = input.size();
+            rx.next_out = (Bytef *)&inflated[0];
+            rx.avail_out = inflated.size();
+            inflate(&rx, Z_SYNC_FLUSH);
+            inflateEnd(&rx);
+            ASSERT_EQ(rx.avail_out, 0);
+            ASSERT_EQ(inflated, text);
+        }
+        deflateEnd(&tx);
+        ASSERT_EQ(replies[0].to_string(), replies[1].to_string());
+
+        // zlib can't compress with 256-byte windows, 512 bytes are used instead
+        policy.tx_window_bits = 8;
+        auto narrow = handshake("permessage-deflate; client_max_window_bits");
+        ASSERT_EQ(narrow.second, "permessage-deflate; server_max_window_bits=9; "
+                                 "client_max_window_bits=12");
+        ASSERT_EQ(negotiated.back().tx_window_bits, 9);
+        auto frame = make_shared<websocket_frame>(0x81, chunk(text));
+        frame->set_mask("\x12\x34\x56\x78");
+        narrow.first->write(frame);
+        auto reply = narrow.first->read<websocket_frame>(dec);
+        ASSERT_TRUE(reply->deflated());
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketStreaming) {
+    string text;
+    for(int i = 0; text.size() < 0x200000; i++)
+        text += to_string(i) + " bottles of beer on the wall\n";
+    string big(0x300000, '\0');
+    for(auto &c : big)
+        c = (char)rand();
+    size_t largestPiece = 0;
+    vector<string> received;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket();
+        string msg;
+        try {
+            while(true) {
+                chunk piece = ws->read_some();
+                if(!ws->alive())
+                    break;
+                largestPiece = max(largestPiece, piece.size());
+                msg.append(piece.data(), piece.size());
+                if(ws->message_end()) {
+                    received.push_back(move(msg));
+                    msg.clear();
+                    if(received.size() == 2)
+                        ws->send(chunk(big));
+                }
+            }
+        }
+        catch(runtime_error &ex) {}
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto client = make_shared<tcp_stream>();
+        client->connect("127.0.0.1", TEST_BIND_PORT);
+        auto req = make_shared<http_request>();
+        req->method = "GET";
+        req->set_header("upgrade", "websocket");
+        req->set_header("host", "localhost");
+        req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+        req->set_header("sec-websocket-extensions", "permessage-deflate");
+        req->set_resource("/");
+        client->write(req);
+        ASSERT_EQ(client->read<http_response>(make_shared<http_response::decoder>())->code(), 101);
+
+        // One frame far over what used to be the frame size limit
+        auto frame = make_shared<websocket_frame>(2, chunk(big));
+        frame->set_mask("\x12\x34\x56\x78");
+        client->write(frame);
+
+        // A deflated message in three fragments, inflated as it comes
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        deflateInit2(&zs, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        string packed(deflateBound(&zs, text.size()) + 16, '\0');
+        zs.next_in = (Bytef *)&text[0];
+        zs.avail_in = text.size();
+        zs.next_out = (Bytef *)&packed[0];
+        zs.avail_out = packed.size();
+        ASSERT_EQ(deflate(&zs, Z_SYNC_FLUSH), Z_OK);
+        packed.resize(packed.size() - zs.avail_out - 4);
+        deflateEnd(&zs);
+        size_t third = packed.size() / 3;
+        for(int i = 0; i < 3; i++) {
+            size_t end = i == 2 ? packed.size() : third * (i + 1);
+            auto part = make_shared<websocket_frame>(i == 0 ? 0x41 : 0,
+                                                     chunk(packed.substr(third * i, end - third * i)));
+            part->set_more(i < 2);
+            part->set_mask("\x9a\xbc\xde\xf0");
+            client->write(part);
+        }
+
+        // The reply comes in 64K frames, FIN on the last
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+        string reply;
+        int frames = 0;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -MAX_WBITS);
+        while(true) {
+            auto f = client->read<websocket_frame>(dec);
+            ASSERT_EQ(f->opcode(), frames == 0 ? 1 : 0);
+            ASSERT_EQ(f->deflated(), frames == 0);
+            ASSERT_LE(f->payload().size(), 0x10000);
+            string input = f->payload().to_string();
+            if(f->fin())
+                input += string("\0\0\xff\xff", 4);
+            zs.next_in = (Bytef *)&input[0];
+            zs.avail_in = input.size();
+            do {
+                char buf[0x4000];
+                zs.next_out = (Bytef *)buf;
+                zs.avail_out = sizeof(buf);
+                inflate(&zs, Z_SYNC_FLUSH);
+                reply.append(buf, sizeof(buf) - zs.avail_out);
+            } while(zs.avail_in || zs.avail_out == 0);
+            frames++;
+            if(f->fin())
+                break;
+        }
+        inflateEnd(&zs);
+        ASSERT_GT(frames, 1);
+        ASSERT_EQ(reply, big);
+
+        ASSERT_EQ(received.size(), 2);
+        ASSERT_EQ(received[0], big);
+        ASSERT_EQ(received[1], text);
+        ASSERT_LE(largestPiece, 0x10000);
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, TimerWheel) {
+    timer_wheel wheel(10, 8); // One turn is 80ms
+    timer_wheel::entry soon, later, cancelled, again;
+    vector<string> fired;
+    uint64_t start = uv_now(uv_default_loop()), laterAt = 0;
+    soon.callback = [&] () {
+        fired.push_back("soon");
+        wheel.schedule(again, 30);
+        cancelled.cancel();
+    };
+    later.callback = [&] () {
+        fired.push_back("later");
+        laterAt = uv_now(uv_default_loop());
+    };
+    cancelled.callback = [&] () { fired.push_back("cancelled"); };
+    again.callback = [&] () { fired.push_back("again"); };
+    wheel.schedule(later, 200);
+    wheel.schedule(soon, 20);
+    wheel.schedule(cancelled, 60);
+    ASSERT_EQ(wheel.size(), 3);
+
+    uv_timer_t stopper; // The wheel does not keep the loop running
+    uv_timer_init(uv_default_loop(), &stopper);
+    uv_timer_start(&stopper, [] (uv_timer_t *) { uv_stop(uv_default_loop()); }, 400, 0);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    uv_close((uv_handle_t *)&stopper, nullptr);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+
+    ASSERT_EQ(fired, vector<string>({ "soon", "again", "later" }));
+    ASSERT_GE(laterAt - start, 200);
+    ASSERT_EQ(wheel.size(), 0);
+    ASSERT_FALSE(later.scheduled());
+}
+
+TEST(IO, WebSocketHeartbeat) {
+    int timedOut = 0;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket();
+        ws->set_heartbeat(200, 500);
+        try {
+            while(ws->poll())
+                ws->send(ws->read());
+        }
+        catch(runtime_error &ex) {
+            timedOut++;
+        }
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        P<stream> clients[2];
+        for(auto &client : clients) {
+            auto conn = make_shared<tcp_stream>();
+            conn->connect("127.0.0.1", TEST_BIND_PORT);
+            client = conn;
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("upgrade", "websocket");
+            req->set_header("host", "localhost");
+            req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+            req->set_resource("/");
+            client->write(req);
+            ASSERT_EQ(client->read<http_response>(make_shared<http_response::decoder>())->code(), 101);
+        }
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+
+        // Answering pings keeps a websocket open past the idle timeout
+        uint64_t start = uv_now(uv_default_loop());
+        for(int pings = 0; pings < 4; pings++) {
+            auto ping = clients[0]->read<websocket_frame>(dec);
+            ASSERT_EQ(ping->opcode(), 9);
+            auto pong = make_shared<websocket_frame>(10, ping->payload());
+            pong->set_mask("abcd");
+            clients[0]->write(pong);
+        }
+        ASSERT_GT(uv_now(uv_default_loop()) - start, 500);
+        auto msg = make_shared<websocket_frame>(1, chunk("still here"));
+        msg->set_mask("abcd");
+        clients[0]->write(msg);
+        ASSERT_EQ(clients[0]->read<websocket_frame>(dec)->payload().to_string(), "still here");
+
+        // The silent one was pinged, then dropped
+        ASSERT_EQ(timedOut, 1);
+        ASSERT_EQ(clients[1]->read<websocket_frame>(dec)->opcode(), 9);
+        ASSERT_ANY_THROW({
+            while(true)
+                clients[1]->read<websocket_frame>(dec);
+        });
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketHeartbeatPushOnly) {
+    websocket_hub hub;
+    bool done = false, alive = false;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket();
+        ws->set_heartbeat(100, 300);
+        hub.subscribe("news", ws);
+        while(!done) // Never reads
+            sleep_fiber(10);
+        alive = ws->alive();
+        hub.unsubscribe(ws);
+        ws->close();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto client = make_shared<tcp_stream>();
+        client->connect("127.0.0.1", TEST_BIND_PORT);
+        auto req = make_shared<http_request>();
+        req->method = "GET";
+        req->set_header("upgrade", "websocket");
+        req->set_header("host", "localhost");
+        req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+        req->set_resource("/");
+        client->write(req);
+        ASSERT_EQ(client->read<http_response>(make_shared<http_response::decoder>())->code(), 101);
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+
+        // Pinged past the idle timeout, the pongs are never read but it stays subscribed
+        uint64_t start = uv_now(uv_default_loop());
+        while(uv_now(uv_default_loop()) - start < 600) {
+            auto ping = client->read<websocket_frame>(dec);
+            ASSERT_EQ(ping->opcode(), 9);
+            auto pong = make_shared<websocket_frame>(10, ping->payload());
+            pong->set_mask("abcd");
+            client->write(pong);
+        }
+        ASSERT_EQ(hub.publish("news", string("pushed")), 1);
+        auto frame = client->read<websocket_frame>(dec);
+        while(frame->opcode() == 9)
+            frame = client->read<websocket_frame>(dec);
+        ASSERT_EQ(frame->payload().to_string(), "pushed");
+        done = true;
+        ASSERT_ANY_THROW({
+            while(true)
+                client->read<websocket_frame>(dec);
+        });
+        ASSERT_TRUE(alive);
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketConcurrentSenders) {
+    int connections = 0, sent = 0;
+    string msgs[2];
+    for(auto &msg : msgs) {
+        msg.resize(300000);
+        for(auto &c : msg)
+            c = (char)rand();
+    }
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        websocket_deflate policy;
+        policy.enabled = connections++ == 1;
+        auto ws = tx->accept_websocket(policy);
+        for(auto &msg : msgs) { // Fragmented, and started before the other is out
+            fiber::launch([&, ws] () {
+                ws->send_some(chunk(msg.data(), msg.size()), true, true);
+                sent++;
+            });
+        }
+        try {
+            while(ws->poll())
+                ws->read();
+        }
+        catch(runtime_error &ex) {}
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        for(int i = 0; i < 2; i++) {
+            auto client = make_shared<tcp_stream>();
+            client->connect("127.0.0.1", TEST_BIND_PORT);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("upgrade", "websocket");
+            req->set_header("host", "localhost");
+            req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+            req->set_header("sec-websocket-extensions", "permessage-deflate; client_max_window_bits");
+            req->set_resource("/");
+            client->write(req);
+            auto resp = client->read<http_response>(make_shared<http_response::decoder>());
+            ASSERT_EQ(resp->code(), 101);
+            websocket_deflate params;
+            params.enabled = (bool)resp->header("Sec-WebSocket-Extensions");
+            ASSERT_EQ(params.enabled, i == 1);
+            // Reads unmasked frames just as well
+            auto ws = make_shared<websocket>(client, params);
+            ASSERT_EQ(ws->read().to_string(), msgs[0]);
+            ASSERT_EQ(ws->read().to_string(), msgs[1]);
+            ASSERT_EQ(sent, 2 * (i + 1));
+            ws->close();
+        }
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketClient) {
+    int connections = 0;
+    string rawFrame;
+    websocket_deflate policy;
+    policy.rx_window_bits = 12;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        int n = connections++;
+        if(n < 2) { // By hand, to see the frame on the wire; then a bad key
+            string key = tx->request->header("sec-websocket-key").substr(0);
+            ASSERT_EQ(tx->request->header("sec-websocket-version").substr(0), "13");
+            key += n == 0 ? http_transaction::WEBSOCKET_MAGIC : "";
+            unsigned char sha[SHA_DIGEST_LENGTH];
+            SHA1((unsigned char *)key.data(), key.size(), sha);
+            auto resp = tx->get_response(101);
+            resp->set_header("upgrade", "WebSocket");
+            resp->set_header("sec-websocket-accept", base64_encode(sha, SHA_DIGEST_LENGTH));
+            auto strm = tx->upgrade();
+            if(n == 0)
+                rawFrame = strm->read<string_message>(make_shared<string_decoder>())->str().to_string();
+            return;
+        }
+        auto ws = tx->accept_websocket(policy);
+        try {
+            while(ws->poll())
+                ws->send(ws->read());
+        }
+        catch(runtime_error &ex) {}
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto connect = [] () {
+            auto conn = make_shared<tcp_stream>();
+            conn->connect("127.0.0.1", TEST_BIND_PORT);
+            return make_shared<http_client>(conn);
+        };
+        auto request = [] () {
+            auto req = make_shared<http_request>();
+            req->set_header("host", "localhost");
+            req->set_resource("/");
+            return req;
+        };
+
+        // What a client sends is masked
+        auto ws = connect()->open_websocket(request());
+        ASSERT_FALSE(ws->deflate_enabled());
+        ws->send(chunk("hello"));
+        try {
+            while(ws->poll())
+                ws->read();
+        }
+        catch(runtime_error &ex) {}
+        ASSERT_EQ(rawFrame.size(), 11);
+        ASSERT_EQ((unsigned char)rawFrame[0], 0x81);
+        ASSERT_EQ((unsigned char)rawFrame[1], 0x80 | 5);
+        string payload = rawFrame.substr(6);
+        websocket_frame::apply_mask(&payload[0], payload.size(), &rawFrame[2]);
+        ASSERT_EQ(payload, "hello");
+
+        ASSERT_ANY_THROW(connect()->open_websocket(request()));
+
+        // Compressed both ways, within the window the server allows us
+        ws = connect()->open_websocket(request());
+        ASSERT_TRUE(ws->deflate_enabled());
+        ASSERT_EQ(ws->deflate_params().tx_window_bits, 12);
+        ASSERT_EQ(ws->deflate_params().rx_window_bits, 15);
+        string text;
+        for(int i = 0; text.size() < 200000; i++)
+            text += to_string(i) + " bottles of beer on the wall\n";
+        for(auto &msg : { string("hi"), text, string("bye") }) {
+            ws->send(chunk(msg));
+            ASSERT_EQ(ws->read().to_string(), msg);
+        }
+        ws->close();
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketHub) {
+    websocket_hub hub;
+    int closed = 0;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket();
+        hub.subscribe("news", ws);
+        ws->send(chunk("welcome"));
+        try {
+            while(ws->poll())
+                ws->read();
+        }
+        catch(runtime_error &ex) {}
+        hub.unsubscribe(ws);
+        closed++;
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        P<stream> clients[2];
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+        for(int i = 0; i < 2; i++) {
+            auto client = make_shared<tcp_stream>();
+            client->connect("127.0.0.1", TEST_BIND_PORT);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("upgrade", "websocket");
+            req->set_header("host", "localhost");
+            req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+            if(i == 1)
+                req->set_header("sec-websocket-extensions", "permessage-deflate");
+            req->set_resource("/");
+            client->write(req);
+            ASSERT_EQ(client->read<http_response>(make_shared<http_response::decoder>())->code(), 101);
+            ASSERT_EQ(client->read<websocket_frame>(dec)->opcode(), 1); // Welcome
+            clients[i] = client;
+        }
+        ASSERT_EQ(hub.subscribers("news"), 2);
+
+        // Framed once, deflated once for the subscriber that asked for it
+        string text(1000, 'a');
+        ASSERT_EQ(hub.publish("news", text), 2);
+        auto plain = clients[0]->read<websocket_frame>(dec);
+        ASSERT_FALSE(plain->deflated());
+        ASSERT_EQ(plain->payload().to_string(), text);
+        auto packed = clients[1]->read<websocket_frame>(dec);
+        ASSERT_TRUE(packed->deflated());
+        ASSERT_LT(packed->payload().size(), text.size());
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -MAX_WBITS);
+        string inflated(text.size(), '\0');
+        string input = packed->payload().to_string() + string("\0\0\xff\xff", 4);
+        zs.next_in = (Bytef *)&input[0];
+        zs.avail_in = input.size();
+        zs.next_out = (Bytef *)&inflated[0];
+        zs.avail_out = inflated.size();
+        inflate(&zs, Z_SYNC_FLUSH);
+        inflateEnd(&zs);
+        ASSERT_EQ(inflated, text);
+
+        // Clients not reading: once the socket is full, messages are dropped
+        string noise(0xc000, '\0');
+        for(auto &c : noise)
+            c = (char)rand();
+        hub.set_max_queued(0x10000);
+        int published = 0;
+        while(published < 4096 && hub.publish("news", noise, true) == 2)
+            published++;
+        ASSERT_LT(published, 4096);
+        ASSERT_EQ(hub.subscribers("news"), 2);
+
+        // Or the subscribers get disconnected
+        hub.set_slow_policy(websocket_hub::DISCONNECT);
+        for(int i = 0; i < 4096 && hub.subscribers("news") > 0; i++)
+            hub.publish("news", noise, true);
+        ASSERT_EQ(hub.subscribers("news"), 0);
+        ASSERT_EQ(closed, 2);
+        for(int i = 0; i < 2; i++) { // What was queued still arrives, then the end
+            ASSERT_ANY_THROW({
+                while(true)
+                    clients[i]->read<websocket_frame>(dec);
+            });
+        }
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketHubClientSubscriber) {
+    websocket_hub hub;
+    string rawFrame;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        string key = tx->request->header("sec-websocket-key").substr(0) + http_transaction::WEBSOCKET_MAGIC;
+        unsigned char sha[SHA_DIGEST_LENGTH];
+        SHA1((unsigned char *)key.data(), key.size(), sha);
+        auto resp = tx->get_response(101);
+        resp->set_header("upgrade", "WebSocket");
+        resp->set_header("sec-websocket-accept", base64_encode(sha, SHA_DIGEST_LENGTH));
+        auto strm = tx->upgrade();
+        while(rawFrame.size() < 11)
+            rawFrame += strm->read<string_message>(make_shared<string_decoder>())->str().to_string();
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto conn = make_shared<tcp_stream>();
+        conn->connect("127.0.0.1", TEST_BIND_PORT);
+        auto req = make_shared<http_request>();
+        req->set_header("host", "localhost");
+        req->set_resource("/");
+        auto ws = make_shared<http_client>(conn)->open_websocket(req);
+        hub.subscribe("news", ws);
+
+        // A client subscriber masks what the hub sends through it
+        ASSERT_EQ(hub.publish("news", string("hello")), 1);
+        while(rawFrame.size() < 11)
+            sleep_fiber(1);
+        ASSERT_EQ((unsigned char)rawFrame[0], 0x81);
+        ASSERT_EQ((unsigned char)rawFrame[1], 0x80 | 5);
+        string payload = rawFrame.substr(6);
+        websocket_frame::apply_mask(&payload[0], payload.size(), &rawFrame[2]);
+        ASSERT_EQ(payload, "hello");
+        hub.unsubscribe(ws);
+        ws->close();
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}
+
+TEST(IO, WebSocketHubFragmented) {
+    websocket_hub hub;
+    string big(0x400000, '\0');
+    for(auto &c : big)
+        c = (char)rand();
+    int sending = 0, sent = 0;
+    http_server server(make_shared<lambda_service>([&] (http_trx &tx) {
+        auto ws = tx->accept_websocket();
+        hub.subscribe("news", ws);
+        sending++;
+        ws->send_some(chunk(big.data(), big.size()), true, true); // Fragmented, yields while the client is not reading
+        sent++;
+        try {
+            while(ws->poll())
+                ws->read();
+        }
+        catch(runtime_error &ex) {}
+        hub.unsubscribe(ws);
+    }));
+    server.listen("127.0.0.1", TEST_BIND_PORT);
+
+    bool checkpoint_finished = false;
+    fiber::launch([&] () {
+        auto dec = make_shared<websocket_frame::decoder>(0x100000);
+        for(int i = 0; i < 2; i++) {
+            auto client = make_shared<tcp_stream>();
+            client->connect("127.0.0.1", TEST_BIND_PORT);
+            auto req = make_shared<http_request>();
+            req->method = "GET";
+            req->set_header("upgrade", "websocket");
+            req->set_header("host", "localhost");
+            req->set_header("sec-websocket-key", "dGhlIHNhbXBsZSBub25jZQ==");
+            if(i == 1)
+                req->set_header("sec-websocket-extensions", "permessage-deflate");
+            req->set_resource("/");
+            client->write(req);
+            ASSERT_EQ(client->read<http_response>(make_shared<http_response::decoder>())->code(), 101);
+            while(sending == i)
+                sleep_fiber(1);
+            sleep_fiber(20);
+            ASSERT_EQ(sent, i);
+
+            // Published while the big message is half sent, it comes after the last fragment
+            ASSERT_EQ(hub.publish("news", string("hello")), 1);
+            size_t received = 0;
+            auto frame = client->read<websocket_frame>(dec);
+            ASSERT_EQ(frame->opcode(), 2);
+            ASSERT_EQ(frame->deflated(), i == 1);
+            while(!frame->fin()) {
+                received += frame->payload().size();
+                frame = client->read<websocket_frame>(dec);
+                ASSERT_EQ(frame->opcode(), 0);
+            }
+            received += frame->payload().size();
+            if(i == 0) {
+                ASSERT_EQ(received, big.size());
+            }
+            frame = client->read<websocket_frame>(dec);
+            ASSERT_EQ(frame->opcode(), 1);
+            ASSERT_TRUE(frame->fin());
+            if(i == 0) {
+                ASSERT_EQ(frame->payload().to_string(), "hello");
+            }
+            else {
+                ASSERT_TRUE(frame->deflated());
+                z_stream zs;
+                memset(&zs, 0, sizeof(zs));
+                inflateInit2(&zs, -MAX_WBITS);
+                char inflated[16];
+                string input = frame->payload().to_string() + string("\0\0\xff\xff", 4);
+                zs.next_in = (Bytef *)&input[0];
+                zs.avail_in = input.size();
+                zs.next_out = (Bytef *)inflated;
+                zs.avail_out = sizeof(inflated);
+                inflate(&zs, Z_SYNC_FLUSH);
+                inflateEnd(&zs);
+                ASSERT_EQ(string(inflated, sizeof(inflated) - zs.avail_out), "hello");
+            }
+            while(sent == i)
+                sleep_fiber(1);
+            client->shutdown();
+            ASSERT_ANY_THROW({
+                while(true)
+                    client->read<websocket_frame>(dec);
+            });
+            while(hub.subscribers("news") > 0)
+                sleep_fiber(1);
+        }
+
+        uv_stop(uv_default_loop());
+        checkpoint_finished = true;
+    });
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_TRUE(checkpoint_finished);
+    uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+}